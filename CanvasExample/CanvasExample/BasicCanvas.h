@@ -0,0 +1,323 @@
+// Copyright 2019 Shao Voon Wong
+// No warranties expressed or implied
+// use it at your risk!
+
+#pragma once
+#include "NullCanvas.h"
+#include "RecordingCanvas.h"
+#include <utility>
+
+namespace canvas
+{
+	// Front end of the drawing API that the backends share: Canvas (cairo, or the
+	// browser under Emscripten), RecordingCanvas and NullCanvas. Every call is an
+	// inline forward to the Backend, so it compiles down to a direct call, and
+	// drawing code written against BasicCanvas compiles for every backend.
+	// Code that touches the pixels of an ImageData finds the channels with
+	// ImageData::layout(), which differs between the backends. Queries and the
+	// calls of one backend only are made on backend().
+	template<typename Backend>
+	class BasicCanvas
+	{
+	private:
+		// declared first, the properties refer to it
+		Backend m_Backend;
+
+	public:
+		// args are those of the Backend constructor
+		template<typename... Args>
+		explicit BasicCanvas(Args&&... args)
+			: m_Backend(std::forward<Args>(args)...)
+			, fillStyle(m_Backend.fillStyle)
+			, strokeStyle(m_Backend.strokeStyle)
+			, font(m_Backend.font)
+			, fontFeatures(m_Backend.fontFeatures)
+			, lineCap(m_Backend.lineCap)
+			, lineJoin(m_Backend.lineJoin)
+			, lineWidth(m_Backend.lineWidth)
+			, miterLimit(m_Backend.miterLimit)
+			, globalCompositeOperation(m_Backend.globalCompositeOperation)
+			, shadowOffsetX(m_Backend.shadowOffsetX)
+			, shadowOffsetY(m_Backend.shadowOffsetY)
+			, shadowColor(m_Backend.shadowColor)
+			, shadowBlur(m_Backend.shadowBlur)
+			, textRenderMode(m_Backend.textRenderMode)
+			, pointRenderMode(m_Backend.pointRenderMode)
+			, textAlign(m_Backend.textAlign)
+			, textBaseline(m_Backend.textBaseline)
+		{
+		}
+
+		Backend& backend()
+		{
+			return m_Backend;
+		}
+		const Backend& backend() const
+		{
+			return m_Backend;
+		}
+
+		void fillRect(double x, double y, double width, double height)
+		{
+			m_Backend.fillRect(x, y, width, height);
+		}
+
+		void clearRect(double x, double y, double width, double height)
+		{
+			m_Backend.clearRect(x, y, width, height);
+		}
+
+		void strokeRect(double x, double y, double width, double height)
+		{
+			m_Backend.strokeRect(x, y, width, height);
+		}
+
+		void fillText(const char* text, double x, double y)
+		{
+			m_Backend.fillText(text, x, y);
+		}
+
+		void strokeText(const char* text, double x, double y)
+		{
+			m_Backend.strokeText(text, x, y);
+		}
+
+		void fillTextBatch(const TextItem* items, size_t count)
+		{
+			m_Backend.fillTextBatch(items, count);
+		}
+
+		void fillTextBatch(const std::vector<TextItem>& items)
+		{
+			m_Backend.fillTextBatch(items);
+		}
+
+		void strokeTextBatch(const TextItem* items, size_t count)
+		{
+			m_Backend.strokeTextBatch(items, count);
+		}
+
+		void strokeTextBatch(const std::vector<TextItem>& items)
+		{
+			m_Backend.strokeTextBatch(items);
+		}
+
+		void fillTextBox(const char* text, double x, double y, double maxWidth, double lineHeight, TextAlign align)
+		{
+			m_Backend.fillTextBox(text, x, y, maxWidth, lineHeight, align);
+		}
+
+		void fillRects(const Rect* rects, size_t count, const unsigned int* colors = nullptr)
+		{
+			m_Backend.fillRects(rects, count, colors);
+		}
+
+		void fillRects(const std::vector<Rect>& rects)
+		{
+			m_Backend.fillRects(rects);
+		}
+
+		void fillRects(const std::vector<Rect>& rects, const std::vector<unsigned int>& colors)
+		{
+			m_Backend.fillRects(rects, colors);
+		}
+
+		void strokeSegments(const Line* lines, size_t count, const unsigned int* colors = nullptr)
+		{
+			m_Backend.strokeSegments(lines, count, colors);
+		}
+
+		void strokeSegments(const std::vector<Line>& lines)
+		{
+			m_Backend.strokeSegments(lines);
+		}
+
+		void strokeSegments(const std::vector<Line>& lines, const std::vector<unsigned int>& colors)
+		{
+			m_Backend.strokeSegments(lines, colors);
+		}
+
+		void drawPoints(const Point* points, size_t count, double radius, PointShape shape, const unsigned int* colors = nullptr)
+		{
+			m_Backend.drawPoints(points, count, radius, shape, colors);
+		}
+
+		void drawPoints(const std::vector<Point>& points, double radius, PointShape shape)
+		{
+			m_Backend.drawPoints(points, radius, shape);
+		}
+
+		void drawPoints(const std::vector<Point>& points, double radius, PointShape shape, const std::vector<unsigned int>& colors)
+		{
+			m_Backend.drawPoints(points, radius, shape, colors);
+		}
+
+		void strokePolyline(const Point* points, size_t count, PolylineLod lod = PolylineLod::m4)
+		{
+			m_Backend.strokePolyline(points, count, lod);
+		}
+
+		void strokePolyline(const std::vector<Point>& points, PolylineLod lod = PolylineLod::m4)
+		{
+			m_Backend.strokePolyline(points, lod);
+		}
+
+		void strokePolyline(const PolylinePyramid& pyramid)
+		{
+			m_Backend.strokePolyline(pyramid);
+		}
+
+		void rect(double x, double y, double width, double height)
+		{
+			m_Backend.rect(x, y, width, height);
+		}
+
+		void beginPath()
+		{
+			m_Backend.beginPath();
+		}
+
+		void closePath()
+		{
+			m_Backend.closePath();
+		}
+
+		void moveTo(double x, double y)
+		{
+			m_Backend.moveTo(x, y);
+		}
+
+		void lineTo(double x, double y)
+		{
+			m_Backend.lineTo(x, y);
+		}
+
+		void bezierCurveTo(double cp1x, double cp1y, double cp2x, double cp2y, double endx, double endy)
+		{
+			m_Backend.bezierCurveTo(cp1x, cp1y, cp2x, cp2y, endx, endy);
+		}
+
+		void quadraticCurveTo(double cpx, double cpy, double endx, double endy)
+		{
+			m_Backend.quadraticCurveTo(cpx, cpy, endx, endy);
+		}
+
+		void arc(double xc, double yc, double radius, double angle1, double angle2)
+		{
+			m_Backend.arc(xc, yc, radius, angle1, angle2);
+		}
+
+		void clip()
+		{
+			m_Backend.clip();
+		}
+
+		void clip(Path2D& path)
+		{
+			m_Backend.clip(path);
+		}
+
+		void stroke()
+		{
+			m_Backend.stroke();
+		}
+
+		void stroke(Path2D& path)
+		{
+			m_Backend.stroke(path);
+		}
+
+		void fill()
+		{
+			m_Backend.fill();
+		}
+
+		void fill(Path2D& path)
+		{
+			m_Backend.fill(path);
+		}
+
+		void scale(double sx, double sy)
+		{
+			m_Backend.scale(sx, sy);
+		}
+
+		void translate(double tx, double ty)
+		{
+			m_Backend.translate(tx, ty);
+		}
+
+		void rotate(double angle)
+		{
+			m_Backend.rotate(angle);
+		}
+
+		void transform(double xx, double xy, double yx, double yy, double x0, double y0)
+		{
+			m_Backend.transform(xx, xy, yx, yy, x0, y0);
+		}
+
+		void setTransform(double xx, double xy, double yx, double yy, double x0, double y0)
+		{
+			m_Backend.setTransform(xx, xy, yx, yy, x0, y0);
+		}
+
+		void drawImage(const char* image_file, double x0, double y0)
+		{
+			m_Backend.drawImage(image_file, x0, y0);
+		}
+
+		void drawCanvas(const Canvas& src, double x, double y)
+		{
+			m_Backend.drawCanvas(src, x, y);
+		}
+
+		void drawCanvas(const Canvas& src, double x, double y, double width, double height)
+		{
+			m_Backend.drawCanvas(src, x, y, width, height);
+		}
+
+		void drawCanvas(const Canvas& src, double sx, double sy, double sw, double sh,
+			double dx, double dy, double dw, double dh)
+		{
+			m_Backend.drawCanvas(src, sx, sy, sw, sh, dx, dy, dw, dh);
+		}
+
+		void putImageData(ImageData& imgData, int x, int y, int dirtyX = 0, int dirtyY = 0, int dirtyWidth = 0, int dirtyHeight = 0)
+		{
+			m_Backend.putImageData(imgData, x, y, dirtyX, dirtyY, dirtyWidth, dirtyHeight);
+		}
+
+		void save()
+		{
+			m_Backend.save();
+		}
+
+		void restore()
+		{
+			m_Backend.restore();
+		}
+
+		decltype(Backend::fillStyle)& fillStyle;
+		decltype(Backend::strokeStyle)& strokeStyle;
+		decltype(Backend::font)& font;
+		decltype(Backend::fontFeatures)& fontFeatures;
+		decltype(Backend::lineCap)& lineCap;
+		decltype(Backend::lineJoin)& lineJoin;
+		decltype(Backend::lineWidth)& lineWidth;
+		decltype(Backend::miterLimit)& miterLimit;
+		decltype(Backend::globalCompositeOperation)& globalCompositeOperation;
+		decltype(Backend::shadowOffsetX)& shadowOffsetX;
+		decltype(Backend::shadowOffsetY)& shadowOffsetY;
+		decltype(Backend::shadowColor)& shadowColor;
+		decltype(Backend::shadowBlur)& shadowBlur;
+		decltype(Backend::textRenderMode)& textRenderMode;
+		decltype(Backend::pointRenderMode)& pointRenderMode;
+		decltype(Backend::textAlign)& textAlign;
+		decltype(Backend::textBaseline)& textBaseline;
+	private:
+		// remove copy constructor and assignment operator
+		BasicCanvas(const BasicCanvas& other) = delete;
+		void operator=(const BasicCanvas& other) = delete;
+	};
+}
@@ -0,0 +1,494 @@
+// Copyright 2019 Shao Voon Wong
+// No warranties expressed or implied
+// use it at your risk!
+
+// Enums, structs and helpers shared by CppCanvas.h and JsCanvas.h, so that
+// the backends agree on them
+
+#pragma once
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdio>
+#include <cstddef>
+#include <algorithm>
+
+namespace canvas
+{
+	enum class LineCap
+	{
+		butt,
+		round,
+		square
+	};
+
+	enum class LineJoin
+	{
+		miter,
+		round,
+		bevel
+	};
+
+	unsigned int fromRGB(unsigned char r, unsigned char g, unsigned char b)
+	{
+		return (unsigned int)((r << 16) | (g << 8) | b);
+	}
+
+	enum class RepeatPattern
+	{
+		repeat,
+		no_repeat
+	};
+
+	enum class GlobalCompositeOperationType
+	{
+		source_over,
+		source_atop,
+		source_in,
+		source_out,
+		destination_over,
+		destination_atop,
+		destination_in,
+		destination_out,
+		lighter,
+		copy,
+		exclusive_or,
+	};
+
+	enum class TextAlign
+	{
+		start,
+		end,
+		left,
+		right,
+		center
+	};
+
+	enum class TextBaseline
+	{
+		top,
+		hanging,
+		middle,
+		alphabetic,
+		ideographic,
+		bottom
+	};
+
+	struct TextMetrics
+	{
+		double width;
+	};
+
+	struct TextItem
+	{
+		const char* text;
+		double x;
+		double y;
+		bool hasColor; // draw with color instead of the current style
+		unsigned int color;
+	};
+
+	struct Rect
+	{
+		double x;
+		double y;
+		double width;
+		double height;
+	};
+
+	struct Point
+	{
+		double x;
+		double y;
+	};
+
+	struct Line
+	{
+		double x0;
+		double y0;
+		double x1;
+		double y1;
+	};
+
+	// Where the channels of a pixel are in ImageData::data(), which differs
+	// between the backends, so that per-pixel code can be written once
+	struct PixelLayout
+	{
+		int red; // byte offsets in the 4 bytes of a pixel
+		int green;
+		int blue;
+		int alpha;
+		bool premultiplied; // the color channels are already scaled by alpha
+	};
+
+	enum class PointShape
+	{
+		circle,
+		square
+	};
+
+	enum class PolylineLod
+	{
+		none,
+		m4
+	};
+
+	// Lowest and highest y of blocks of a polyline whose x never decreases, in
+	// levels of doubling block size, so that a pixel column of a zoomed out
+	// series is summarized without visiting all of its points. The points are
+	// not copied and must outlive the pyramid.
+	class PolylinePyramid
+	{
+	public:
+		static const size_t BlockSize = 64;
+
+		PolylinePyramid(const Point* points, size_t count)
+			: m_Points(points), m_Count(count)
+		{
+			size_t blocks = count / BlockSize;
+			if (blocks == 0)
+				return;
+
+			m_Levels.push_back(std::vector<Extrema>(blocks));
+			for (size_t b = 0; b < blocks; ++b)
+			{
+				Extrema& e = m_Levels[0][b];
+				e.low = e.high = b * BlockSize;
+				for (size_t i = b * BlockSize + 1; i < (b + 1) * BlockSize; ++i)
+					addPoint(e, i);
+			}
+			while (m_Levels.back().size() > 1)
+			{
+				const std::vector<Extrema>& lower = m_Levels.back();
+				std::vector<Extrema> level(lower.size() / 2);
+				for (size_t b = 0; b < level.size(); ++b)
+				{
+					level[b] = lower[2 * b];
+					addPoint(level[b], lower[2 * b + 1].low);
+					addPoint(level[b], lower[2 * b + 1].high);
+				}
+				m_Levels.push_back(level);
+			}
+		}
+
+		const Point* data() const
+		{
+			return m_Points;
+		}
+		size_t size() const
+		{
+			return m_Count;
+		}
+
+		// Indices of the lowest and highest y in [begin, end), which must not be empty
+		void findExtrema(size_t begin, size_t end, size_t& low, size_t& high) const
+		{
+			Extrema e = { begin, begin };
+			size_t i = begin + 1;
+			while (i < end)
+			{
+				// the largest aligned block that fits, or a single point
+				int level = (int)m_Levels.size() - 1;
+				while (level >= 0 && (i % (BlockSize << level) != 0 || i + (BlockSize << level) > end))
+					--level;
+				if (level < 0)
+				{
+					addPoint(e, i);
+					++i;
+					continue;
+				}
+				const Extrema& block = m_Levels[level][i / (BlockSize << level)];
+				addPoint(e, block.low);
+				addPoint(e, block.high);
+				i += BlockSize << level;
+			}
+			low = e.low;
+			high = e.high;
+		}
+
+	private:
+		// remove copy constructor and assignment operator
+		PolylinePyramid(const PolylinePyramid& other) = delete;
+		void operator=(const PolylinePyramid& other) = delete;
+
+		struct Extrema
+		{
+			size_t low;
+			size_t high;
+		};
+
+		void addPoint(Extrema& e, size_t i) const
+		{
+			if (m_Points[i].y < m_Points[e.low].y)
+				e.low = i;
+			if (m_Points[i].y > m_Points[e.high].y)
+				e.high = i;
+		}
+
+		const Point* m_Points;
+		size_t m_Count;
+		std::vector<std::vector<Extrema> > m_Levels;
+	};
+
+	// Appends the first, lowest, highest and last point of a run in index order
+	inline void addPolylineRun(const Point* points, size_t first, size_t low, size_t high, size_t last, std::vector<Point>& out)
+	{
+		size_t run[4] = { first, (low < high) ? low : high, (low < high) ? high : low, last };
+		for (int k = 0; k < 4; ++k)
+		{
+			if (k == 0 || run[k] != run[k - 1])
+				out.push_back(points[run[k]]);
+		}
+	}
+
+	// M4 decimation: keeps the first, lowest, highest and last point of every run
+	// of consecutive points that fall in one device pixel column, which strokes the
+	// same pixels as the whole polyline. mat is xx, yx, xy, yy, x0, y0 as in cairo.
+	inline void decimatePolyline(const Point* points, size_t count, const double mat[6], std::vector<Point>& out)
+	{
+		if (count == 0)
+			return;
+
+		size_t first = 0, low = 0, high = 0;
+		double column = floor(mat[0] * points[0].x + mat[2] * points[0].y + mat[4]);
+		double low_y = mat[1] * points[0].x + mat[3] * points[0].y + mat[5];
+		double high_y = low_y;
+		for (size_t i = 1; i < count; ++i)
+		{
+			double x = points[i].x;
+			double y = points[i].y;
+			double c = floor(mat[0] * x + mat[2] * y + mat[4]);
+			double dy = mat[1] * x + mat[3] * y + mat[5];
+			if (c != column)
+			{
+				addPolylineRun(points, first, low, high, i - 1, out);
+				first = low = high = i;
+				column = c;
+				low_y = high_y = dy;
+				continue;
+			}
+			if (dy < low_y)
+			{
+				low_y = dy;
+				low = i;
+			}
+			if (dy > high_y)
+			{
+				high_y = dy;
+				high = i;
+			}
+		}
+		addPolylineRun(points, first, low, high, count - 1, out);
+	}
+
+	// M4 decimation of the device columns [visible_x0, visible_x1) through the
+	// pyramid. Without scale or translation only in x and y, every point is visited.
+	inline void decimatePolyline(const PolylinePyramid& pyramid, const double mat[6],
+		double visible_x0, double visible_x1, std::vector<Point>& out)
+	{
+		const Point* points = pyramid.data();
+		size_t count = pyramid.size();
+		if (mat[0] <= 0.0 || mat[1] != 0.0 || mat[2] != 0.0)
+		{
+			decimatePolyline(points, count, mat, out);
+			return;
+		}
+
+		// the device x of the points never decreases
+		const double xx = mat[0];
+		const double x0 = mat[4];
+		auto column_below = [&](const Point& pt, double column) { return xx * pt.x + x0 < column; };
+		size_t begin = std::lower_bound(points, points + count, visible_x0, column_below) - points;
+		size_t end = std::lower_bound(points, points + count, visible_x1, column_below) - points;
+		// keep the segments that cross into the visible columns
+		if (begin > 0)
+			--begin;
+		if (end < count)
+			++end;
+
+		size_t i = begin;
+		while (i < end)
+		{
+			double column = floor(xx * points[i].x + x0);
+			size_t next = std::lower_bound(points + i, points + end, column + 1.0, column_below) - points;
+			size_t low = i, high = i;
+			pyramid.findExtrema(i, next, low, high);
+			addPolylineRun(points, i, low, high, next - 1, out);
+			i = next;
+		}
+	}
+
+	// Line breaks of a paragraph for one font and wrap width
+	struct TextLayout
+	{
+		std::vector<std::string> lines;
+		std::vector<double> widths;
+	};
+
+	class TextLayoutCache
+	{
+	public:
+		static const size_t MaxLayouts = 1024;
+
+		TextLayoutCache() {}
+
+		// Returns nullptr if the layout has not been cached yet
+		TextLayout* find(const char* font_key, const char* features, double max_width, const char* text)
+		{
+			makeKey(font_key, features, max_width, text);
+			auto it = m_Layouts.find(m_Key);
+			return (it != m_Layouts.end()) ? &it->second : nullptr;
+		}
+
+		// Adds an empty layout under the key of the last find()
+		TextLayout& add()
+		{
+			if (m_Layouts.size() >= MaxLayouts)
+				m_Layouts.clear();
+
+			return m_Layouts[m_Key];
+		}
+
+	private:
+		// remove copy constructor and assignment operator
+		TextLayoutCache(const TextLayoutCache& other) = delete;
+		void operator=(const TextLayoutCache& other) = delete;
+
+		void makeKey(const char* font_key, const char* features, double max_width, const char* text)
+		{
+			char width_str[32];
+			snprintf(width_str, sizeof(width_str), "%g", max_width);
+			m_Key = font_key;
+			m_Key += '\n';
+			m_Key += features;
+			m_Key += '\n';
+			m_Key += width_str;
+			m_Key += '\n';
+			m_Key += text;
+		}
+
+		std::unordered_map<std::string, TextLayout> m_Layouts;
+		std::string m_Key;
+	};
+
+	enum class TextRenderMode
+	{
+		cairo,
+		glyph_atlas
+	};
+
+	// JsCanvas keeps the mode only for API compatibility, the browser caches glyphs itself.
+	class TextRenderModeProperty
+	{
+	public:
+		TextRenderModeProperty() : m_Mode(TextRenderMode::cairo) {}
+
+		void operator=(TextRenderMode mode)
+		{
+			m_Mode = mode;
+		}
+
+		operator TextRenderMode()
+		{
+			return m_Mode;
+		}
+
+	private:
+		// remove copy constructor and assignment operator
+		TextRenderModeProperty(const TextRenderModeProperty& other) = delete;
+		void operator=(const TextRenderModeProperty& other) = delete;
+
+		TextRenderMode m_Mode;
+	};
+
+	enum class PointRenderMode
+	{
+		cairo,
+		sprite
+	};
+
+	// JsCanvas keeps the mode only for API compatibility, the browser draws the points itself.
+	class PointRenderModeProperty
+	{
+	public:
+		PointRenderModeProperty() : m_Mode(PointRenderMode::cairo) {}
+
+		void operator=(PointRenderMode mode)
+		{
+			m_Mode = mode;
+		}
+
+		operator PointRenderMode()
+		{
+			return m_Mode;
+		}
+
+	private:
+		// remove copy constructor and assignment operator
+		PointRenderModeProperty(const PointRenderModeProperty& other) = delete;
+		void operator=(const PointRenderModeProperty& other) = delete;
+
+		PointRenderMode m_Mode;
+	};
+
+	enum class HeatmapFilter
+	{
+		nearest,
+		bilinear
+	};
+
+	// 256 opaque colors sampled evenly along a gradient of 0xRRGGBB stops
+	class Colormap
+	{
+	public:
+		static const int Size = 256;
+
+		Colormap(const unsigned int* stops, size_t count)
+		{
+			for (int i = 0; i < Size; ++i)
+			{
+				unsigned int color = 0;
+				if (count == 1)
+					color = stops[0];
+				else if (count > 1)
+				{
+					double t = (double)i / (Size - 1) * (count - 1);
+					size_t s = (size_t)t;
+					if (s > count - 2)
+						s = count - 2;
+					double f = t - s;
+					for (int shift = 0; shift < 24; shift += 8)
+					{
+						double a = (stops[s] >> shift) & 0xff;
+						double b = (stops[s + 1] >> shift) & 0xff;
+						color |= (unsigned int)(a + (b - a) * f + 0.5) << shift;
+					}
+				}
+				m_Colors[i] = 0xff000000 | (color & 0xffffff);
+			}
+		}
+		Colormap(const std::vector<unsigned int>& stops)
+			: Colormap(stops.data(), stops.size()) {}
+
+		static Colormap gray()
+		{
+			const unsigned int stops[] = { 0x000000, 0xffffff };
+			return Colormap(stops, 2);
+		}
+		static Colormap viridis()
+		{
+			const unsigned int stops[] = { 0x440154, 0x482878, 0x3e4989, 0x31688e, 0x26828e,
+				0x1f9e89, 0x35b779, 0x6ece58, 0xb5de2b, 0xfde725 };
+			return Colormap(stops, 10);
+		}
+
+		// ARGB32, opaque so premultiplied as well
+		const unsigned int* data() const
+		{
+			return m_Colors;
+		}
+	private:
+		unsigned int m_Colors[Size];
+	};
+}
@@ -3,12 +3,24 @@
 // use it at your risk!
 
 #include <iostream>
+#include <chrono>
+#include <string>
+#include <vector>
 
-#ifdef __EMSCRIPTEN__
+// With CANVAS_SOFTWARE_RENDERER, the Emscripten build draws with cairo inside
+// the module and present() copies the surface to the canvas element
+#if defined(__EMSCRIPTEN__) && !defined(CANVAS_SOFTWARE_RENDERER)
 	#include "JsCanvas.h"
 #else
 	#include "CppCanvas.h"
 #endif
+#ifndef __EMSCRIPTEN__
+	#include "TileRenderer.h"
+#else
+	#include <emscripten/html5.h>
+#endif
+#include "RecordingCanvas.h"
+#include "BasicCanvas.h"
 
 
 // Display text with fillText()
@@ -84,6 +96,101 @@ void displayTextOutline()
 	ctx.savePng("c:\\temp\\displayTextOutline.png");
 }
 
+// Align text around an anchor with textAlign and textBaseline
+void alignText()
+{
+	using namespace canvas;
+
+	Canvas ctx("canvas", 320, 280);
+
+	ctx.strokeStyle = "red";
+	ctx.beginPath();
+	ctx.moveTo(160, 20);
+	ctx.lineTo(160, 260);
+	ctx.moveTo(20, 140);
+	ctx.lineTo(300, 140);
+	ctx.stroke();
+
+	ctx.font = "20px Georgia";
+	ctx.textAlign = TextAlign::center;
+	ctx.textBaseline = TextBaseline::middle;
+	ctx.fillText("Centred", 160, 140);
+
+	ctx.textAlign = "right";
+	ctx.textBaseline = "top";
+	ctx.fillText("Top right", 160, 40);
+
+	TextMetrics tm = ctx.measureText("Top right");
+	std::cout << "measureText width: " << tm.width << "\n";
+
+	ctx.savePng("c:\\temp\\alignText.png");
+}
+
+// Draw a table of labels with one batched call
+void textBatch()
+{
+	using namespace canvas;
+
+	Canvas ctx("canvas", 320, 280);
+
+	ctx.font = "14px Verdana";
+	ctx.shadowOffsetX = 1;
+	ctx.shadowOffsetY = 1;
+	ctx.shadowColor = "rgba(0,0,0,0.5)";
+
+	std::vector<std::string> labels;
+	for (int row = 0; row < 10; ++row)
+		labels.push_back("Row " + std::to_string(row + 1));
+
+	std::vector<TextItem> items;
+	for (int row = 0; row < 10; ++row)
+	{
+		TextItem item = { labels[row].c_str(), 20.0, 30.0 + row * 24.0, (row % 2) == 1, fromRGB(200, 0, 0) };
+		items.push_back(item);
+	}
+	ctx.fillTextBatch(items);
+
+	ctx.savePng("c:\\temp\\textBatch.png");
+}
+
+// Shape text from a font file (needs CANVAS_USE_HARFBUZZ with CppCanvas)
+void shapedText()
+{
+	using namespace canvas;
+
+#if defined(__EMSCRIPTEN__) && (defined(CANVAS_USE_HARFBUZZ) || !defined(CANVAS_SOFTWARE_RENDERER))
+	loadFontFile("Noto Sans", "NotoSans-Regular.ttf");
+#elif defined(CANVAS_USE_HARFBUZZ)
+	loadFontFile("Noto Sans", "C:\\Windows\\Fonts\\NotoSans-Regular.ttf");
+#endif
+
+	Canvas ctx("canvas", 320, 280);
+
+	ctx.font = "24px Noto Sans";
+	ctx.fontFeatures = "kern,liga";
+	ctx.fillText("office affine AVATAR", 10, 50);
+
+	ctx.savePng("c:\\temp\\shapedText.png");
+}
+
+// Wrapped Text
+void textBox()
+{
+	using namespace canvas;
+
+	Canvas ctx("canvas", 320, 280);
+
+	ctx.font = "16px Arial";
+	ctx.fillStyle = 0x0000ff;
+	Rect box = ctx.fillTextBox("The quick brown fox jumps over the lazy dog.\nPack my box with five dozen liquor jugs.",
+		20, 30, 200, 22, TextAlign::center);
+
+	ctx.strokeStyle = 0xff0000;
+	ctx.strokeRect(box.x, box.y, box.width, box.height);
+
+	ctx.savePng("c:\\temp\\textBox.png");
+}
+
 // Display Image
 void displayImage()
 {
@@ -91,8 +198,10 @@ void displayImage()
 
 	Canvas ctx("canvas", 320, 280);
 
-#ifdef __EMSCRIPTEN__
+#if defined(__EMSCRIPTEN__) && !defined(CANVAS_SOFTWARE_RENDERER)
 	ctx.drawImage("yes_image", 10.0, 10.0);
+#elif defined(__EMSCRIPTEN__)
+	ctx.drawImage("yes.jpg", 10.0, 10.0);
 #else
 	ctx.drawImage("C:\\Users\\shaov\\Pictures\\yes.jpg", 10.0, 10.0);
 #endif
@@ -198,13 +307,37 @@ void saveRestore()
 	ctx.savePng("c:\\temp\\saveRestore.png");
 }
 
+// The font and alignment set between save() and restore() are gone after
+// restore(): the first and the last line are both 20px, right aligned at x = 300
+void saveRestoreFont()
+{
+	using namespace canvas;
+
+	Canvas ctx("canvas", 320, 280);
+	ctx.font = "20px Arial";
+	ctx.textAlign = "right";
+	ctx.fillText("before save", 300, 50);
+
+	ctx.save();
+	ctx.font = "40px Arial";
+	ctx.textAlign = "left";
+	ctx.fillText("saved", 10, 120);
+	ctx.restore();
+
+	ctx.fillText("after restore", 300, 190);
+
+	ctx.savePng("c:\\temp\\saveRestoreFont.png");
+}
+
 void repeatPattern()
 {
 	using namespace canvas;
 
 	Canvas ctx("canvas", 320, 280);
-#ifdef __EMSCRIPTEN__
+#if defined(__EMSCRIPTEN__) && !defined(CANVAS_SOFTWARE_RENDERER)
 	auto pat = ctx.createPattern("pat", "lamp", RepeatPattern::repeat);
+#elif defined(__EMSCRIPTEN__)
+	auto pat = ctx.createPattern("pat", "img_lamp.jpg", RepeatPattern::repeat);
 #else
 	auto pat = ctx.createPattern("pat", "D:\\GitHub\\html5_canvas_cpp\\CanvasExample\\WebApplication1\\img_lamp.jpg", RepeatPattern::repeat);
 #endif
@@ -250,6 +383,91 @@ void pointInPath()
 	ctx.savePng("c:\\temp\\pointInPath.png");
 }
 
+// Reusable Path
+void reusePath2D()
+{
+	using namespace canvas;
+
+	Canvas ctx("canvas", 320, 280);
+
+	Path2D heart("heart");
+	heart.moveTo(0, 10);
+	heart.bezierCurveTo(0, -5, -20, -5, -20, 10);
+	heart.bezierCurveTo(-20, 20, 0, 30, 0, 40);
+	heart.bezierCurveTo(0, 30, 20, 20, 20, 10);
+	heart.bezierCurveTo(20, -5, 0, -5, 0, 10);
+	heart.closePath();
+
+	ctx.fillStyle = 0xff0000;
+	for (int i = 0; i < 6; ++i)
+	{
+		ctx.save();
+		ctx.translate(40 + i * 45, 60 + (i % 2) * 60);
+		ctx.fill(heart);
+		ctx.restore();
+	}
+
+	ctx.setTransform(1, 0, 0, 1, 0, 0);
+	if (ctx.isPointInPath(heart, 0, 20))
+		ctx.stroke(heart);
+
+	ctx.savePng("c:\\temp\\reusePath2D.png");
+}
+
+// Record once, replay on a Canvas
+void recordReplay()
+{
+	using namespace canvas;
+
+	RecordingCanvas rec(320, 280);
+
+	rec.fillStyle = 0x00ff00;
+	rec.fillRect(10, 10, 100, 60);
+	rec.strokeStyle = "blue";
+	rec.lineWidth = 4.0;
+	rec.beginPath();
+	rec.moveTo(20, 120);
+	rec.quadraticCurveTo(150, 20, 280, 120);
+	rec.stroke();
+	rec.font = "20px Arial";
+	rec.fillStyle = "red";
+	rec.fillText("Recorded", 150, 200);
+
+	Canvas ctx("canvas", 320, 280);
+	rec.replay(ctx);
+
+	ctx.savePng("c:\\temp\\recordReplay.png");
+}
+
+// Only the gauge that changed is repainted and saved
+void dashboardDamage()
+{
+	using namespace canvas;
+
+	RetainedScene scene(320, 280);
+	for (int i = 0; i < 4; ++i)
+	{
+		RecordingCanvas& gauge = scene.add();
+		gauge.fillStyle = "lightgray";
+		gauge.fillRect(20 + i * 75, 40, 60, 200);
+		gauge.fillStyle = "blue";
+		gauge.fillRect(20 + i * 75, 140, 60, 100);
+	}
+
+	Canvas ctx("canvas", 320, 280);
+	scene.render(ctx);
+	ctx.takeDamage();
+
+	RecordingCanvas& gauge = scene.update(2);
+	gauge.fillStyle = "lightgray";
+	gauge.fillRect(170, 40, 60, 200);
+	gauge.fillStyle = "red";
+	gauge.fillRect(170, 80, 60, 160);
+	scene.render(ctx);
+
+	ctx.savePng("c:\\temp\\dashboardDamage.png", ctx.takeDamage());
+}
+
 void shadowFillRect()
 {
 	using namespace canvas;
@@ -290,8 +508,10 @@ void shadowFillArc()
 
 	Canvas ctx("canvas", 320, 280);
 
-#ifdef __EMSCRIPTEN__
+#if defined(__EMSCRIPTEN__) && !defined(CANVAS_SOFTWARE_RENDERER)
 	ctx.drawImage("yes_image", 10.0, 10.0);
+#elif defined(__EMSCRIPTEN__)
+	ctx.drawImage("yes.jpg", 10.0, 10.0);
 #else
 	ctx.drawImage("C:\\Users\\shaov\\Pictures\\yes.jpg", 10.0, 10.0);
 #endif
@@ -316,8 +536,10 @@ void shadowStrokeArc()
 
 	Canvas ctx("canvas", 320, 280);
 
-#ifdef __EMSCRIPTEN__
+#if defined(__EMSCRIPTEN__) && !defined(CANVAS_SOFTWARE_RENDERER)
 	ctx.drawImage("yes_image", 10.0, 10.0);
+#elif defined(__EMSCRIPTEN__)
+	ctx.drawImage("yes.jpg", 10.0, 10.0);
 #else
 	ctx.drawImage("C:\\Users\\shaov\\Pictures\\yes.jpg", 10.0, 10.0);
 #endif
@@ -359,8 +581,10 @@ void shadowFillBlur()
 
 	Canvas ctx("canvas", 320, 280);
 	/*
-#ifdef __EMSCRIPTEN__
+#if defined(__EMSCRIPTEN__) && !defined(CANVAS_SOFTWARE_RENDERER)
 	ctx.drawImage("yes_image", 10.0, 10.0);
+#elif defined(__EMSCRIPTEN__)
+	ctx.drawImage("yes.jpg", 10.0, 10.0);
 #else
 	ctx.drawImage("C:\\Users\\shaov\\Pictures\\yes.jpg", 10.0, 10.0);
 #endif
@@ -376,11 +600,589 @@ void shadowFillBlur()
 	ctx.savePng("c:\\temp\\shadowFillBlur.png");
 }
 
+// Time 50k short labels through cairo and through the glyph atlas
+void benchmarkFillText()
+{
+	using namespace canvas;
+
+	Canvas ctx("canvas", 1920, 1080);
+	ctx.font = "12px Verdana";
+
+	const int label_count = 50000;
+	char label[20];
+	TextRenderMode modes[] = { TextRenderMode::cairo, TextRenderMode::glyph_atlas };
+	const char* mode_names[] = { "cairo", "glyph_atlas" };
+	for (int m = 0; m < 2; ++m)
+	{
+		ctx.textRenderMode = modes[m];
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < label_count; ++i)
+		{
+			sprintf(label, "%d.%02d", i % 1000, i % 100);
+			ctx.fillText(label, (i * 37) % 1860, 12 + (i * 13) % 1060);
+		}
+		auto end = std::chrono::steady_clock::now();
+		std::cout << mode_names[m] << ": " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+	}
+
+	ctx.savePng("c:\\temp\\benchmarkFillText.png");
+}
+
+// Bar chart, scatter plot and grid lines drawn with the bulk calls
+void bulkPrimitives()
+{
+	using namespace canvas;
+
+	Canvas ctx("canvas", 320, 280);
+
+	std::vector<Rect> bars;
+	std::vector<unsigned int> bar_colors;
+	for (int i = 0; i < 12; ++i)
+	{
+		double height = 20 + (i * 37) % 200;
+		Rect bar = { 20.0 + i * 24, 250 - height, 16, height };
+		bars.push_back(bar);
+		bar_colors.push_back((i % 2) ? 0x4080c0 : 0xc04040);
+	}
+	ctx.fillRects(bars, bar_colors);
+
+	std::vector<Line> grid;
+	for (int y = 50; y <= 250; y += 50)
+	{
+		Line line = { 10, y + 0.5, 310, y + 0.5 };
+		grid.push_back(line);
+	}
+	ctx.strokeStyle = "gray";
+	ctx.lineWidth = 1.0;
+	ctx.strokeSegments(grid);
+
+	std::vector<Point> points;
+	for (int i = 0; i < 200; ++i)
+	{
+		Point pt = { 10.0 + (i * 7919) % 300, 10.0 + (i * 104729) % 240 };
+		points.push_back(pt);
+	}
+	ctx.fillStyle = "green";
+	ctx.drawPoints(points, 3.0, PointShape::circle);
+
+	ctx.savePng("c:\\temp\\bulkPrimitives.png");
+}
+
+// One fillRect per heatmap cell against one fillRects call
+void benchmarkFillRects()
+{
+	using namespace canvas;
+
+	const int size = 1000;
+	Canvas ctx("canvas", size, size);
+	std::vector<Rect> cells;
+	std::vector<unsigned int> colors;
+	for (int y = 0; y < size; ++y)
+	{
+		for (int x = 0; x < size; ++x)
+		{
+			Rect cell = { (double)x, (double)y, 1, 1 };
+			cells.push_back(cell);
+			colors.push_back(fromRGB((unsigned char)x, (unsigned char)y, 128));
+		}
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < cells.size(); ++i)
+	{
+		ctx.fillStyle = colors[i];
+		ctx.fillRect(cells[i].x, cells[i].y, cells[i].width, cells[i].height);
+	}
+	auto end = std::chrono::steady_clock::now();
+	std::cout << "fillRect: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+
+	start = std::chrono::steady_clock::now();
+	ctx.fillRects(cells, colors);
+	end = std::chrono::steady_clock::now();
+	std::cout << "fillRects: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+
+	ctx.savePng("c:\\temp\\benchmarkFillRects.png");
+}
+
+// Million point scatter plot drawn with cairo paths, then with point sprites
+void benchmarkScatter()
+{
+	using namespace canvas;
+
+	Canvas ctx("canvas", 1920, 1080);
+	std::vector<Point> points;
+	std::vector<unsigned char> indices;
+	for (int i = 0; i < 1000000; ++i)
+	{
+		Point pt = { (i * 7919 % 19190) / 10.0, (i * 104729 % 10790) / 10.0 };
+		points.push_back(pt);
+		indices.push_back((unsigned char)(i % 6));
+	}
+	std::vector<unsigned int> palette = { 0xe41a1c, 0x377eb8, 0x4daf4a, 0x984ea3, 0xff7f00, 0xa65628 };
+
+	PointRenderMode modes[] = { PointRenderMode::cairo, PointRenderMode::sprite };
+	const char* mode_names[] = { "cairo", "sprite" };
+	for (int m = 0; m < 2; ++m)
+	{
+		ctx.pointRenderMode = modes[m];
+		auto start = std::chrono::steady_clock::now();
+		ctx.drawPoints(points, 2.5, PointShape::circle, indices, palette);
+		auto end = std::chrono::steady_clock::now();
+		std::cout << mode_names[m] << ": " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+	}
+
+	ctx.savePng("c:\\temp\\benchmarkScatter.png");
+}
+
+// Ten million sample series stroked whole, decimated, and through a pyramid
+void benchmarkPolyline()
+{
+	using namespace canvas;
+
+	Canvas ctx("canvas", 2000, 600);
+	std::vector<Point> series(10000000);
+	double value = 0.0;
+	for (size_t i = 0; i < series.size(); ++i)
+	{
+		value += ((int)(i * 2654435761u % 2001) - 1000) / 1000.0;
+		series[i].x = (double)i;
+		series[i].y = value;
+	}
+	PolylinePyramid pyramid(series.data(), series.size());
+
+	ctx.strokeStyle = "blue";
+	ctx.lineWidth = 1.0;
+	ctx.translate(0, 300);
+	ctx.scale(2000.0 / series.size(), 0.1);
+
+	PolylineLod lods[] = { PolylineLod::none, PolylineLod::m4 };
+	const char* lod_names[] = { "none", "m4" };
+	for (int l = 0; l < 2; ++l)
+	{
+		auto start = std::chrono::steady_clock::now();
+		ctx.strokePolyline(series, lods[l]);
+		auto end = std::chrono::steady_clock::now();
+		std::cout << lod_names[l] << ": " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	ctx.strokePolyline(pyramid);
+	auto end = std::chrono::steady_clock::now();
+	std::cout << "pyramid: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+
+	ctx.savePng("c:\\temp\\benchmarkPolyline.png");
+}
+
+// 4K heatmap of a 400 x 225 grid, nearest and bilinear
+void benchmarkHeatmap()
+{
+	using namespace canvas;
+
+	const int cols = 400;
+	const int rows = 225;
+	std::vector<float> values(cols * rows);
+	for (int y = 0; y < rows; ++y)
+	{
+		for (int x = 0; x < cols; ++x)
+			values[y * cols + x] = (float)(sin(x * 0.05) * cos(y * 0.07));
+	}
+
+	Canvas ctx("canvas", 3840, 2160);
+	Colormap colormap = Colormap::viridis();
+	Rect dest = { 0, 0, 3840, 2160 };
+	HeatmapFilter filters[] = { HeatmapFilter::nearest, HeatmapFilter::bilinear };
+	const char* filter_names[] = { "nearest", "bilinear" };
+	for (int f = 0; f < 2; ++f)
+	{
+		auto start = std::chrono::steady_clock::now();
+		ctx.drawHeatmap(values, cols, rows, dest, colormap, -1.0, 1.0, filters[f]);
+		auto end = std::chrono::steady_clock::now();
+		std::cout << filter_names[f] << ": " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+	}
+
+#ifndef __EMSCRIPTEN__
+	ThreadPool pool;
+	auto start = std::chrono::steady_clock::now();
+	ctx.drawHeatmap(values, cols, rows, dest, colormap, -1.0, 1.0, HeatmapFilter::bilinear, &pool);
+	auto end = std::chrono::steady_clock::now();
+	std::cout << "bilinear on " << pool.size() << " threads: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+#endif
+
+	ctx.savePng("c:\\temp\\benchmarkHeatmap.png");
+}
+
+// Image registered once and drawn many times by its handle
+void drawSprites()
+{
+	using namespace canvas;
+
+	Canvas ctx("canvas", 640, 480);
+#if defined(__EMSCRIPTEN__) && !defined(CANVAS_SOFTWARE_RENDERER)
+	Image sprite = ctx.loadImage("yes_image");
+#elif defined(__EMSCRIPTEN__)
+	Image sprite = ctx.loadImage("yes.jpg");
+#else
+	Image sprite = ctx.loadImage("C:\\Users\\shaov\\Pictures\\yes.jpg");
+#endif
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < 5000; ++i)
+	{
+		double x = (i * 7919) % 600;
+		double y = (i * 104729) % 440;
+		ctx.drawImage(sprite, x, y, 40, 40);
+	}
+	ctx.flush();
+	auto end = std::chrono::steady_clock::now();
+	std::cout << "drawImage: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+
+	ctx.savePng("c:\\temp\\drawSprites.png");
+}
+
+// Per-pixel effect on the pixels of the canvas, read into the same ImageData every frame
+void invertPixels()
+{
+	using namespace canvas;
+
+	Canvas ctx("canvas", 320, 280);
+	auto gradient = ctx.createLinearGradient(0, 0, 320, 0);
+	gradient.addColorStop(0, "magenta");
+	gradient.addColorStop(0.5, "blue");
+	gradient.addColorStop(1.0, "red");
+	ctx.fillStyle = gradient;
+	ctx.fillRect(0, 0, 320, 280);
+
+	// the channels are in a different order and premultiplied or not on each backend
+	PixelLayout layout = ImageData::layout();
+	ImageData imgData = ctx.createImageData(320, 280);
+	for (int frame = 0; frame < 3; ++frame)
+	{
+		ctx.getImageData(imgData, 0, 0);
+		unsigned char* pixel = imgData.data();
+		for (int i = 0; i < 320 * 280 * 4; i += 4)
+		{
+			// a premultiplied channel is inverted within its alpha; only red is
+			// inverted, so that a swapped layout would show blue instead
+			unsigned char full = layout.premultiplied ? pixel[i + layout.alpha] : 255;
+			pixel[i + layout.red] = full - pixel[i + layout.red];
+		}
+		ctx.putImageData(imgData, 0, 0);
+	}
+
+	ctx.savePng("c:\\temp\\invertPixels.png");
+}
+
+// Static grid drawn once into a layer and composited under every frame
+void layerBackground()
+{
+	using namespace canvas;
+
+	Canvas ctx("canvas", 1280, 720);
+	Layer background(ctx);
+	background.strokeStyle = "#ccc";
+	background.lineWidth = 1.0;
+	for (int x = 0; x <= 1280; x += 20)
+	{
+		background.beginPath();
+		background.moveTo(x + 0.5, 0);
+		background.lineTo(x + 0.5, 720);
+		background.stroke();
+	}
+	for (int y = 0; y <= 720; y += 20)
+	{
+		background.beginPath();
+		background.moveTo(0, y + 0.5);
+		background.lineTo(1280, y + 0.5);
+		background.stroke();
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < 100; ++frame)
+	{
+		ctx.clearRect(0, 0, 1280, 720);
+		ctx.drawCanvas(background, 0, 0);
+		ctx.fillStyle = "orange";
+		ctx.beginPath();
+		ctx.arc(100 + frame * 10, 360, 40, 0, 6.283185307179586);
+		ctx.fill();
+	}
+	auto end = std::chrono::steady_clock::now();
+	std::cout << "100 frames: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+
+	ctx.savePng("c:\\temp\\layerBackground.png");
+}
+
+// Frames of many separate calls, presented after each one. Built with JsCanvas
+// and with CANVAS_SOFTWARE_RENDERER, this compares the bridge into the browser
+// with cairo inside the module. WebApplication1/test/benchmark.js runs both
+// builds under Node.
+void benchmarkFrames()
+{
+	using namespace canvas;
+
+	const int frames = 60;
+	Canvas ctx("canvas", 1280, 720);
+	auto start = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < frames; ++frame)
+	{
+		ctx.fillStyle = "white";
+		ctx.fillRect(0, 0, 1280, 720);
+		for (int i = 0; i < 10000; ++i)
+		{
+			double x = (i * 7919 + frame * 13) % 1280;
+			double y = (i * 104729) % 720;
+			ctx.fillStyle = (i % 2) ? 0x4080c0 : 0xc04040;
+			ctx.fillRect(x, y, 6, 6);
+		}
+		ctx.strokeStyle = "gray";
+		ctx.beginPath();
+		for (int i = 0; i < 10000; ++i)
+		{
+			double x = i * 1280.0 / 10000;
+			double y = 360 + 300 * sin(i * 0.01 + frame * 0.1);
+			if (i == 0)
+				ctx.moveTo(x, y);
+			else
+				ctx.lineTo(x, y);
+		}
+		ctx.stroke();
+		ctx.present();
+	}
+	auto end = std::chrono::steady_clock::now();
+	std::cout << "frame: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() / frames << "ms\n";
+
+	ctx.savePng("c:\\temp\\benchmarkFrames.png");
+}
+
+// Drawing code written once against BasicCanvas, for any backend
+template<typename Backend>
+void drawApiScene(canvas::BasicCanvas<Backend>& ctx, int frame)
+{
+	ctx.fillStyle = "white";
+	ctx.fillRect(0, 0, 1280, 720);
+	for (int i = 0; i < 10000; ++i)
+	{
+		double x = (i * 7919 + frame * 13) % 1280;
+		double y = (i * 104729) % 720;
+		ctx.fillStyle = (i % 2) ? 0x4080c0 : 0xc04040;
+		ctx.fillRect(x, y, 6, 6);
+	}
+	ctx.lineWidth = 2.0;
+	ctx.strokeStyle = "gray";
+	ctx.beginPath();
+	for (int i = 0; i < 10000; ++i)
+	{
+		double x = i * 1280.0 / 10000;
+		double y = 360 + 300 * sin(i * 0.01 + frame * 0.1);
+		if (i == 0)
+			ctx.moveTo(x, y);
+		else
+			ctx.lineTo(x, y);
+	}
+	ctx.stroke();
+}
+
+// The null backend gives the cost of the API calls alone, to compare with the
+// recording and the drawing of the same calls
+void benchmarkApiOverhead()
+{
+	using namespace canvas;
+
+	const int frames = 60;
+	BasicCanvas<NullCanvas> null_ctx(1280, 720);
+	auto start = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < frames; ++frame)
+		drawApiScene(null_ctx, frame);
+	auto end = std::chrono::steady_clock::now();
+	std::cout << "null: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / frames
+		<< "us, " << null_ctx.backend().getCalls() / frames << " calls\n";
+
+	BasicCanvas<RecordingCanvas> recording_ctx(1280, 720);
+	start = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < frames; ++frame)
+	{
+		recording_ctx.backend().clear();
+		drawApiScene(recording_ctx, frame);
+	}
+	end = std::chrono::steady_clock::now();
+	std::cout << "recording: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / frames << "us\n";
+
+	BasicCanvas<Canvas> ctx("canvas", 1280, 720);
+	start = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < frames; ++frame)
+	{
+		drawApiScene(ctx, frame);
+		ctx.backend().present();
+	}
+	end = std::chrono::steady_clock::now();
+	std::cout << "canvas: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / frames << "us\n";
+
+	ctx.backend().savePng("c:\\temp\\benchmarkApiOverhead.png");
+}
+
+#ifndef __EMSCRIPTEN__
+// Poster rendered on one thread, then in tiles on every core
+void benchmarkTiles()
+{
+	using namespace canvas;
+
+	const int width = 7680;
+	const int height = 4320;
+	RecordingCanvas scene(width, height);
+	char label[20];
+	for (int i = 0; i < 20000; ++i)
+	{
+		double x = (i * 7919) % width;
+		double y = (i * 104729) % height;
+		scene.fillStyle = (unsigned int)(i * 2654435761u) & 0xffffff;
+		scene.beginPath();
+		scene.arc(x, y, 10 + i % 40, 0, 2 * 3.14159265);
+		scene.fill();
+		if (i % 10 == 0)
+		{
+			scene.fillStyle = "black";
+			sprintf(label, "#%d", i);
+			scene.fillText(label, x, y);
+		}
+	}
+	scene.shadowColor = 0x80000000;
+	scene.shadowBlur = 8;
+	scene.shadowOffsetX = 10;
+	scene.shadowOffsetY = 10;
+	scene.fillStyle = 0x2060c0;
+	scene.fillRect(1000, 1000, 1500, 800);
+
+	Canvas single("canvas", width, height);
+	auto start = std::chrono::steady_clock::now();
+	scene.replay(single);
+	auto end = std::chrono::steady_clock::now();
+	std::cout << "single: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+
+	ThreadPool pool;
+	TileRenderer renderer(pool, 512);
+	Canvas tiled("canvas", width, height);
+	start = std::chrono::steady_clock::now();
+	renderer.render(scene, tiled);
+	end = std::chrono::steady_clock::now();
+	std::cout << "tiles on " << pool.size() << " threads: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+
+	single.savePng("c:\\temp\\benchmarkTilesSingle.png");
+	tiled.savePng("c:\\temp\\benchmarkTiles.png");
+}
+
+// A small badge drawn per request on every core, once on new canvases and once
+// on canvases of a CanvasPool
+void drawBadge(canvas::Canvas& ctx, size_t i)
+{
+	ctx.fillStyle = (unsigned int)(i * 2654435761u) & 0xffffff;
+	ctx.fillRect(0, 0, ctx.getWidth(), ctx.getHeight());
+	ctx.fillStyle = "white";
+	ctx.font = "20px Arial";
+	char label[20];
+	sprintf(label, "#%d", (int)i);
+	ctx.fillText(label, 10, 30);
+}
+
+void benchmarkCanvasPool()
+{
+	using namespace canvas;
+
+	const size_t requests = 20000;
+	ThreadPool threads;
+	auto start = std::chrono::steady_clock::now();
+	threads.parallelFor(requests, [](size_t i) {
+		Canvas ctx("canvas", 200 + (int)(i % 5) * 20, 120 + (int)(i % 3) * 10);
+		drawBadge(ctx, i);
+	});
+	auto end = std::chrono::steady_clock::now();
+	std::cout << "new canvas: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+
+	CanvasPool pool;
+	start = std::chrono::steady_clock::now();
+	threads.parallelFor(requests, [&pool](size_t i) {
+		Canvas* ctx = pool.acquire(200 + (int)(i % 5) * 20, 120 + (int)(i % 3) * 10);
+		drawBadge(*ctx, i);
+		pool.release(ctx);
+	});
+	end = std::chrono::steady_clock::now();
+	std::cout << "pooled canvas: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+
+	Canvas* ctx = pool.acquire(240, 140);
+	drawBadge(*ctx, requests);
+	ctx->savePng("c:\\temp\\benchmarkCanvasPool.png");
+	pool.release(ctx);
+}
+
+// Frames drawn in place in a ring of caller-owned buffers, as a video encoder
+// would consume them, with rows padded past the width
+void renderFrameRing()
+{
+	using namespace canvas;
+
+	const int width = 640;
+	const int height = 360;
+	const int stride = width * 4 + 64;
+	const int ring_size = 3;
+	const int frames = 60;
+	std::vector<unsigned char> ring((size_t)stride * height * ring_size);
+
+	Canvas ctx("canvas", ring.data(), width, height, stride, PixelFormat::rgb24);
+	ctx.font = "20px Arial";
+	auto start = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < frames; ++frame)
+	{
+		if (frame > 0)
+			ctx.rebind(ring.data() + (size_t)stride * height * (frame % ring_size));
+		ctx.fillStyle = "white";
+		ctx.fillRect(0, 0, width, height);
+		ctx.fillStyle = 0x2060c0;
+		ctx.fillRect(frame * 8, 140, 80, 80);
+		ctx.fillStyle = "black";
+		char label[20];
+		sprintf(label, "frame %d", frame);
+		ctx.fillText(label, 10, 30);
+	}
+	auto end = std::chrono::steady_clock::now();
+	std::cout << "frame: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / frames << "us\n";
+
+	ctx.savePng("c:\\temp\\renderFrameRing.png");
+}
+#endif
+
+#ifdef __EMSCRIPTEN__
+// Draws one frame per requestAnimationFrame: of the page, or of the worker
+// when cpp.js runs in cppworker.js, where the OffscreenCanvas shows the frame
+// once the callback has presented it
+EM_BOOL animateFrame(double time, void* user_data)
+{
+	canvas::Canvas& ctx = *(canvas::Canvas*)user_data;
+	ctx.fillStyle = "white";
+	ctx.fillRect(0, 0, 320, 280);
+	ctx.fillStyle = 0x2060c0;
+	ctx.fillRect(120 + 100 * sin(time / 500.0), 100, 80, 80);
+	ctx.present();
+	return EM_TRUE;
+}
+
+void animateFrames()
+{
+	using namespace canvas;
+
+	// drawn on for as long as the page is open
+	Canvas* ctx = new Canvas("canvas", 320, 280);
+	emscripten_request_animation_frame_loop(&animateFrame, ctx);
+}
+#endif
+
 int main()
 {
 	//displayText();
 	//displayItalicText();
 	//displayTextOutline();
+	//alignText();
+	//textBatch();
+	//shapedText();
+	//textBox();
 	//displayImage();
 	//drawLine();
 	//drawBezier();
@@ -388,15 +1190,34 @@ int main()
 	//clearRect();
 	//rotateRect();
 	//saveRestore();
+	//saveRestoreFont();
 	//repeatPattern();
 	//compositeOp();
 	//pointInPath();
+	//reusePath2D();
+	//recordReplay();
+	//dashboardDamage();
 	//shadowFillRect();
 	//shadowFillText();
 	//shadowFillArc();
 	//shadowStrokeArc();
 	//radialGradient();
 	//shadowFillBlur();
+	//benchmarkFillText();
+	//bulkPrimitives();
+	//benchmarkFillRects();
+	//benchmarkScatter();
+	//benchmarkPolyline();
+	//benchmarkHeatmap();
+	//layerBackground();
+	//drawSprites();
+	//invertPixels();
+	//benchmarkFrames();
+	//benchmarkApiOverhead();
+	//benchmarkTiles();
+	//benchmarkCanvasPool();
+	//renderFrameRing();
+	//animateFrames();
 
 	std::cout << "Done!\n";
 }
\ No newline at end of file
@@ -12,40 +12,57 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 #include <unordered_map>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <mutex>
+#include "ThreadPool.h"
+#include "CanvasCommon.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define CANVAS_USE_SSE2
+#endif
+
+// Define CANVAS_SOFTWARE_RENDERER to build with Emscripten, see Canvas::present()
+#ifdef __EMSCRIPTEN__
+	#include <emscripten.h>
+#endif
+
+// Define CANVAS_USE_HARFBUZZ to shape text with HarfBuzz over FreeType faces loaded by loadFontFile()
+#ifdef CANVAS_USE_HARFBUZZ
+	#include <ft2build.h>
+	#include FT_FREETYPE_H
+	#include <cairo-ft.h>
+	#include <hb.h>
+#endif
 
 namespace canvas
 {
 
-	enum class LineCap
-	{
-		butt,
-		round,
-		square
-	};
-
-	enum class LineJoin
-	{
-		miter,
-		round,
-		bevel
-	};
-
-	unsigned int fromRGB(unsigned char r, unsigned char g, unsigned char b)
-	{
-		return (unsigned int)((r << 16) | (g << 8) | b);
-	}
-
 	std::unordered_map<std::string, std::string> g_ColorNameMap;
+	std::once_flag g_ColorNameMapOnce;
 
 	const char* getColorValue(const char* color_name);
 	void initColorNameMap();
+	void fillColorNameMap();
 
 	// https://cairographics.org/manual/cairo-Image-Surfaces.html
+	// The pixels are those of the cairo surface: premultiplied ARGB32 in native
+	// byte order, so B, G, R, A in memory on little-endian machines, which is
+	// what layout() returns. JsCanvas gives the RGBA of the browser instead.
 	class ImageData
 	{
 	public:
 		ImageData(unsigned char* data, int width, int height) 
 			: m_Data(data), m_Width(width), m_Height(height) {}
+		static PixelLayout layout()
+		{
+			PixelLayout bgra = { 2, 1, 0, 3, true };
+			return bgra;
+		}
 		ImageData(ImageData&& other) noexcept
 		{
 			m_Data = other.m_Data;
@@ -132,12 +149,6 @@ namespace canvas
 		cairo_pattern_t* m_Pattern;
 	};
 
-	enum class RepeatPattern
-	{
-		repeat,
-		no_repeat
-	};
-
 	class Pattern
 	{
 	public:
@@ -186,19 +197,201 @@ namespace canvas
 		unsigned char* m_Pixel;
 	};
 
-	enum class GlobalCompositeOperationType
+	// Decoded once by Canvas::loadImage() or createImage(), so that drawImage()
+	// and createPattern() do not load the file on every call
+	class Image
+	{
+	public:
+		Image(cairo_surface_t* surface) : m_Surface(surface) {}
+		Image(Image&& other) noexcept
+		{
+			m_Surface = other.m_Surface;
+			other.m_Surface = nullptr;
+		}
+		~Image()
+		{
+			if (m_Surface)
+			{
+				cairo_surface_destroy(m_Surface);
+				m_Surface = nullptr;
+			}
+		}
+
+		// null when the file could not be loaded
+		cairo_surface_t* getSurface() const
+		{
+			return m_Surface;
+		}
+	private:
+		// remove copy constructor and assignment operator
+		Image(const Image& other) = delete;
+		void operator=(const Image& other) = delete;
+
+		cairo_surface_t* m_Surface;
+	};
+
+	// Records path commands once, the cairo path is built lazily and kept for
+	// every scale class because cairo splits arcs according to the device size.
+	class Path2D
 	{
-		source_over,
-		source_atop,
-		source_in,
-		source_out,
-		destination_over,
-		destination_atop,
-		destination_in,
-		destination_out,
-		lighter,
-		copy,
-		exclusive_or,
+	public:
+		Path2D(const char* = "") {}
+		Path2D(Path2D&& other) noexcept
+		{
+			m_Ops = std::move(other.m_Ops);
+			m_Args = std::move(other.m_Args);
+			m_Paths = std::move(other.m_Paths);
+			other.m_Paths.clear();
+		}
+		~Path2D()
+		{
+			clearPaths();
+		}
+
+		void moveTo(double x, double y)
+		{
+			add(PathOp::move_to, x, y);
+		}
+		void lineTo(double x, double y)
+		{
+			add(PathOp::line_to, x, y);
+		}
+		void bezierCurveTo(double cp1x, double cp1y, double cp2x, double cp2y, double endx, double endy)
+		{
+			add(PathOp::curve_to, cp1x, cp1y, cp2x, cp2y, endx, endy);
+		}
+		void quadraticCurveTo(double cpx, double cpy, double endx, double endy)
+		{
+			add(PathOp::quad_to, cpx, cpy, endx, endy);
+		}
+		void arc(double xc, double yc, double radius, double angle1, double angle2)
+		{
+			add(PathOp::arc, xc, yc, radius, angle1, angle2);
+		}
+		void rect(double x, double y, double width, double height)
+		{
+			add(PathOp::rect, x, y, width, height);
+		}
+		void closePath()
+		{
+			add(PathOp::close_path);
+		}
+
+		// Returns the path for the matrix, in user space. Tiles rendered in parallel
+		// share the recorded Path2D objects, so the cache is locked.
+		const cairo_path_t* getPath(const cairo_matrix_t& mat)
+		{
+			double det = fabs(mat.xx * mat.yy - mat.xy * mat.yx);
+			int scale_class = 0;
+			if (det > 0.0)
+				scale_class = (int)floor(log2(det) + 0.5); // half octaves of the linear scale
+			if (scale_class < -16)
+				scale_class = -16;
+			if (scale_class > 16)
+				scale_class = 16;
+
+			std::lock_guard<std::mutex> lock(m_PathsMutex);
+			for (auto& entry : m_Paths)
+			{
+				if (entry.first == scale_class)
+					return entry.second;
+			}
+
+			cairo_surface_t* scratch_surface = cairo_image_surface_create(CAIRO_FORMAT_A8, 1, 1);
+			cairo_t* scratch_cr = cairo_create(scratch_surface);
+			double scale = pow(2.0, scale_class / 2.0);
+			cairo_scale(scratch_cr, scale, scale);
+			replay(scratch_cr);
+			cairo_path_t* path = cairo_copy_path(scratch_cr);
+			cairo_destroy(scratch_cr);
+			cairo_surface_destroy(scratch_surface);
+
+			m_Paths.push_back(std::make_pair(scale_class, path));
+			return path;
+		}
+	private:
+		// remove copy constructor and assignment operator
+		Path2D(const Path2D& other) = delete;
+		void operator=(const Path2D& other) = delete;
+
+		enum class PathOp : unsigned char
+		{
+			move_to,
+			line_to,
+			curve_to,
+			quad_to,
+			arc,
+			rect,
+			close_path
+		};
+
+		void add(PathOp op, double a = 0.0, double b = 0.0, double c = 0.0, double d = 0.0, double e = 0.0, double f = 0.0)
+		{
+			static const int arg_count[] = { 2, 2, 6, 4, 5, 4, 0 };
+			const double args[] = { a, b, c, d, e, f };
+			m_Ops.push_back(op);
+			m_Args.insert(m_Args.end(), args, args + arg_count[(int)op]);
+			clearPaths();
+		}
+
+		void replay(cairo_t* cr) const
+		{
+			const double* a = m_Args.data();
+			for (PathOp op : m_Ops)
+			{
+				switch (op)
+				{
+				case PathOp::move_to:
+					cairo_move_to(cr, a[0], a[1]);
+					a += 2;
+					break;
+				case PathOp::line_to:
+					cairo_line_to(cr, a[0], a[1]);
+					a += 2;
+					break;
+				case PathOp::curve_to:
+					cairo_curve_to(cr, a[0], a[1], a[2], a[3], a[4], a[5]);
+					a += 6;
+					break;
+				case PathOp::quad_to:
+				{
+					if (!cairo_has_current_point(cr))
+						cairo_move_to(cr, a[0], a[1]);
+					double x0 = 0.0, y0 = 0.0;
+					cairo_get_current_point(cr, &x0, &y0);
+					cairo_curve_to(cr,
+						x0 + 2.0 / 3.0 * (a[0] - x0), y0 + 2.0 / 3.0 * (a[1] - y0),
+						a[2] + 2.0 / 3.0 * (a[0] - a[2]), a[3] + 2.0 / 3.0 * (a[1] - a[3]),
+						a[2], a[3]);
+					a += 4;
+					break;
+				}
+				case PathOp::arc:
+					cairo_arc(cr, a[0], a[1], a[2], a[3], a[4]);
+					a += 5;
+					break;
+				case PathOp::rect:
+					cairo_rectangle(cr, a[0], a[1], a[2], a[3]);
+					a += 4;
+					break;
+				case PathOp::close_path:
+					cairo_close_path(cr);
+					break;
+				}
+			}
+		}
+
+		void clearPaths()
+		{
+			for (auto& entry : m_Paths)
+				cairo_path_destroy(entry.second);
+			m_Paths.clear();
+		}
+
+		std::vector<PathOp> m_Ops;
+		std::vector<double> m_Args;
+		std::vector<std::pair<int, cairo_path_t*> > m_Paths;
+		std::mutex m_PathsMutex;
 	};
 
 	class GlobalCompositeOperationProperty
@@ -366,6 +559,112 @@ namespace canvas
 		cairo_t* cr;
 	};
 
+#ifdef CANVAS_USE_HARFBUZZ
+	// Font files loaded with loadFontFile(), shared by cairo (drawing) and HarfBuzz (shaping)
+	class FontFaceRegistry
+	{
+	public:
+		FontFaceRegistry() : m_Library(nullptr) {}
+		~FontFaceRegistry()
+		{
+			for (auto it = m_Faces.begin(); it != m_Faces.end(); ++it)
+			{
+				hb_face_destroy(it->second.hb_face);
+				// the FreeType face is released with the last reference to the cairo face
+				cairo_font_face_destroy(it->second.cairo_face);
+			}
+			m_Faces.clear();
+		}
+
+		bool load(const char* family, const char* file)
+		{
+			if (m_Library == nullptr && FT_Init_FreeType(&m_Library) != 0)
+				return false;
+
+			FT_Face ft_face = nullptr;
+			if (FT_New_Face(m_Library, file, 0, &ft_face) != 0)
+				return false;
+
+			hb_blob_t* blob = hb_blob_create_from_file(file);
+			Face face;
+			face.cairo_face = cairo_ft_font_face_create_for_ft_face(ft_face, 0);
+			cairo_font_face_set_user_data(face.cairo_face, &s_FaceKey, ft_face, destroyFace);
+			face.hb_face = hb_face_create(blob, 0);
+			hb_blob_destroy(blob);
+
+			std::string key = toLower(family);
+			auto it = m_Faces.find(key);
+			if (it != m_Faces.end())
+			{
+				hb_face_destroy(it->second.hb_face);
+				cairo_font_face_destroy(it->second.cairo_face);
+			}
+			m_Faces[key] = face;
+			return true;
+		}
+
+		cairo_font_face_t* findCairoFace(const std::string& family) const
+		{
+			if (m_Faces.empty())
+				return nullptr;
+
+			auto it = m_Faces.find(toLower(family));
+			return (it != m_Faces.end()) ? it->second.cairo_face : nullptr;
+		}
+
+		hb_face_t* findHarfBuzzFace(cairo_font_face_t* cairo_face) const
+		{
+			for (auto it = m_Faces.begin(); it != m_Faces.end(); ++it)
+			{
+				if (it->second.cairo_face == cairo_face)
+					return it->second.hb_face;
+			}
+			return nullptr;
+		}
+	private:
+		// remove copy constructor and assignment operator
+		FontFaceRegistry(const FontFaceRegistry& other) = delete;
+		void operator=(const FontFaceRegistry& other) = delete;
+
+		struct Face
+		{
+			cairo_font_face_t* cairo_face;
+			hb_face_t* hb_face;
+		};
+
+		static void destroyFace(void* ft_face)
+		{
+			FT_Done_Face((FT_Face)ft_face);
+		}
+
+		static std::string toLower(const std::string& value)
+		{
+			std::string lower = value;
+			for (size_t i = 0; i < lower.size(); ++i)
+			{
+				char ch = lower[i];
+				if (ch >= 'A' && ch <= 'Z')
+					lower[i] = ch - 'A' + 'a';
+			}
+			return lower;
+		}
+
+		static cairo_user_data_key_t s_FaceKey;
+		FT_Library m_Library;
+		std::unordered_map<std::string, Face> m_Faces;
+	};
+
+	cairo_user_data_key_t FontFaceRegistry::s_FaceKey;
+	FontFaceRegistry g_FontFaces;
+
+	// Makes the font in file available as family in the font property.
+	// Call it before drawing starts, the registry is not locked.
+	bool loadFontFile(const char* family, const char* file)
+	{
+		return g_FontFaces.load(family, file);
+	}
+#endif
+
 	void setFont(cairo_t* cr, const char* value)
 	{
 		std::string v = value;
@@ -396,22 +695,22 @@ namespace canvas
 		if (vlower.find("bold ") != std::string::npos)
 			weight = CAIRO_FONT_WEIGHT_BOLD;
 
+		std::string font_str = v;
 		size_t font_pos = v.find_first_of(' ', font_size_pos+1);
 		if (font_pos != std::string::npos)
-		{
-			std::string font_str = v.substr(font_pos + 1);
+			font_str = v.substr(font_pos + 1);
 
-			cairo_select_font_face(cr, font_str.c_str(),
-				slant,
-				weight);
-		}
-		else
+#ifdef CANVAS_USE_HARFBUZZ
+		cairo_font_face_t* face = g_FontFaces.findCairoFace(font_str);
+		if (face)
 		{
-			cairo_select_font_face(cr, value,
-				slant,
-				weight);
+			cairo_set_font_face(cr, face);
+			return;
 		}
-
+#endif
+		cairo_select_font_face(cr, font_str.c_str(),
+			slant,
+			weight);
 	}
 	class FontProperty
 	{
@@ -432,6 +731,19 @@ namespace canvas
 		{
 			return m_Font.c_str();
 		}
+		// Only the string that keys the text caches, cairo_restore brings back the font itself
+		void restoreFont(const std::string& value)
+		{
+			m_Font = value;
+		}
+
+		// Back to the default font of cairo, as on a new context
+		void reset()
+		{
+			m_Font.clear();
+			cairo_set_font_face(cr, nullptr);
+			cairo_set_font_size(cr, 10.0);
+		}
 	private:
 		// remove copy constructor and assignment operator
 		FontProperty(const FontProperty& other) = delete;
@@ -441,6 +753,299 @@ namespace canvas
 		std::string m_Font;
 	};
 
+	class TextAlignProperty
+	{
+	public:
+		TextAlignProperty() : m_Align(TextAlign::start) {}
+
+		void operator=(TextAlign align)
+		{
+			m_Align = align;
+		}
+		void operator=(const char* value)
+		{
+			std::string s = value;
+			if (s == "start")
+				m_Align = TextAlign::start;
+			else if (s == "end")
+				m_Align = TextAlign::end;
+			else if (s == "left")
+				m_Align = TextAlign::left;
+			else if (s == "right")
+				m_Align = TextAlign::right;
+			else if (s == "center")
+				m_Align = TextAlign::center;
+		}
+		operator TextAlign()
+		{
+			return m_Align;
+		}
+	private:
+		// remove copy constructor and assignment operator
+		TextAlignProperty(const TextAlignProperty& other) = delete;
+		void operator=(const TextAlignProperty& other) = delete;
+
+		TextAlign m_Align;
+	};
+
+	class TextBaselineProperty
+	{
+	public:
+		TextBaselineProperty() : m_Baseline(TextBaseline::alphabetic) {}
+
+		void operator=(TextBaseline baseline)
+		{
+			m_Baseline = baseline;
+		}
+		void operator=(const char* value)
+		{
+			std::string s = value;
+			if (s == "top")
+				m_Baseline = TextBaseline::top;
+			else if (s == "hanging")
+				m_Baseline = TextBaseline::hanging;
+			else if (s == "middle")
+				m_Baseline = TextBaseline::middle;
+			else if (s == "alphabetic")
+				m_Baseline = TextBaseline::alphabetic;
+			else if (s == "ideographic")
+				m_Baseline = TextBaseline::ideographic;
+			else if (s == "bottom")
+				m_Baseline = TextBaseline::bottom;
+		}
+		operator TextBaseline()
+		{
+			return m_Baseline;
+		}
+	private:
+		// remove copy constructor and assignment operator
+		TextBaselineProperty(const TextBaselineProperty& other) = delete;
+		void operator=(const TextBaselineProperty& other) = delete;
+
+		TextBaseline m_Baseline;
+	};
+
+	// Ascent and descent per font, so that aligning text does not ask cairo for extents on every call.
+	class FontMetricsCache
+	{
+	public:
+		struct Metrics
+		{
+			double ascent;
+			double descent;
+		};
+
+		FontMetricsCache() {}
+
+		const Metrics& getMetrics(cairo_t* cr, const char* font_key)
+		{
+			auto it = m_Fonts.find(font_key);
+			if (it != m_Fonts.end())
+				return it->second;
+
+			cairo_font_extents_t extents;
+			cairo_font_extents(cr, &extents);
+			Metrics& metrics = m_Fonts[font_key];
+			metrics.ascent = extents.ascent;
+			metrics.descent = extents.descent;
+			return metrics;
+		}
+
+	private:
+		// remove copy constructor and assignment operator
+		FontMetricsCache(const FontMetricsCache& other) = delete;
+		void operator=(const FontMetricsCache& other) = delete;
+
+		std::unordered_map<std::string, Metrics> m_Fonts;
+	};
+
+	// Glyphs of a string positioned from an origin of (0, 0)
+	struct TextRun
+	{
+		std::vector<cairo_glyph_t> glyphs;
+		double advance;
+	};
+
+	// Shaped runs keyed by font, font features and string. Runs are shaped by
+	// HarfBuzz for faces from loadFontFile() and by cairo's toy API otherwise.
+	class TextRunCache
+	{
+	public:
+		static const size_t MaxRuns = 4096;
+
+		typedef std::unordered_map<std::string, TextRun> RunMap;
+
+		TextRunCache() {}
+
+		~TextRunCache()
+		{
+#ifdef CANVAS_USE_HARFBUZZ
+			for (auto it = m_Fonts.begin(); it != m_Fonts.end(); ++it)
+			{
+				if (it->second.hb_font)
+					hb_font_destroy(it->second.hb_font);
+			}
+#endif
+		}
+
+		// The run stays valid until the next call
+		const TextRun& getRun(cairo_t* cr, const char* font_key, const char* features, const char* text)
+		{
+			m_Key = font_key;
+			m_Key += '\n';
+			m_Key += features;
+			FontRuns& font = m_Fonts[m_Key];
+
+			auto it = font.runs.find(text);
+			if (it != font.runs.end())
+				return it->second;
+
+			if (font.runs.size() >= MaxRuns)
+				font.runs.clear();
+
+			TextRun& run = font.runs[text];
+			run.glyphs.clear();
+			run.advance = 0.0;
+#ifdef CANVAS_USE_HARFBUZZ
+			hb_face_t* hb_face = g_FontFaces.findHarfBuzzFace(cairo_get_font_face(cr));
+			if (hb_face)
+			{
+				shapeWithHarfBuzz(cr, hb_face, features, font, text, run);
+				return run;
+			}
+#endif
+			shapeWithCairo(cr, text, run);
+			return run;
+		}
+
+	private:
+		// remove copy constructor and assignment operator
+		TextRunCache(const TextRunCache& other) = delete;
+		void operator=(const TextRunCache& other) = delete;
+
+		// The runs of a font and its features. With HarfBuzz, the font at the
+		// size of the key and the parsed features are kept for the next runs.
+		struct FontRuns
+		{
+			RunMap runs;
+#ifdef CANVAS_USE_HARFBUZZ
+			hb_face_t* hb_face = nullptr;
+			hb_font_t* hb_font = nullptr;
+			std::vector<hb_feature_t> hb_features;
+#endif
+		};
+
+		void shapeWithCairo(cairo_t* cr, const char* text, TextRun& run)
+		{
+			cairo_scaled_font_t* scaled_font = cairo_get_scaled_font(cr);
+			cairo_glyph_t* glyphs = nullptr;
+			int num_glyphs = 0;
+			if (cairo_scaled_font_text_to_glyphs(scaled_font, 0.0, 0.0, text, -1,
+				&glyphs, &num_glyphs, nullptr, nullptr, nullptr) != CAIRO_STATUS_SUCCESS)
+			{
+				return;
+			}
+			run.glyphs.assign(glyphs, glyphs + num_glyphs);
+			cairo_glyph_free(glyphs);
+
+			if (num_glyphs > 0)
+			{
+				cairo_text_extents_t extents;
+				cairo_scaled_font_glyph_extents(scaled_font, run.glyphs.data(), num_glyphs, &extents);
+				run.advance = extents.x_advance;
+			}
+		}
+
+#ifdef CANVAS_USE_HARFBUZZ
+		static const int HarfBuzzScale = 64; // 26.6 fixed point like FreeType
+
+		// Creates the HarfBuzz font of the entry on its first run, and again when
+		// the family was loaded again with another face
+		void prepareHarfBuzzFont(cairo_t* cr, hb_face_t* hb_face, const char* features, FontRuns& font)
+		{
+			if (font.hb_face == hb_face)
+				return;
+
+			if (font.hb_font)
+				hb_font_destroy(font.hb_font);
+			cairo_matrix_t font_matrix;
+			cairo_get_font_matrix(cr, &font_matrix);
+			font.hb_face = hb_face;
+			font.hb_font = hb_font_create(hb_face);
+			hb_font_set_scale(font.hb_font, (int)(font_matrix.xx * HarfBuzzScale), (int)(font_matrix.yy * HarfBuzzScale));
+
+			// comma separated list such as "kern,liga,-calt"
+			font.hb_features.clear();
+			std::string list = features;
+			size_t pos = 0;
+			while (pos < list.size())
+			{
+				size_t comma = list.find(',', pos);
+				if (comma == std::string::npos)
+					comma = list.size();
+				hb_feature_t feature;
+				if (comma > pos && hb_feature_from_string(list.c_str() + pos, (int)(comma - pos), &feature))
+					font.hb_features.push_back(feature);
+				pos = comma + 1;
+			}
+		}
+
+		void shapeWithHarfBuzz(cairo_t* cr, hb_face_t* hb_face, const char* features, FontRuns& font, const char* text, TextRun& run)
+		{
+			prepareHarfBuzzFont(cr, hb_face, features, font);
+
+			hb_buffer_t* buffer = hb_buffer_create();
+			hb_buffer_add_utf8(buffer, text, -1, 0, -1);
+			hb_buffer_guess_segment_properties(buffer);
+			hb_shape(font.hb_font, buffer, font.hb_features.data(), (unsigned int)font.hb_features.size());
+
+			unsigned int count = 0;
+			hb_glyph_info_t* infos = hb_buffer_get_glyph_infos(buffer, &count);
+			hb_glyph_position_t* positions = hb_buffer_get_glyph_positions(buffer, &count);
+			double pen_x = 0.0;
+			double pen_y = 0.0;
+			run.glyphs.resize(count);
+			for (unsigned int i = 0; i < count; ++i)
+			{
+				// HarfBuzz y axis points up
+				run.glyphs[i].index = infos[i].codepoint;
+				run.glyphs[i].x = pen_x + (double)positions[i].x_offset / HarfBuzzScale;
+				run.glyphs[i].y = pen_y - (double)positions[i].y_offset / HarfBuzzScale;
+				pen_x += (double)positions[i].x_advance / HarfBuzzScale;
+				pen_y -= (double)positions[i].y_advance / HarfBuzzScale;
+			}
+			run.advance = pen_x;
+
+			hb_buffer_destroy(buffer);
+		}
+#endif
+
+		std::unordered_map<std::string, FontRuns> m_Fonts;
+		std::string m_Key;
+	};
+
+	class FontFeaturesProperty
+	{
+	public:
+		FontFeaturesProperty() {}
+
+		// comma separated OpenType features such as "kern,liga,-calt", used with HarfBuzz
+		void operator=(const char* value)
+		{
+			m_Features = value;
+		}
+		const char* getFeatures() const
+		{
+			return m_Features.c_str();
+		}
+	private:
+		// remove copy constructor and assignment operator
+		FontFeaturesProperty(const FontFeaturesProperty& other) = delete;
+		void operator=(const FontFeaturesProperty& other) = delete;
+
+		std::string m_Features;
+	};
+
 	class LineCapProperty
 	{
 	public:
@@ -726,263 +1331,895 @@ namespace canvas
 		unsigned int m_Blur;
 	};
 
+	// (x * y) / 255 with rounding, for x and y in [0, 255]
+	inline unsigned int mul255(unsigned int x, unsigned int y)
+	{
+		unsigned int t = x * y + 128;
+		return (t + (t >> 8)) >> 8;
+	}
 
-	class Canvas
+	// Composite a premultiplied ARGB32 color through an A8 coverage mask
+	// onto a row of premultiplied ARGB32 pixels with the OVER operator.
+	inline void blendMaskSpan(unsigned int* dest, const unsigned char* mask, int count, unsigned int color)
 	{
-	public:
-		Canvas(const char* name, int width, int height) 
-			: surface(nullptr), cr(nullptr), m_Width(width), m_Height(height)
+		const unsigned int ca = color >> 24;
+		int i = 0;
+#ifdef CANVAS_USE_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i half = _mm_set1_epi16(128);
+		const __m128i full = _mm_set1_epi16(255);
+		const __m128i src = _mm_unpacklo_epi8(_mm_set1_epi32((int)color), zero);
+		for (; i + 4 <= count; i += 4)
 		{
-			surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
-			cr = cairo_create(surface);
-
-			fillStyle.init(cr);
-			strokeStyle.init(cr);
-			font.init(cr);
-			lineCap.init(cr);
-			lineJoin.init(cr);
-			lineWidth.init(cr);
-			miterLimit.init(cr);
-			globalCompositeOperation.init(cr);
-
-			fillStyle = "white";
-			fillRect(0, 0, m_Width, m_Height);
-			fillStyle = "black";
-			lineWidth = 1.0;
+			unsigned int m4;
+			memcpy(&m4, mask + i, 4);
+			if (m4 == 0)
+				continue;
+			if (m4 == 0xffffffff && ca == 0xff)
+			{
+				_mm_storeu_si128((__m128i*)(dest + i), _mm_set1_epi32((int)color));
+				continue;
+			}
+			__m128i m = _mm_cvtsi32_si128((int)m4);
+			m = _mm_unpacklo_epi8(m, m);
+			m = _mm_unpacklo_epi16(m, m);
+			__m128i d = _mm_loadu_si128((const __m128i*)(dest + i));
+
+			__m128i m_lo = _mm_unpacklo_epi8(m, zero);
+			__m128i m_hi = _mm_unpackhi_epi8(m, zero);
+			__m128i d_lo = _mm_unpacklo_epi8(d, zero);
+			__m128i d_hi = _mm_unpackhi_epi8(d, zero);
+
+			// source scaled by coverage
+			__m128i t = _mm_add_epi16(_mm_mullo_epi16(src, m_lo), half);
+			__m128i s_lo = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+			t = _mm_add_epi16(_mm_mullo_epi16(src, m_hi), half);
+			__m128i s_hi = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+
+			// destination scaled by inverse source alpha
+			__m128i inv_lo = _mm_sub_epi16(full, _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, 0xff), 0xff));
+			__m128i inv_hi = _mm_sub_epi16(full, _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, 0xff), 0xff));
+			t = _mm_add_epi16(_mm_mullo_epi16(d_lo, inv_lo), half);
+			d_lo = _mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8), s_lo);
+			t = _mm_add_epi16(_mm_mullo_epi16(d_hi, inv_hi), half);
+			d_hi = _mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8), s_hi);
+
+			_mm_storeu_si128((__m128i*)(dest + i), _mm_packus_epi16(d_lo, d_hi));
 		}
-
-		~Canvas()
+#endif
+		for (; i < count; ++i)
 		{
-			destroy();
+			unsigned int m = mask[i];
+			if (m == 0)
+				continue;
+			if (m == 0xff && ca == 0xff)
+			{
+				dest[i] = color;
+				continue;
+			}
+			unsigned int d = dest[i];
+			unsigned int inv = 255 - mul255(ca, m);
+			unsigned int result = 0;
+			for (int shift = 0; shift < 32; shift += 8)
+			{
+				unsigned int s = mul255((color >> shift) & 0xff, m);
+				result |= (s + mul255((d >> shift) & 0xff, inv)) << shift;
+			}
+			dest[i] = result;
 		}
+	}
 
-		void destroy()
+	// Cache of antialiased A8 glyph masks keyed by font, glyph index and
+	// horizontal subpixel phase. Glyphs are shelf-packed into fixed-size pages.
+	class GlyphAtlas
+	{
+	public:
+		static const int PageSize = 512;
+		static const int MaxPages = 8;
+		static const int SubpixelSteps = 4;
+
+		struct Glyph
 		{
-			cairo_destroy(cr);
-			cairo_surface_destroy(surface);
-			cr = nullptr;
-			surface = nullptr;
+			int page;
+			int x;
+			int y;
+			int width;
+			int height;
+			int left; // offset of the mask from the pen position
+			int top;
+		};
+
+		typedef std::unordered_map<unsigned long long, Glyph> GlyphMap;
+
+		GlyphAtlas() : m_ShelfX(0), m_ShelfY(0), m_ShelfHeight(0), m_Full(false) {}
+		~GlyphAtlas()
+		{
+			clear();
 		}
 
-		void fillRect(double x, double y, double width, double height)
+		// Glyph table of one font, looked up once per text run
+		GlyphMap& getGlyphs(const std::string& font_key)
 		{
-			if (shadowColor.isTransparent() == false)
+			if (m_Full)
 			{
-				int blur_cnt = shadowBlur;
-				if (blur_cnt <= 0)
-				{
-					save();
-
-					setShadowColor(cr);
-
-					cairo_rectangle(cr, x + shadowOffsetX, y + shadowOffsetY, width, height);
-					cairo_fill(cr);
-
-					restore();
-				}
-				else
-				{
-					save();
-
-					cairo_surface_t* mask_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, m_Width, m_Height);
-					cairo_t* mask_cr = cairo_create(mask_surface);
-
-					double offset_x = shadowOffsetX;
-					double offset_y = shadowOffsetY;
-
-					cairo_set_source_rgba(mask_cr, 0, 0, 1.0, 1.0);
-
-					cairo_rectangle(mask_cr, x + shadowOffsetX, y + shadowOffsetY, width, height);
-					cairo_fill(mask_cr);
-
-					cairo_surface_flush(surface);
-					cairo_surface_flush(mask_surface);
-					unsigned char* dest_pixel = cairo_image_surface_get_data(surface);
-
-					unsigned char* src_pixel = cairo_image_surface_get_data(mask_surface);
+				// atlas filled up during an earlier run, start over rather than grow without bound
+				clear();
+			}
+			return m_Fonts[font_key];
+		}
 
-					applyBoxBlur(shadowBlur, src_pixel);
+		// Returns nullptr if the glyph cannot be cached (too large for a page).
+		const Glyph* getGlyph(GlyphMap& glyphs, cairo_scaled_font_t* scaled_font, unsigned long index, int phase)
+		{
+			unsigned long long key = ((unsigned long long)index << 8) | (unsigned long long)phase;
+			auto it = glyphs.find(key);
+			if (it != glyphs.end())
+				return &it->second;
 
-					applyShadow(src_pixel, dest_pixel);
+			Glyph glyph = {};
+			if (!rasterize(scaled_font, index, phase, glyph))
+				return nullptr;
 
-					cairo_surface_mark_dirty(surface);
+			return &(glyphs[key] = glyph);
+		}
 
-					cairo_destroy(mask_cr);
-					cairo_surface_destroy(mask_surface);
-					mask_cr = nullptr;
-					mask_surface = nullptr;
+		unsigned char* getPageData(int page) const
+		{
+			return cairo_image_surface_get_data(m_Pages[page]);
+		}
+		int getPageStride(int page) const
+		{
+			return cairo_image_surface_get_stride(m_Pages[page]);
+		}
 
-					restore();
-				}
-			}
-			cairo_rectangle(cr, x, y, width, height);
-			cairo_fill(cr);
+		void clear()
+		{
+			for (size_t i = 0; i < m_Pages.size(); ++i)
+				cairo_surface_destroy(m_Pages[i]);
+
+			m_Pages.clear();
+			m_Fonts.clear();
+			m_ShelfX = 0;
+			m_ShelfY = 0;
+			m_ShelfHeight = 0;
+			m_Full = false;
 		}
+	private:
+		// remove copy constructor and assignment operator
+		GlyphAtlas(const GlyphAtlas& other) = delete;
+		void operator=(const GlyphAtlas& other) = delete;
 
-		void clearRect(double x, double y, double width, double height)
+		bool rasterize(cairo_scaled_font_t* scaled_font, unsigned long index, int phase, Glyph& glyph)
 		{
-			ImageData imgData = createImageData("imgData", width, height);
+			double offset = (double)phase / SubpixelSteps;
+			cairo_glyph_t cg = { index, 0.0, 0.0 };
+			cairo_text_extents_t extents;
+			cairo_scaled_font_glyph_extents(scaled_font, &cg, 1, &extents);
 
-			for (int y = 0; y < imgData.height(); ++y)
+			if (extents.width <= 0.0 || extents.height <= 0.0)
 			{
-				for (int x = 0; x < imgData.width(); ++x)
-				{
-					int index = (y * imgData.width() + x) * 4;
-					imgData.data()[index] = 0xff;
-					imgData.data()[index + 1] = 0xff;
-					imgData.data()[index + 2] = 0xff;
-					imgData.data()[index + 3] = 0xff;
-				}
-
+				// blank glyph such as space, nothing to composite
+				return true;
 			}
-			
-			putImageData(imgData, x, y, 0, 0, width, height);
+
+			// one pixel of padding on each side for the antialiased edge
+			int x0 = (int)floor(offset + extents.x_bearing) - 1;
+			int y0 = (int)floor(extents.y_bearing) - 1;
+			int x1 = (int)ceil(offset + extents.x_bearing + extents.width) + 1;
+			int y1 = (int)ceil(extents.y_bearing + extents.height) + 1;
+			int width = x1 - x0;
+			int height = y1 - y0;
+			if (width > PageSize || height > PageSize)
+				return false;
+
+			if (!allocate(width, height, glyph))
+				return false;
+
+			glyph.left = x0;
+			glyph.top = y0;
+
+			cairo_t* page_cr = cairo_create(m_Pages[glyph.page]);
+			cairo_rectangle(page_cr, glyph.x, glyph.y, width, height);
+			cairo_clip(page_cr);
+			cairo_set_scaled_font(page_cr, scaled_font);
+			cairo_set_source_rgba(page_cr, 1.0, 1.0, 1.0, 1.0);
+			cg.x = glyph.x - x0 + offset;
+			cg.y = glyph.y - y0;
+			cairo_show_glyphs(page_cr, &cg, 1);
+			cairo_destroy(page_cr);
+			cairo_surface_flush(m_Pages[glyph.page]);
+
+			return true;
 		}
 
-		void strokeRect(double x, double y, double width, double height)
+		bool allocate(int width, int height, Glyph& glyph)
 		{
-			if (shadowColor.isTransparent() == false)
+			if (m_Pages.empty())
+				addPage();
+
+			if (m_ShelfX + width > PageSize)
 			{
-				int blur_cnt = shadowBlur;
-				if (blur_cnt <= 0)
+				// start a new shelf
+				m_ShelfX = 0;
+				m_ShelfY += m_ShelfHeight;
+				m_ShelfHeight = 0;
+			}
+			if (m_ShelfY + height > PageSize)
+			{
+				if ((int)m_Pages.size() >= MaxPages)
 				{
-					save();
-
-					setShadowColor(cr);
+					m_Full = true;
+					return false;
+				}
+				addPage();
+			}
 
-					cairo_rectangle(cr, x + shadowOffsetX, y + shadowOffsetY, width, height);
-					cairo_stroke(cr);
+			glyph.page = (int)m_Pages.size() - 1;
+			glyph.x = m_ShelfX;
+			glyph.y = m_ShelfY;
+			glyph.width = width;
+			glyph.height = height;
 
-					restore();
-				}
-				else
-				{
-					save();
+			m_ShelfX += width;
+			if (height > m_ShelfHeight)
+				m_ShelfHeight = height;
 
-					cairo_surface_t* mask_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, m_Width, m_Height);
-					cairo_t* mask_cr = cairo_create(mask_surface);
+			return true;
+		}
 
-					double offset_x = shadowOffsetX;
-					double offset_y = shadowOffsetY;
+		void addPage()
+		{
+			m_Pages.push_back(cairo_image_surface_create(CAIRO_FORMAT_A8, PageSize, PageSize));
+			m_ShelfX = 0;
+			m_ShelfY = 0;
+			m_ShelfHeight = 0;
+		}
 
-					cairo_set_source_rgba(mask_cr, 0, 0, 1.0, 1.0);
+		std::vector<cairo_surface_t*> m_Pages;
+		std::unordered_map<std::string, GlyphMap> m_Fonts;
+		int m_ShelfX;
+		int m_ShelfY;
+		int m_ShelfHeight;
+		bool m_Full;
+	};
 
-					cairo_rectangle(mask_cr, x + shadowOffsetX, y + shadowOffsetY, width, height);
-					cairo_stroke(mask_cr);
+	// Colormap indices of count values, low mapping to 0 and low + 255 / scale to 255.
+	// Values out of range are clamped and NaN maps to 0.
+	inline void mapHeatmapValues(const float* values, int count, float low, float scale, unsigned char* indices)
+	{
+		int i = 0;
+#ifdef CANVAS_USE_SSE2
+		const __m128 low4 = _mm_set1_ps(low);
+		const __m128 scale4 = _mm_set1_ps(scale);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 top = _mm_set1_ps(255.0f);
+		const __m128 half = _mm_set1_ps(0.5f);
+		for (; i + 8 <= count; i += 8)
+		{
+			__m128 a = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(values + i), low4), scale4);
+			__m128 b = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(values + i + 4), low4), scale4);
+			// max returns its second operand for NaN
+			a = _mm_min_ps(_mm_max_ps(a, zero), top);
+			b = _mm_min_ps(_mm_max_ps(b, zero), top);
+			__m128i words = _mm_packs_epi32(_mm_cvttps_epi32(_mm_add_ps(a, half)), _mm_cvttps_epi32(_mm_add_ps(b, half)));
+			_mm_storel_epi64((__m128i*)(indices + i), _mm_packus_epi16(words, words));
+		}
+#endif
+		for (; i < count; ++i)
+		{
+			float v = (values[i] - low) * scale;
+			v = (v > 0.0f) ? v : 0.0f;
+			v = (v < 255.0f) ? v : 255.0f;
+			indices[i] = (unsigned char)(v + 0.5f);
+		}
+	}
 
-					cairo_surface_flush(surface);
-					cairo_surface_flush(mask_surface);
-					unsigned char* dest_pixel = cairo_image_surface_get_data(surface);
+	// out = a + (b - a) * t for two rows of count values
+	inline void lerpHeatmapRows(const float* a, const float* b, float t, int count, float* out)
+	{
+		int i = 0;
+#ifdef CANVAS_USE_SSE2
+		const __m128 t4 = _mm_set1_ps(t);
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 va = _mm_loadu_ps(a + i);
+			__m128 vb = _mm_loadu_ps(b + i);
+			_mm_storeu_ps(out + i, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), t4)));
+		}
+#endif
+		for (; i < count; ++i)
+			out[i] = a[i] + (b[i] - a[i]) * t;
+	}
 
-					unsigned char* src_pixel = cairo_image_surface_get_data(mask_surface);
+	// Cache of antialiased A8 point masks for every shape and radius, one per
+	// subpixel phase of the centre in each direction.
+	class PointSpriteCache
+	{
+	public:
+		static const int SubpixelSteps = 4;
+		static const int MaxRadius = 64;
+		static const size_t MaxMarkers = 64;
 
-					applyBoxBlur(shadowBlur, src_pixel);
+		struct Sprite
+		{
+			cairo_surface_t* mask;
+			const unsigned char* data;
+			int stride;
+			int left; // offset of the mask from the pixel of the centre
+			int top;
+			int width;
+			int height;
+		};
+
+		PointSpriteCache() {}
+		~PointSpriteCache()
+		{
+			clear();
+		}
 
-					applyShadow(src_pixel, dest_pixel);
+		// Sprites of one marker indexed by phase_y * SubpixelSteps + phase_x.
+		// Returns nullptr if the marker is too large to be worth caching.
+		const Sprite* getSprites(PointShape shape, double radius)
+		{
+			if (!(radius > 0.0 && radius <= MaxRadius))
+				return nullptr;
 
-					cairo_surface_mark_dirty(surface);
+			for (size_t i = 0; i < m_Markers.size(); ++i)
+			{
+				if (m_Markers[i].shape == shape && m_Markers[i].radius == radius)
+					return m_Markers[i].sprites;
+			}
 
-					cairo_destroy(mask_cr);
-					cairo_surface_destroy(mask_surface);
-					mask_cr = nullptr;
-					mask_surface = nullptr;
+			if (m_Markers.size() >= MaxMarkers)
+				clear();
 
-					restore();
-				}
+			Marker marker;
+			marker.shape = shape;
+			marker.radius = radius;
+			for (int phase_y = 0; phase_y < SubpixelSteps; ++phase_y)
+			{
+				for (int phase_x = 0; phase_x < SubpixelSteps; ++phase_x)
+					rasterize(shape, radius, phase_x, phase_y, marker.sprites[phase_y * SubpixelSteps + phase_x]);
 			}
-			cairo_rectangle(cr, x, y, width, height);
-			cairo_stroke(cr);
+			m_Markers.push_back(marker);
+			return m_Markers.back().sprites;
 		}
 
-		void fillText(const char* text, double x, double y)
+		void clear()
 		{
-			if (shadowColor.isTransparent() == false)
+			for (size_t i = 0; i < m_Markers.size(); ++i)
 			{
-				int blur_cnt = shadowBlur;
-				if (blur_cnt <= 0)
-				{
-					save();
-
-					setShadowColor(cr);
-
-					cairo_move_to(cr, x + shadowOffsetX, y + shadowOffsetY);
-					cairo_show_text(cr, text);
+				for (int j = 0; j < SubpixelSteps * SubpixelSteps; ++j)
+					cairo_surface_destroy(m_Markers[i].sprites[j].mask);
+			}
+			m_Markers.clear();
+		}
+	private:
+		// remove copy constructor and assignment operator
+		PointSpriteCache(const PointSpriteCache& other) = delete;
+		void operator=(const PointSpriteCache& other) = delete;
 
-					restore();
-				}
-				else
-				{
-					save();
+		struct Marker
+		{
+			PointShape shape;
+			double radius;
+			Sprite sprites[SubpixelSteps * SubpixelSteps];
+		};
 
-					cairo_surface_t* mask_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, m_Width, m_Height);
-					cairo_t* mask_cr = cairo_create(mask_surface);
+		static void rasterize(PointShape shape, double radius, int phase_x, int phase_y, Sprite& sprite)
+		{
+			// one pixel of padding on each side for the antialiased edge and the phase
+			int half = (int)ceil(radius) + 1;
+			sprite.left = -half;
+			sprite.top = -half;
+			sprite.width = 2 * half + 1;
+			sprite.height = 2 * half + 1;
+			sprite.mask = cairo_image_surface_create(CAIRO_FORMAT_A8, sprite.width, sprite.height);
+
+			double cx = half + (double)phase_x / SubpixelSteps;
+			double cy = half + (double)phase_y / SubpixelSteps;
+			cairo_t* mask_cr = cairo_create(sprite.mask);
+			cairo_set_source_rgba(mask_cr, 1.0, 1.0, 1.0, 1.0);
+			if (shape == PointShape::square)
+				cairo_rectangle(mask_cr, cx - radius, cy - radius, 2.0 * radius, 2.0 * radius);
+			else
+				cairo_arc(mask_cr, cx, cy, radius, 0.0, 6.283185307179586);
+			cairo_fill(mask_cr);
+			cairo_destroy(mask_cr);
+			cairo_surface_flush(sprite.mask);
+
+			sprite.data = cairo_image_surface_get_data(sprite.mask);
+			sprite.stride = cairo_image_surface_get_stride(sprite.mask);
+		}
 
-					double offset_x = shadowOffsetX;
-					double offset_y = shadowOffsetY;
+		std::vector<Marker> m_Markers;
+	};
 
-					cairo_set_source_rgba(mask_cr, 0, 0, 1.0, 1.0);
+	// Keeps the surfaces of destroyed layers for reuse by new layers of the same
+	// size, so that a layer per frame does not allocate.
+	class SurfacePool
+	{
+	public:
+		static const size_t MaxSurfaces = 8;
 
-					setFont(mask_cr, font.getFont());
-					cairo_move_to(mask_cr, x + shadowOffsetX, y + shadowOffsetY);
-					cairo_show_text(mask_cr, text);
+		SurfacePool() {}
+		~SurfacePool()
+		{
+			for (size_t i = 0; i < m_Surfaces.size(); ++i)
+				cairo_surface_destroy(m_Surfaces[i]);
+		}
 
+		// Transparent ARGB32 surface
+		cairo_surface_t* acquire(int width, int height)
+		{
+			for (size_t i = 0; i < m_Surfaces.size(); ++i)
+			{
+				cairo_surface_t* surface = m_Surfaces[i];
+				if (cairo_image_surface_get_width(surface) == width && cairo_image_surface_get_height(surface) == height)
+				{
+					m_Surfaces.erase(m_Surfaces.begin() + i);
 					cairo_surface_flush(surface);
-					cairo_surface_flush(mask_surface);
-					unsigned char* dest_pixel = cairo_image_surface_get_data(surface);
-
-					unsigned char* src_pixel = cairo_image_surface_get_data(mask_surface);
-
-					applyBoxBlur(shadowBlur, src_pixel);
-
-					applyShadow(src_pixel, dest_pixel);
-
+					memset(cairo_image_surface_get_data(surface), 0, cairo_image_surface_get_stride(surface) * height);
+					cairo_surface_set_device_offset(surface, 0.0, 0.0);
 					cairo_surface_mark_dirty(surface);
-
-					cairo_destroy(mask_cr);
-					cairo_surface_destroy(mask_surface);
-					mask_cr = nullptr;
-					mask_surface = nullptr;
-
-					restore();
+					return surface;
 				}
 			}
-			cairo_move_to(cr, x, y);
-			cairo_show_text(cr, text);
+			return cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
 		}
 
-		void strokeText(const char* text, double x, double y)
+		void release(cairo_surface_t* surface)
 		{
-			if (shadowColor.isTransparent() == false)
+			if (m_Surfaces.size() >= MaxSurfaces)
 			{
-				int blur_cnt = shadowBlur;
-				if (blur_cnt <= 0)
-				{
-					save();
-
-					setShadowColor(cr);
+				cairo_surface_destroy(m_Surfaces.front());
+				m_Surfaces.erase(m_Surfaces.begin());
+			}
+			m_Surfaces.push_back(surface);
+		}
+	private:
+		// remove copy constructor and assignment operator
+		SurfacePool(const SurfacePool& other) = delete;
+		void operator=(const SurfacePool& other) = delete;
 
-					cairo_move_to(cr, x + shadowOffsetX, y + shadowOffsetY);
-					cairo_text_path(cr, text);
-					cairo_stroke(cr);
+		std::vector<cairo_surface_t*> m_Surfaces;
+	};
 
-					restore();
-				}
-				else
-				{
-					save();
+	// Layouts of 32 bit pixels for a canvas over the pixels of the caller
+	enum class PixelFormat
+	{
+		argb32, // premultiplied alpha
+		rgb24 // the top byte is unused
+	};
 
-					cairo_surface_t* mask_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, m_Width, m_Height);
-					cairo_t* mask_cr = cairo_create(mask_surface);
+	class Canvas
+	{
+	public:
+		Canvas(const char* name, int width, int height) 
+			: surface(nullptr), cr(nullptr), m_Pool(nullptr), m_Name(name), m_Width(width), m_Height(height), m_OriginX(0), m_OriginY(0)
+			, m_Damaged(false), m_DamageX0(0), m_DamageY0(0), m_DamageX1(0), m_DamageY1(0), m_Clipped(false)
+		{
+			createSurface(width, height);
+			init();
 
-					double offset_x = shadowOffsetX;
-					double offset_y = shadowOffsetY;
+			fillStyle = "white";
+			fillRect(0, 0, m_Width, m_Height);
+			fillStyle = "black";
+		}
 
-					cairo_set_source_rgba(mask_cr, 0, 0, 1.0, 1.0);
+		// Draws straight into pixels owned by the caller, such as a frame in shared
+		// memory, which are neither cleared nor copied. stride is the number of
+		// bytes from one row to the next, a multiple of 4 of at least width * 4.
+		// The pixels must outlive the canvas, or its next rebind().
+		Canvas(const char* name, unsigned char* data, int width, int height, int stride, PixelFormat format)
+			: surface(nullptr), cr(nullptr), m_Pool(nullptr), m_Name(name), m_Width(width), m_Height(height), m_OriginX(0), m_OriginY(0)
+			, m_Damaged(false), m_DamageX0(0), m_DamageY0(0), m_DamageX1(0), m_DamageY1(0), m_Clipped(false)
+		{
+			cairo_format_t cairo_format = (format == PixelFormat::rgb24) ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32;
+			surface = cairo_image_surface_create_for_data(data, cairo_format, width, height, stride);
+			init();
+			fillStyle = "black";
+		}
 
-					setFont(mask_cr, font.getFont());
-					cairo_move_to(mask_cr, x + shadowOffsetX, y + shadowOffsetY);
-					cairo_text_path(mask_cr, text);
-					cairo_stroke(mask_cr);
+		~Canvas()
+		{
+			destroy();
+		}
+
+		void destroy()
+		{
+			cairo_destroy(cr);
+			if (m_Pool)
+				m_Pool->release(surface);
+			else
+				cairo_surface_destroy(surface);
+			cr = nullptr;
+			surface = nullptr;
+		}
+
+		cairo_surface_t* getSurface() const
+		{
+			return surface;
+		}
+
+		// cairo draws every call at once, kept for API compatibility with JsCanvas
+		void flush() {}
+
+		// Shows the surface in the canvas element with the name of this canvas,
+		// call it once per frame after drawing. It is only needed when the
+		// software renderer is built with Emscripten, then cairo and pixman
+		// rasterize inside the module and the frame crosses into JavaScript in
+		// one putImageData over the heap. The native build has nothing to show.
+		//
+		// em++ -O3 -msimd128 -msse2 -DCANVAS_SOFTWARE_RENDERER -sUSE_LIBPNG=1 -sUSE_ZLIB=1
+		//     -sALLOW_MEMORY_GROWTH=1 -I<cairo>/include/cairo -I<stb> CanvasExample.cpp
+		//     <cairo>/lib/libcairo.a <pixman>/lib/libpixman-1.a --preload-file yes.jpg -o cpp.js
+		//
+		// with cairo and pixman built by emconfigure/emmake. -msse2 turns on the
+		// SSE2 paths of this file on top of WASM SIMD.
+		void present()
+		{
+#ifdef __EMSCRIPTEN__
+			cairo_surface_flush(surface);
+			const unsigned char* src = cairo_image_surface_get_data(surface);
+			int stride = cairo_image_surface_get_stride(surface);
+			int width = cairo_image_surface_get_width(surface);
+			int height = cairo_image_surface_get_height(surface);
+			const unsigned int* inverse = inverseAlphaTable();
+
+			// ARGB32 is premultiplied, ImageData is RGBA that is not
+			m_PresentPixels.resize((size_t)width * height * 4);
+			unsigned char* dest = m_PresentPixels.data();
+			for (int y = 0; y < height; ++y)
+			{
+				const unsigned int* row = (const unsigned int*)(src + y * stride);
+				for (int x = 0; x < width; ++x, dest += 4)
+				{
+					unsigned int pixel = row[x];
+					unsigned int a = pixel >> 24;
+					unsigned int scale = inverse[a];
+					dest[0] = (unsigned char)((((pixel >> 16) & 0xff) * scale + 0x8000) >> 16);
+					dest[1] = (unsigned char)((((pixel >> 8) & 0xff) * scale + 0x8000) >> 16);
+					dest[2] = (unsigned char)(((pixel & 0xff) * scale + 0x8000) >> 16);
+					dest[3] = (unsigned char)a;
+				}
+			}
+
+			// under Node there is no document, which leaves the frame in the heap for benchmarks
+			EM_ASM_({
+				if (typeof document === 'undefined')
+					return;
+				var canvas = document.getElementById(UTF8ToString($0));
+				if (canvas == null)
+					return;
+				var pixels = new Uint8ClampedArray(HEAPU8.buffer, $1, $2 * $3 * 4);
+				canvas.getContext("2d").putImageData(new ImageData(pixels, $2, $3), 0, 0);
+				}, m_Name.c_str(), m_PresentPixels.data(), width, height);
+#endif
+		}
+
+		// Surfaces shared by the layers of this canvas
+		SurfacePool& getSurfacePool()
+		{
+			return m_SurfacePool;
+		}
+
+		// Composites src like drawImage, straight from its surface. src must not be this canvas.
+		void drawCanvas(const Canvas& src, double x, double y)
+		{
+			drawCanvas(src, 0.0, 0.0, src.m_Width, src.m_Height, x, y, src.m_Width, src.m_Height);
+		}
+
+		void drawCanvas(const Canvas& src, double x, double y, double width, double height)
+		{
+			drawCanvas(src, 0.0, 0.0, src.m_Width, src.m_Height, x, y, width, height);
+		}
+
+		void drawCanvas(const Canvas& src, double sx, double sy, double sw, double sh,
+			double dx, double dy, double dw, double dh)
+		{
+			drawSurface(src.surface, sx, sy, sw, sh, dx, dy, dw, dh);
+		}
+
+		// Loads image_file once, with its alpha
+		Image loadImage(const char* image_file)
+		{
+			int width, height, channels;
+			unsigned char* image = stbi_load(image_file,
+				&width,
+				&height,
+				&channels,
+				STBI_rgb_alpha);
+			if (image == nullptr)
+				return std::move(Image(nullptr));
+
+			cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+			cairo_surface_flush(surface);
+			unsigned char* data = cairo_image_surface_get_data(surface);
+			int stride = cairo_image_surface_get_stride(surface);
+			for (int y = 0; y < height; ++y)
+			{
+				unsigned int* dest = (unsigned int*)(data + y * stride);
+				const unsigned char* src = image + y * width * 4;
+				for (int x = 0; x < width; ++x, src += 4)
+				{
+					// ARGB32 is premultiplied
+					unsigned int a = src[3];
+					unsigned int r = (src[0] * a + 127) / 255;
+					unsigned int g = (src[1] * a + 127) / 255;
+					unsigned int b = (src[2] * a + 127) / 255;
+					dest[x] = (a << 24) | (r << 16) | (g << 8) | b;
+				}
+			}
+			cairo_surface_mark_dirty(surface);
+			stbi_image_free((void*)image);
+
+			return std::move(Image(surface));
+		}
+
+		// From pixels in the layout of getImageData()
+		Image createImage(const ImageData& imgData)
+		{
+			int width = imgData.width();
+			int height = imgData.height();
+			cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+			cairo_surface_flush(surface);
+			unsigned char* data = cairo_image_surface_get_data(surface);
+			int stride = cairo_image_surface_get_stride(surface);
+			for (int y = 0; y < height; ++y)
+				memcpy(data + y * stride, imgData.data() + y * width * 4, width * 4);
+			cairo_surface_mark_dirty(surface);
+
+			return std::move(Image(surface));
+		}
+
+		void drawImage(const Image& image, double x, double y)
+		{
+			cairo_surface_t* src = image.getSurface();
+			if (src == nullptr)
+				return;
+			int width = cairo_image_surface_get_width(src);
+			int height = cairo_image_surface_get_height(src);
+			drawSurface(src, 0.0, 0.0, width, height, x, y, width, height);
+		}
+
+		void drawImage(const Image& image, double x, double y, double width, double height)
+		{
+			cairo_surface_t* src = image.getSurface();
+			if (src == nullptr)
+				return;
+			drawSurface(src, 0.0, 0.0, cairo_image_surface_get_width(src), cairo_image_surface_get_height(src),
+				x, y, width, height);
+		}
+
+		Pattern createPattern(const Image& image, RepeatPattern rp)
+		{
+			cairo_surface_t* surface = image.getSurface();
+			if (surface)
+				cairo_surface_reference(surface);
+			cairo_pattern_t* pattern = cairo_pattern_create_for_surface(surface);
+
+			cairo_extend_t extend = CAIRO_EXTEND_REPEAT;
+			if (rp == RepeatPattern::no_repeat)
+				extend = CAIRO_EXTEND_NONE;
+
+			cairo_pattern_set_extend(pattern, extend);
+
+			return std::move(Pattern(surface, pattern, nullptr));
+		}
+
+		// Places the top left pixel of this canvas at (x, y) of a larger canvas,
+		// so that the same drawing calls render one tile of it.
+		void setOrigin(int x, int y)
+		{
+			m_OriginX = x;
+			m_OriginY = y;
+			cairo_surface_set_device_offset(surface, -x, -y);
+		}
+
+		// Makes the canvas like a new one, but transparent instead of white: clears
+		// every pixel and sets the state, transform, clip, path and origin back to
+		// the defaults. The surface, the context and the caches are kept.
+		void reset()
+		{
+			while (!m_SaveStack.empty())
+				restore();
+			cairo_identity_matrix(cr);
+			cairo_reset_clip(cr);
+			cairo_new_path(cr);
+			m_Clipped = false;
+			setOrigin(0, 0);
+
+			fillStyle = "black";
+			font.reset();
+			lineCap = LineCap::butt;
+			lineJoin = LineJoin::miter;
+			lineWidth = 1.0;
+			miterLimit = 10.0;
+			globalCompositeOperation = GlobalCompositeOperationType::source_over;
+			shadowOffsetX = 0.0;
+			shadowOffsetY = 0.0;
+			shadowColor = 0u;
+			shadowBlur = 0u;
+			textRenderMode = TextRenderMode::cairo;
+			pointRenderMode = PointRenderMode::cairo;
+			textAlign = TextAlign::start;
+			textBaseline = TextBaseline::alphabetic;
+			fontFeatures = "";
+
+			cairo_surface_flush(surface);
+			memset(cairo_image_surface_get_data(surface), 0, cairo_image_surface_get_stride(surface) * m_Height);
+			cairo_surface_mark_dirty(surface);
+			m_Damaged = false;
+			addDamage(0.0, 0.0, m_Width, m_Height);
+		}
+
+		// Resizes and resets the canvas. The pixels are kept when they are enough
+		// for the new size, then only the surface and the context are created again.
+		// A canvas over the pixels of the caller moves to ARGB32 pixels of its own.
+		void resize(int width, int height)
+		{
+			if (width != m_Width || height != m_Height)
+			{
+				cairo_destroy(cr);
+				if (m_Pool)
+				{
+					m_Pool->release(surface);
+					surface = m_Pool->acquire(width, height);
+				}
+				else
+				{
+					cairo_surface_destroy(surface);
+					createSurface(width, height);
+				}
+				m_Width = width;
+				m_Height = height;
+				// the saves went with the old context
+				m_SaveStack.clear();
+				init();
+			}
+			reset();
+		}
+
+		// Moves a canvas over the pixels of the caller to the next frame of a ring,
+		// at data, with the same size, stride and format. cairo ties a context to
+		// its surface for good, so the context is created again, but with the state
+		// of the last one: styles, line and font settings, transform and origin.
+		// The path, the clip and the saved states belong to the last frame.
+		void rebind(unsigned char* data)
+		{
+			while (!m_SaveStack.empty())
+				restore();
+
+			cairo_surface_t* next = cairo_image_surface_create_for_data(data, cairo_image_surface_get_format(surface),
+				m_Width, m_Height, cairo_image_surface_get_stride(surface));
+			cairo_surface_set_device_offset(next, -m_OriginX, -m_OriginY);
+			cairo_t* next_cr = cairo_create(next);
+			copyState(cr, next_cr);
+
+			cairo_destroy(cr);
+			cairo_surface_destroy(surface);
+			surface = next;
+			cr = next_cr;
+			bindProperties();
+			m_Clipped = false;
+		}
+
+		int getWidth() const
+		{
+			return m_Width;
+		}
+		int getHeight() const
+		{
+			return m_Height;
+		}
+
+		void fillRect(double x, double y, double width, double height)
+		{
+			if (shadowColor.isTransparent() == false)
+			{
+				int blur_cnt = shadowBlur;
+				if (blur_cnt <= 0)
+				{
+					save();
+
+					setShadowColor(cr);
+
+					cairo_rectangle(cr, x + shadowOffsetX, y + shadowOffsetY, width, height);
+					cairo_fill(cr);
+
+					restore();
+				}
+				else
+				{
+					save();
+
+					cairo_surface_t* mask_surface = createMaskSurface();
+					cairo_t* mask_cr = cairo_create(mask_surface);
+
+					double offset_x = shadowOffsetX;
+					double offset_y = shadowOffsetY;
+
+					cairo_set_source_rgba(mask_cr, 0, 0, 1.0, 1.0);
+
+					cairo_rectangle(mask_cr, x + shadowOffsetX, y + shadowOffsetY, width, height);
+					cairo_fill(mask_cr);
+
+					cairo_surface_flush(surface);
+					cairo_surface_flush(mask_surface);
+					unsigned char* dest_pixel = cairo_image_surface_get_data(surface);
+
+					unsigned char* src_pixel = cairo_image_surface_get_data(mask_surface);
+
+					applyBoxBlur(shadowBlur, src_pixel);
+
+					applyShadow(src_pixel, dest_pixel);
+
+					cairo_surface_mark_dirty(surface);
+
+					cairo_destroy(mask_cr);
+					cairo_surface_destroy(mask_surface);
+					mask_cr = nullptr;
+					mask_surface = nullptr;
+
+					restore();
+				}
+			}
+			cairo_rectangle(cr, x, y, width, height);
+			damagePath(false);
+			cairo_fill(cr);
+		}
+
+		void clearRect(double x, double y, double width, double height)
+		{
+			ImageData imgData = createImageData("imgData", width, height);
+
+			for (int y = 0; y < imgData.height(); ++y)
+			{
+				for (int x = 0; x < imgData.width(); ++x)
+				{
+					int index = (y * imgData.width() + x) * 4;
+					imgData.data()[index] = 0xff;
+					imgData.data()[index + 1] = 0xff;
+					imgData.data()[index + 2] = 0xff;
+					imgData.data()[index + 3] = 0xff;
+				}
+
+			}
+			
+			putImageData(imgData, x, y, 0, 0, width, height);
+		}
+
+		void strokeRect(double x, double y, double width, double height)
+		{
+			if (shadowColor.isTransparent() == false)
+			{
+				int blur_cnt = shadowBlur;
+				if (blur_cnt <= 0)
+				{
+					save();
+
+					setShadowColor(cr);
+
+					cairo_rectangle(cr, x + shadowOffsetX, y + shadowOffsetY, width, height);
+					cairo_stroke(cr);
+
+					restore();
+				}
+				else
+				{
+					save();
+
+					cairo_surface_t* mask_surface = createMaskSurface();
+					cairo_t* mask_cr = cairo_create(mask_surface);
+
+					double offset_x = shadowOffsetX;
+					double offset_y = shadowOffsetY;
+
+					cairo_set_source_rgba(mask_cr, 0, 0, 1.0, 1.0);
+
+					cairo_rectangle(mask_cr, x + shadowOffsetX, y + shadowOffsetY, width, height);
+					cairo_stroke(mask_cr);
 
 					cairo_surface_flush(surface);
 					cairo_surface_flush(mask_surface);
@@ -996,179 +2233,1146 @@ namespace canvas
 
 					cairo_surface_mark_dirty(surface);
 
-					cairo_destroy(mask_cr);
-					cairo_surface_destroy(mask_surface);
-					mask_cr = nullptr;
-					mask_surface = nullptr;
+					cairo_destroy(mask_cr);
+					cairo_surface_destroy(mask_surface);
+					mask_cr = nullptr;
+					mask_surface = nullptr;
+
+					restore();
+				}
+			}
+			cairo_rectangle(cr, x, y, width, height);
+			damagePath(true);
+			cairo_stroke(cr);
+		}
+
+		// Bulk versions of fillRect, of moveTo, lineTo and stroke per line, and of
+		// a filled arc or square per point. colors holds one 0xRRGGBB per item, or
+		// is null to use the current style. The items of one color are drawn as one
+		// path in order of first appearance of the color, so overlapping items of
+		// different colors may not stack in the order given. The current path is
+		// replaced.
+		void fillRects(const Rect* rects, size_t count, const unsigned int* colors = nullptr)
+		{
+			if (count == 0)
+				return;
+
+			AtlasState state;
+			if (shadowColor.isTransparent() && getAtlasState(state) && (colors != nullptr || (state.color >> 24) == 0xff))
+			{
+				// pixel aligned rectangles are written straight into the surface
+				fillAlignedRects(state, rects, count, colors);
+				rects = m_UnalignedRects.data();
+				count = m_UnalignedRects.size();
+				colors = (colors != nullptr) ? m_UnalignedColors.data() : nullptr;
+				if (count == 0)
+				{
+					cairo_new_path(cr);
+					return;
+				}
+			}
+
+			drawGrouped(count, colors, false, [&](size_t i)
+			{
+				cairo_rectangle(cr, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+			});
+		}
+
+		void fillRects(const std::vector<Rect>& rects)
+		{
+			fillRects(rects.data(), rects.size());
+		}
+
+		void fillRects(const std::vector<Rect>& rects, const std::vector<unsigned int>& colors)
+		{
+			fillRects(rects.data(), rects.size(), colors.empty() ? nullptr : colors.data());
+		}
+
+		void strokeSegments(const Line* lines, size_t count, const unsigned int* colors = nullptr)
+		{
+			drawGrouped(count, colors, true, [&](size_t i)
+			{
+				cairo_move_to(cr, lines[i].x0, lines[i].y0);
+				cairo_line_to(cr, lines[i].x1, lines[i].y1);
+			});
+		}
+
+		void strokeSegments(const std::vector<Line>& lines)
+		{
+			strokeSegments(lines.data(), lines.size());
+		}
+
+		void strokeSegments(const std::vector<Line>& lines, const std::vector<unsigned int>& colors)
+		{
+			strokeSegments(lines.data(), lines.size(), colors.empty() ? nullptr : colors.data());
+		}
+
+		void drawPoints(const Point* points, size_t count, double radius, PointShape shape, const unsigned int* colors = nullptr)
+		{
+			if (stampPoints(points, count, radius, shape, colors, nullptr, nullptr))
+				return;
+
+			if (shape == PointShape::square)
+			{
+				m_PointRects.resize(count);
+				for (size_t i = 0; i < count; ++i)
+				{
+					Rect rc = { points[i].x - radius, points[i].y - radius, 2.0 * radius, 2.0 * radius };
+					m_PointRects[i] = rc;
+				}
+				fillRects(m_PointRects.data(), count, colors);
+				return;
+			}
+
+			drawGrouped(count, colors, false, [&](size_t i)
+			{
+				cairo_new_sub_path(cr);
+				cairo_arc(cr, points[i].x, points[i].y, radius, 0.0, 6.283185307179586);
+			});
+		}
+
+		void drawPoints(const std::vector<Point>& points, double radius, PointShape shape)
+		{
+			drawPoints(points.data(), points.size(), radius, shape);
+		}
+
+		void drawPoints(const std::vector<Point>& points, double radius, PointShape shape, const std::vector<unsigned int>& colors)
+		{
+			drawPoints(points.data(), points.size(), radius, shape, colors.empty() ? nullptr : colors.data());
+		}
+
+		// Points colored by palette[indices[i]]
+		void drawPoints(const Point* points, size_t count, double radius, PointShape shape,
+			const unsigned char* indices, const unsigned int* palette)
+		{
+			if (stampPoints(points, count, radius, shape, nullptr, indices, palette))
+				return;
+
+			m_PaletteColors.resize(count);
+			for (size_t i = 0; i < count; ++i)
+				m_PaletteColors[i] = palette[indices[i]];
+			drawPoints(points, count, radius, shape, m_PaletteColors.data());
+		}
+
+		void drawPoints(const std::vector<Point>& points, double radius, PointShape shape,
+			const std::vector<unsigned char>& indices, const std::vector<unsigned int>& palette)
+		{
+			drawPoints(points.data(), points.size(), radius, shape, indices.data(), palette.data());
+		}
+
+		// Strokes the points as one polyline, decimated under the current transform
+		// by decimatePolyline with PolylineLod::m4. The current path is replaced.
+		void strokePolyline(const Point* points, size_t count, PolylineLod lod = PolylineLod::m4)
+		{
+			if (lod == PolylineLod::m4)
+			{
+				double mat[6];
+				getMatrix(mat);
+				m_PolylinePoints.clear();
+				decimatePolyline(points, count, mat, m_PolylinePoints);
+				points = m_PolylinePoints.data();
+				count = m_PolylinePoints.size();
+			}
+			drawPolyline(points, count);
+		}
+
+		void strokePolyline(const std::vector<Point>& points, PolylineLod lod = PolylineLod::m4)
+		{
+			strokePolyline(points.data(), points.size(), lod);
+		}
+
+		// Draws a grid of rows x cols values, stored row by row, over dest. low and
+		// high map to the first and the last color of the colormap, NaN to the first.
+		// dest on whole pixels under a translation is written directly, in bands of
+		// rows on the pool if one is given. Inside a job of a pool, such as a tile
+		// of TileRenderer, the bands run on the calling thread. Otherwise the grid is drawn as an image
+		// through the current transform and bilinear blends colors instead of values.
+		void drawHeatmap(const float* values, int cols, int rows, const Rect& dest, const Colormap& colormap,
+			double low, double high, HeatmapFilter filter = HeatmapFilter::nearest, ThreadPool* pool = nullptr)
+		{
+			if (cols <= 0 || rows <= 0 || dest.width <= 0.0 || dest.height <= 0.0)
+				return;
+
+			HeatmapJob job;
+			job.values = values;
+			job.cols = cols;
+			job.rows = rows;
+			job.colors = colormap.data();
+			job.low = (float)low;
+			job.scale = (high > low) ? (float)(255.0 / (high - low)) : 0.0f;
+			job.bilinear = (filter == HeatmapFilter::bilinear);
+
+			AtlasState state;
+			if (shadowColor.isTransparent() && getAtlasState(state, false))
+			{
+				double left = dest.x + state.tx;
+				double top = dest.y + state.ty;
+				double right = left + dest.width;
+				double bottom = top + dest.height;
+				if (left == floor(left) && top == floor(top) && right == floor(right) && bottom == floor(bottom))
+				{
+					drawHeatmapPixels(job, state, left, top, right, bottom, pool);
+					return;
+				}
+			}
+			drawHeatmapImage(job, dest);
+		}
+
+		void drawHeatmap(const std::vector<float>& values, int cols, int rows, const Rect& dest, const Colormap& colormap,
+			double low, double high, HeatmapFilter filter = HeatmapFilter::nearest, ThreadPool* pool = nullptr)
+		{
+			drawHeatmap(values.data(), cols, rows, dest, colormap, low, high, filter, pool);
+		}
+
+		// Only the columns of the canvas and their neighbours are visited
+		void strokePolyline(const PolylinePyramid& pyramid)
+		{
+			double mat[6];
+			getMatrix(mat);
+			double pad = strokeExtent() * fabs(mat[0]) + 1.0;
+			m_PolylinePoints.clear();
+			decimatePolyline(pyramid, mat, m_OriginX - pad, m_OriginX + m_Width + pad, m_PolylinePoints);
+			drawPolyline(m_PolylinePoints.data(), m_PolylinePoints.size());
+		}
+
+		void fillText(const char* text, double x, double y)
+		{
+			TextItem item = { text, x, y, false, 0 };
+			drawTextBatch(&item, 1, false);
+		}
+
+		void strokeText(const char* text, double x, double y)
+		{
+			TextItem item = { text, x, y, false, 0 };
+			drawTextBatch(&item, 1, true);
+		}
+
+		TextMetrics measureText(const char* text)
+		{
+			const TextRun& run = m_TextRuns.getRun(cr, font.getFont(), fontFeatures.getFeatures(), text);
+			TextMetrics tm = { run.advance };
+			return tm;
+		}
+
+		void fillTextBatch(const TextItem* items, size_t count)
+		{
+			drawTextBatch(items, count, false);
+		}
+
+		void fillTextBatch(const std::vector<TextItem>& items)
+		{
+			drawTextBatch(items.data(), items.size(), false);
+		}
+
+		void strokeTextBatch(const TextItem* items, size_t count)
+		{
+			drawTextBatch(items, count, true);
+		}
+
+		void strokeTextBatch(const std::vector<TextItem>& items)
+		{
+			drawTextBatch(items.data(), items.size(), true);
+		}
+
+		// Wraps text at spaces to fit maxWidth and draws one line every lineHeight,
+		// aligned inside [x, x + maxWidth]. Line i is placed at y + i * lineHeight
+		// like fillText with the current textBaseline. Returns the ink box of the lines.
+		Rect fillTextBox(const char* text, double x, double y, double maxWidth, double lineHeight, TextAlign align)
+		{
+			const TextLayout& layout = layoutText(text, maxWidth);
+
+			m_BoxItems.clear();
+			Rect box = { x, y, 0.0, 0.0 };
+			double left = x + maxWidth;
+			double right = x;
+			for (size_t i = 0; i < layout.lines.size(); ++i)
+			{
+				double line_x = x;
+				if (align == TextAlign::end || align == TextAlign::right)
+					line_x = x + maxWidth - layout.widths[i];
+				else if (align == TextAlign::center)
+					line_x = x + (maxWidth - layout.widths[i]) / 2.0;
+
+				if (line_x < left)
+					left = line_x;
+				if (line_x + layout.widths[i] > right)
+					right = line_x + layout.widths[i];
+
+				TextItem item = { layout.lines[i].c_str(), line_x, y + i * lineHeight, false, 0 };
+				m_BoxItems.push_back(item);
+			}
+			if (m_BoxItems.empty())
+				return box;
+
+			// lines are already aligned horizontally
+			TextAlign saved_align = textAlign;
+			textAlign = TextAlign::left;
+			drawTextBatch(m_BoxItems.data(), m_BoxItems.size(), false);
+			textAlign = saved_align;
+
+			double baseline_x = 0.0;
+			double baseline_y = y;
+			alignText(0.0, baseline_x, baseline_y);
+			const FontMetricsCache::Metrics& metrics = m_FontMetrics.getMetrics(cr, font.getFont());
+			box.x = left;
+			box.y = baseline_y - metrics.ascent;
+			box.width = right - left;
+			box.height = (layout.lines.size() - 1) * lineHeight + metrics.ascent + metrics.descent;
+			return box;
+		}
+
+		void rect(double x, double y, double width, double height)
+		{
+			cairo_rectangle(cr, x, y, width, height);
+		}
+
+		void beginPath()
+		{
+			cairo_new_path(cr);
+		}
+
+		void closePath()
+		{
+			cairo_close_path(cr);
+		}
+
+		bool isPointInPath(double x, double y)
+		{
+			return (cairo_in_stroke(cr, x, y) > 0);
+		}
+
+		bool isPointInPath(Path2D& path, double x, double y)
+		{
+			cairo_path_t* current = swapPath(path);
+			bool inside = (cairo_in_fill(cr, x, y) > 0);
+			restorePath(current);
+			return inside;
+		}
+
+		void moveTo(double x, double y)
+		{
+			cairo_move_to(cr, x, y);
+		}
+
+		void lineTo(double x, double y)
+		{
+			cairo_line_to(cr, x, y);
+		}
+
+		// https://www.geeksforgeeks.org/cubic-bezier-curve-implementation-in-c/
+		// https://pomax.github.io/bezierinfo/
+		void bezierCurveTo(double cp1x, double cp1y, double cp2x, double cp2y, double endx, double endy)
+		{
+			cairo_curve_to(cr,
+				cp1x, cp1y,
+				cp2x, cp2y,
+				endx, endy);
+		}
+		// A quadratic is exactly the cubic with its control point elevated by 2/3
+		void quadraticCurveTo(double cpx, double cpy, double endx, double endy)
+		{
+			if (!cairo_has_current_point(cr))
+				cairo_move_to(cr, cpx, cpy);
+
+			double x0 = 0.0, y0 = 0.0;
+			cairo_get_current_point(cr, &x0, &y0);
+
+			cairo_curve_to(cr,
+				x0 + 2.0 / 3.0 * (cpx - x0), y0 + 2.0 / 3.0 * (cpy - y0),
+				endx + 2.0 / 3.0 * (cpx - endx), endy + 2.0 / 3.0 * (cpy - endy),
+				endx, endy);
+		}
+
+		void clip()
+		{
+			cairo_clip(cr);
+			m_Clipped = true;
+		}
+
+		// the Path2D overloads leave the current path untouched
+		void clip(Path2D& path)
+		{
+			cairo_path_t* current = swapPath(path);
+			clip();
+			restorePath(current);
+		}
+
+		void arc(double xc, double yc,
+			double radius,
+			double angle1, double angle2)
+		{
+			cairo_arc(cr, xc, yc, radius, angle1, angle2);
+		}
+
+		void stroke()
+		{
+			if (shadowColor.isTransparent() == false)
+			{
+				save();
+
+				cairo_surface_t* mask_surface = createMaskSurface();
+				cairo_t* mask_cr = cairo_create(mask_surface);
+
+				cairo_path_t* path = copyPath(cr, mask_cr);
+
+				cairo_set_source_rgba(mask_cr, 0, 0, 1.0, 1.0);
+
+				cairo_stroke(mask_cr);
+
+				cairo_surface_flush(surface);
+				cairo_surface_flush(mask_surface);
+				unsigned char* dest_pixel = cairo_image_surface_get_data(surface);
+
+				unsigned char* src_pixel = cairo_image_surface_get_data(mask_surface);
+
+				applyBoxBlur(shadowBlur, src_pixel);
+
+				applyShadow(src_pixel, dest_pixel);
+
+				cairo_surface_mark_dirty(surface);
+
+				cairo_destroy(mask_cr);
+				cairo_surface_destroy(mask_surface);
+				mask_cr = nullptr;
+				mask_surface = nullptr;
+
+				cairo_path_destroy(path);
+
+				restore();
+			}
+
+			damagePath(true);
+			cairo_stroke(cr);
+		}
+
+		void fill()
+		{
+			if (shadowColor.isTransparent() == false)
+			{
+				save();
+
+				cairo_surface_t* mask_surface = createMaskSurface();
+				cairo_t* mask_cr = cairo_create(mask_surface);
+
+				cairo_path_t* path = copyPath(cr, mask_cr);
+
+				cairo_set_source_rgba(mask_cr, 0, 0, 1.0, 1.0);
+
+				cairo_fill(mask_cr);
+
+				cairo_surface_flush(surface);
+				cairo_surface_flush(mask_surface);
+				unsigned char* dest_pixel = cairo_image_surface_get_data(surface);
+
+				unsigned char* src_pixel = cairo_image_surface_get_data(mask_surface);
+				
+				applyBoxBlur(shadowBlur, src_pixel);
+				//applyGaussianBlur(shadowBlur, src_pixel);
+
+				applyShadow(src_pixel, dest_pixel);
+
+				cairo_surface_mark_dirty(surface);
+
+				cairo_destroy(mask_cr);
+				cairo_surface_destroy(mask_surface);
+				mask_cr = nullptr;
+				mask_surface = nullptr;
+
+				cairo_path_destroy(path);
+
+				restore();
+			}
+
+			damagePath(false);
+			cairo_fill(cr);
+		}
+
+		void fill(Path2D& path)
+		{
+			cairo_path_t* current = swapPath(path);
+			fill();
+			restorePath(current);
+		}
+
+		void stroke(Path2D& path)
+		{
+			cairo_path_t* current = swapPath(path);
+			stroke();
+			restorePath(current);
+		}
+
+		void scale(double sx, double sy)
+		{
+			cairo_scale(cr, sx, sy);
+		}
+
+		void translate(double tx, double ty)
+		{
+			cairo_translate(cr, tx, ty);
+		}
+
+		void rotate(double angle)
+		{
+			cairo_rotate(cr, angle);
+		}
+
+		void transform(double xx, double xy, double yx, double yy, double x0, double y0)
+		{
+			_cairo_matrix mat = {};
+			mat.xx = xx;
+			mat.xy = xy;
+			mat.yx = yx;
+			mat.yy = yy;
+			mat.x0 = x0;
+			mat.y0 = y0;
+
+			cairo_transform(cr, &mat);
+		}
+
+		void setTransform(double xx, double xy, double yx, double yy, double x0, double y0)
+		{
+			cairo_identity_matrix(cr);
+			transform(xx, xy, yx, yy, x0, y0);
+		}
+
+		// https://github.com/aleksaro/gloom/wiki/Loading-images-with-stb
+		void drawImage(const char* image_file, double x0, double y0)
+		{
+			int width, height, channels;
+			//stbi_set_flip_vertically_on_load(true);
+			unsigned char* image = stbi_load(image_file,
+				&width,
+				&height,
+				&channels,
+				STBI_rgb);
+
+			ImageData imgData = createImageData("imgData", width, height);
+			unsigned char* dest_pixel = imgData.data();
+			for (int y = 0; y < imgData.height(); ++y)
+			{
+				for (int x = 0; x < imgData.width(); ++x)
+				{
+					int index = (y * imgData.width() + x) * 4;
+					int src_index = (y * imgData.width() + x) * 3;
+					dest_pixel[index] = image[src_index + 2];
+					dest_pixel[index + 1] = image[src_index + 1];
+					dest_pixel[index + 2] = image[src_index + 0];
+					dest_pixel[index + 3] = 0xff;
+				}
+
+			}
+
+			putImageData(imgData, x0, y0, 0, 0, width, height);
+
+			stbi_image_free((void*)image);
+		}
+
+		Gradient createLinearGradient(const char* name, double x0, double y0, double x1, double y1)
+		{
+			return std::move(Gradient(cairo_pattern_create_linear(x0, y0, x1, y1)));
+		}
+
+		Gradient createRadialGradient(const char* name, double x0, double y0, double r0, double x1, double y1, double r1)
+		{
+			return std::move(Gradient(cairo_pattern_create_radial(x0, y0, r0, x1, y1, r1)));
+		}
+
+		// The names of the resources are optional
+		Gradient createLinearGradient(double x0, double y0, double x1, double y1)
+		{
+			return createLinearGradient("", x0, y0, x1, y1);
+		}
+
+		Gradient createRadialGradient(double x0, double y0, double r0, double x1, double y1, double r1)
+		{
+			return createRadialGradient("", x0, y0, r0, x1, y1, r1);
+		}
+
+		Pattern createPattern(const char* image_file, RepeatPattern rp)
+		{
+			return createPattern("", image_file, rp);
+		}
+
+		ImageData createImageData(int width, int height)
+		{
+			return createImageData("", width, height);
+		}
+
+		ImageData getImageData(int x, int y, int width, int height)
+		{
+			return getImageData("", x, y, width, height);
+		}
+
+		Pattern createPattern(const char* name, const char* image_file, RepeatPattern rp)
+		{
+			int width, height, channels;
+			//stbi_set_flip_vertically_on_load(true);
+			unsigned char* image = stbi_load(image_file,
+				&width,
+				&height,
+				&channels,
+				STBI_rgb);
+
+			unsigned char* dest_pixel = new unsigned char[width * height * 4];
+			for (int y = 0; y < height; ++y)
+			{
+				for (int x = 0; x < width; ++x)
+				{
+					int index = (y * width + x) * 4;
+					int src_index = (y * width + x) * 3;
+					dest_pixel[index] = image[src_index + 2];
+					dest_pixel[index + 1] = image[src_index + 1];
+					dest_pixel[index + 2] = image[src_index + 0];
+					dest_pixel[index + 3] = 0xff;
+				}
+
+			}
+
+			cairo_surface_t* surface = 
+				cairo_image_surface_create_for_data(dest_pixel,
+					CAIRO_FORMAT_ARGB32,
+					width,
+					height,
+					width * 4);
+
+			cairo_pattern_t* pattern =
+				cairo_pattern_create_for_surface(surface);
+
+
+			cairo_extend_t extend = CAIRO_EXTEND_REPEAT;
+			if (rp == RepeatPattern::no_repeat)
+				extend = CAIRO_EXTEND_NONE;
+
+			cairo_pattern_set_extend(pattern, extend);
+
+			stbi_image_free((void*)image);
+
+			return std::move(Pattern(surface, pattern, dest_pixel));
+		}
+
+		// https://cairographics.org/manual/cairo-Image-Surfaces.html
+		ImageData createImageData(const char* name, int width, int height)
+		{
+			unsigned char* data = new unsigned char[width * height * 4];
+			return std::move(ImageData(data, width, height));
+		}
+
+		// As in the browser, the dirty rectangle of imgData is put at (x + dirtyX, y + dirtyY).
+		// A dirtyWidth or dirtyHeight of 0 reaches the edge of imgData.
+		void putImageData(ImageData& imgData, int x, int y, int dirtyX = 0, int dirtyY = 0, int dirtyWidth = 0, int dirtyHeight = 0)
+		{
+			cairo_surface_flush(surface);
+			unsigned char* dest_pixel = cairo_image_surface_get_data(surface);
+			int dest_stride = cairo_image_surface_get_stride(surface);
+			int dest_width = cairo_image_surface_get_width(surface);
+			int dest_height = cairo_image_surface_get_height(surface);
+			if (dirtyWidth == 0)
+				dirtyWidth = imgData.width() - dirtyX;
+			if (dirtyHeight == 0)
+				dirtyHeight = imgData.height() - dirtyY;
+			int x0 = std::max(dirtyX, 0);
+			int y0 = std::max(dirtyY, 0);
+			int x1 = std::min(dirtyX + dirtyWidth, imgData.width());
+			int y1 = std::min(dirtyY + dirtyHeight, imgData.height());
+			if (x0 >= x1 || y0 >= y1)
+				return;
+			addDamage(x + x0, y + y0, x + x1, y + y1);
+			x -= m_OriginX;
+			y -= m_OriginY;
+
+			unsigned char* src_pixel = imgData.data();
+			for (int ty = y0; ty < y1; ++ty)
+			{
+				int dest_y = y + ty;
+				if (dest_y < 0 || dest_y >= dest_height)
+					continue;
+				for (int tx = x0; tx < x1; ++tx)
+				{
+					int dest_x = x + tx;
+					if (dest_x < 0 || dest_x >= dest_width)
+						continue;
+					int src_index = (ty * imgData.width() + tx) * 4;
+					int dest_index = dest_y * dest_stride + dest_x * 4;
+					dest_pixel[dest_index] = src_pixel[src_index];
+					dest_pixel[dest_index + 1] = src_pixel[src_index + 1];
+					dest_pixel[dest_index + 2] = src_pixel[src_index + 2];
+					dest_pixel[dest_index + 3] = src_pixel[src_index + 3];
+				}
+			}
+
+			cairo_surface_mark_dirty(surface);
+		}
+
+		ImageData getImageData(const char* name, int x, int y, int width, int height)
+		{
+			ImageData imgData = createImageData(name, width, height);
+			getImageData(imgData, x, y);
+			return imgData;
+		}
+
+		// Reads into the pixels of imgData, so that an effect run every frame does not allocate
+		void getImageData(ImageData& imgData, int x, int y)
+		{
+			int width = imgData.width();
+			int height = imgData.height();
+			x -= m_OriginX;
+			y -= m_OriginY;
+			cairo_surface_flush(surface);
+			unsigned char* src_pixel = cairo_image_surface_get_data(surface);
+			int src_stride = cairo_image_surface_get_stride(surface);
+			int src_width = cairo_image_surface_get_width(surface);
+			int src_height = cairo_image_surface_get_height(surface);
+			// the unused byte of RGB24 reads as opaque
+			unsigned char alpha_mask = (cairo_image_surface_get_format(surface) == CAIRO_FORMAT_RGB24) ? 0xff : 0x00;
+
+			unsigned char* dest_pixel = imgData.data();
+			for (int ty = y, dy = 0; ty < src_height && dy < height; ++ty, ++dy)
+			{
+				if (ty < 0)
+					continue;
+				for (int tx = x, dx = 0; tx < src_width && dx < width; ++tx, ++dx)
+				{
+					if (tx < 0)
+						continue;
+					int src_index = ty * src_stride + tx * 4;
+					int dest_index = (dy * width + dx) * 4;
+					dest_pixel[dest_index] = src_pixel[src_index];
+					dest_pixel[dest_index + 1] = src_pixel[src_index + 1];
+					dest_pixel[dest_index + 2] = src_pixel[src_index + 2];
+					dest_pixel[dest_index + 3] = src_pixel[src_index + 3] | alpha_mask;
+				}
+			}
+		}
+
+		void save()
+		{
+			cairo_save(cr);
+			SavedState state = { m_Clipped, font.getFont(), fontFeatures.getFeatures(),
+				textAlign, textBaseline, textRenderMode, pointRenderMode };
+			m_SaveStack.push_back(state);
+		}
 
-					restore();
-				}
+		void restore()
+		{
+			cairo_restore(cr);
+			if (!m_SaveStack.empty())
+			{
+				const SavedState& state = m_SaveStack.back();
+				m_Clipped = state.clipped;
+				font.restoreFont(state.font);
+				fontFeatures = state.fontFeatures.c_str();
+				textAlign = state.textAlign;
+				textBaseline = state.textBaseline;
+				textRenderMode = state.textRenderMode;
+				pointRenderMode = state.pointRenderMode;
+				m_SaveStack.pop_back();
 			}
-			cairo_move_to(cr, x, y);
-			cairo_text_path(cr, text);
-			cairo_stroke(cr);
 		}
 
-		void rect(double x, double y, double width, double height)
+		bool savePng(const char* file)
 		{
-			cairo_rectangle(cr, x, y, width, height);
+			cairo_status_t status = cairo_surface_write_to_png(surface, file);
+			return (status == CAIRO_STATUS_SUCCESS);
 		}
 
-		void beginPath()
+		// Saves only area, such as the one returned by takeDamage()
+		bool savePng(const char* file, const Rect& area)
 		{
-			cairo_new_path(cr);
+			int x0 = (int)floor(area.x) - m_OriginX;
+			int y0 = (int)floor(area.y) - m_OriginY;
+			int x1 = (int)ceil(area.x + area.width) - m_OriginX;
+			int y1 = (int)ceil(area.y + area.height) - m_OriginY;
+			if (x0 < 0) x0 = 0;
+			if (y0 < 0) y0 = 0;
+			if (x1 > m_Width) x1 = m_Width;
+			if (y1 > m_Height) y1 = m_Height;
+			if (x0 >= x1 || y0 >= y1)
+				return false;
+
+			cairo_surface_flush(surface);
+			int stride = cairo_image_surface_get_stride(surface);
+			unsigned char* data = cairo_image_surface_get_data(surface) + y0 * stride + x0 * 4;
+			cairo_surface_t* area_surface = cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32, x1 - x0, y1 - y0, stride);
+			cairo_status_t status = cairo_surface_write_to_png(area_surface, file);
+			cairo_surface_destroy(area_surface);
+			return (status == CAIRO_STATUS_SUCCESS);
 		}
 
-		void closePath()
+		// Returns the pixel bounds of everything drawn since the last call,
+		// shadows included, and starts a new empty area.
+		Rect takeDamage()
 		{
-			cairo_close_path(cr);
+			Rect damage = { 0.0, 0.0, 0.0, 0.0 };
+			if (m_Damaged)
+			{
+				damage.x = m_DamageX0;
+				damage.y = m_DamageY0;
+				damage.width = m_DamageX1 - m_DamageX0;
+				damage.height = m_DamageY1 - m_DamageY0;
+			}
+			m_Damaged = false;
+			return damage;
 		}
 
-		bool isPointInPath(double x, double y)
+		FillStyleProperty fillStyle;
+		StrokeStyleProperty strokeStyle;
+		FontProperty font;
+		LineCapProperty lineCap;
+		LineJoinProperty lineJoin;
+		LineWidthProperty lineWidth;
+		MiterLimitProperty miterLimit;
+		GlobalCompositeOperationProperty globalCompositeOperation;
+		ShadowOffsetProperty shadowOffsetX;
+		ShadowOffsetProperty shadowOffsetY;
+		ShadowColorProperty shadowColor;
+		ShadowBlurProperty shadowBlur;
+		TextRenderModeProperty textRenderMode;
+		PointRenderModeProperty pointRenderMode;
+		TextAlignProperty textAlign;
+		TextBaselineProperty textBaseline;
+		FontFeaturesProperty fontFeatures;
+	protected:
+		// Transparent canvas on a surface of the pool, which takes it back on destroy()
+		Canvas(SurfacePool& pool, int width, int height)
+			: surface(nullptr), cr(nullptr), m_Pool(&pool), m_Width(width), m_Height(height), m_OriginX(0), m_OriginY(0)
+			, m_Damaged(false), m_DamageX0(0), m_DamageY0(0), m_DamageX1(0), m_DamageY1(0), m_Clipped(false)
 		{
-			return (cairo_in_stroke(cr, x, y) > 0);
+			surface = pool.acquire(width, height);
+			init();
+			fillStyle = "black";
 		}
 
-		void moveTo(double x, double y)
+	private:
+		// remove copy constructor and assignment operator
+		Canvas(const Canvas& other) = delete;
+		void operator=(const Canvas& other) = delete;
+
+		// ARGB32 surface on m_Pixels, which are allocated again only when they are too few
+		void createSurface(int width, int height)
 		{
-			cairo_move_to(cr, x, y);
+			int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+			size_t size = (size_t)stride * height;
+			if (m_Pixels.size() < size)
+			{
+				// nothing to copy, the canvas is cleared anyway
+				m_Pixels.clear();
+				m_Pixels.resize(size);
+			}
+			surface = cairo_image_surface_create_for_data(m_Pixels.data(), CAIRO_FORMAT_ARGB32, width, height, stride);
 		}
 
-		void lineTo(double x, double y)
+		void init()
 		{
-			cairo_line_to(cr, x, y);
+			cr = cairo_create(surface);
+			bindProperties();
+
+			lineWidth = 1.0;
 		}
 
-		// https://www.geeksforgeeks.org/cubic-bezier-curve-implementation-in-c/
-		// https://pomax.github.io/bezierinfo/
-		void bezierCurveTo(double cp1x, double cp1y, double cp2x, double cp2y, double endx, double endy)
+		// Points the properties that set cairo state at cr
+		void bindProperties()
 		{
-			cairo_curve_to(cr,
-				cp1x, cp1y,
-				cp2x, cp2y,
-				endx, endy);
+			fillStyle.init(cr);
+			strokeStyle.init(cr);
+			font.init(cr);
+			lineCap.init(cr);
+			lineJoin.init(cr);
+			lineWidth.init(cr);
+			miterLimit.init(cr);
+			globalCompositeOperation.init(cr);
 		}
-		/*
-		void quadraticCurveTo(double cpx, double cpy, double endx, double endy)
+
+		// Copies the drawing state of from to to, without the path and the clip
+		static void copyState(cairo_t* from, cairo_t* to)
 		{
-			double x[3];
-			double y[3];
-			cairo_get_current_point(cr, &x[0], &y[0]);
-			x[1] = cpx;
-			x[2] = endx;
-			y[1] = cpy;
-			y[2] = endy;
-			double xu = 0.0, yu = 0.0, u = 0.0;
-			int i = 0;
-			for (u = 0.0; u <= 1.0; u += 0.0001)
+			cairo_set_source(to, cairo_get_source(from));
+			cairo_set_operator(to, cairo_get_operator(from));
+			cairo_set_tolerance(to, cairo_get_tolerance(from));
+			cairo_set_antialias(to, cairo_get_antialias(from));
+			cairo_set_fill_rule(to, cairo_get_fill_rule(from));
+			cairo_set_line_width(to, cairo_get_line_width(from));
+			cairo_set_line_cap(to, cairo_get_line_cap(from));
+			cairo_set_line_join(to, cairo_get_line_join(from));
+			cairo_set_miter_limit(to, cairo_get_miter_limit(from));
+			int dash_count = cairo_get_dash_count(from);
+			if (dash_count > 0)
 			{
-				xu = pow(1 - u, 2) * x[0] + 2 * (1 - u) * u * x[1] + (u * u) * x[2];
-				yu = pow(1 - u, 2) * y[0] + 2 * (1 - u) * u * y[1] + (u * u) * y[2];
-
-				cairo_line_to(cr, xu, yu);
+				std::vector<double> dashes(dash_count);
+				double offset = 0.0;
+				cairo_get_dash(from, dashes.data(), &offset);
+				cairo_set_dash(to, dashes.data(), dash_count, offset);
 			}
+
+			cairo_matrix_t matrix;
+			cairo_get_matrix(from, &matrix);
+			cairo_set_matrix(to, &matrix);
+			cairo_set_font_face(to, cairo_get_font_face(from));
+			cairo_get_font_matrix(from, &matrix);
+			cairo_set_font_matrix(to, &matrix);
+			cairo_font_options_t* options = cairo_font_options_create();
+			cairo_get_font_options(from, options);
+			cairo_set_font_options(to, options);
+			cairo_font_options_destroy(options);
 		}
-		*/
-		void quadraticCurveTo(double cpx, double cpy, double endx, double endy)
+
+		// Move (x, y) from the textAlign/textBaseline anchor to the left end of the alphabetic baseline
+		void alignText(double advance, double& x, double& y)
+		{
+			TextAlign align = textAlign;
+			if (align == TextAlign::end || align == TextAlign::right)
+				x -= advance;
+			else if (align == TextAlign::center)
+				x -= advance / 2.0;
+
+			TextBaseline baseline = textBaseline;
+			if (baseline == TextBaseline::alphabetic)
+				return;
+
+			const FontMetricsCache::Metrics& metrics = m_FontMetrics.getMetrics(cr, font.getFont());
+			if (baseline == TextBaseline::top)
+				y += metrics.ascent;
+			else if (baseline == TextBaseline::hanging)
+				y += metrics.ascent * 0.8;
+			else if (baseline == TextBaseline::middle)
+				y += (metrics.ascent - metrics.descent) / 2.0;
+			else if (baseline == TextBaseline::ideographic || baseline == TextBaseline::bottom)
+				y -= metrics.descent;
+		}
+
+		// Places the cached runs of the whole batch into one glyph array, then draws it
+		// with a single shadow mask and one cairo call per run of items sharing a color.
+		void drawTextBatch(const TextItem* items, size_t count, bool stroke_text)
 		{
-			double x[3];
-			double y[3];
-			cairo_get_current_point(cr, &x[0], &y[0]);
-			x[1] = cpx;
-			x[2] = endx;
-			y[1] = cpy;
-			y[2] = endy;
+			if (count == 0)
+				return;
+
+			const char* font_key = font.getFont();
+			const char* features = fontFeatures.getFeatures();
+			m_BatchGlyphs.clear();
+			m_BatchEnds.clear();
+			for (size_t i = 0; i < count; ++i)
+			{
+				const TextRun& run = m_TextRuns.getRun(cr, font_key, features, items[i].text);
+				double x = items[i].x;
+				double y = items[i].y;
+				alignText(run.advance, x, y);
+
+				for (size_t g = 0; g < run.glyphs.size(); ++g)
+				{
+					cairo_glyph_t glyph = run.glyphs[g];
+					glyph.x += x;
+					glyph.y += y;
+					m_BatchGlyphs.push_back(glyph);
+				}
+				m_BatchEnds.push_back(m_BatchGlyphs.size());
+			}
+
+			if (!m_BatchGlyphs.empty())
+			{
+				cairo_text_extents_t extents;
+				cairo_glyph_extents(cr, m_BatchGlyphs.data(), (int)m_BatchGlyphs.size(), &extents);
+				addUserDamage(extents.x_bearing, extents.y_bearing,
+					extents.x_bearing + extents.width, extents.y_bearing + extents.height,
+					stroke_text ? strokeExtent() : 0.0);
+			}
 
-			double hyp1 = hypotenuse(x[0], y[0], x[1], y[1]);
-			double hyp2 = hypotenuse(x[1], y[1], x[2], y[2]);
-			double inc_step = 1.0 / (hyp1 + hyp2);
+			if (shadowColor.isTransparent() == false)
+				drawTextBatchShadow(stroke_text);
 
-			double xu = 0.0, yu = 0.0, u = 0.0;
-			int i = 0;
-			for (u = 0.0; u <= 1.0; u += inc_step)
+			cairo_pattern_t* source = cairo_pattern_reference(cairo_get_source(cr));
+			bool source_changed = false;
+			size_t run_start = 0;
+			for (size_t i = 0; i < count; ++i)
 			{
-				xu = pow(1 - u, 2) * x[0] + 2 * (1 - u) * u * x[1] + (u * u) * x[2];
-				yu = pow(1 - u, 2) * y[0] + 2 * (1 - u) * u * y[1] + (u * u) * y[2];
+				if (i + 1 < count && items[i + 1].hasColor == items[i].hasColor &&
+					(items[i].hasColor == false || items[i + 1].color == items[i].color))
+				{
+					continue; // the next item extends the run
+				}
+
+				if (items[i].hasColor)
+				{
+					unsigned int color = items[i].color;
+					cairo_set_source_rgb(cr, ((color & 0xff0000) >> 16) / 255.0, ((color & 0xff00) >> 8) / 255.0, (color & 0xff) / 255.0);
+					source_changed = true;
+				}
+				else if (source_changed)
+				{
+					cairo_set_source(cr, source);
+					source_changed = false;
+				}
 
-				cairo_line_to(cr, xu, yu);
+				size_t glyph_start = (run_start == 0) ? 0 : m_BatchEnds[run_start - 1];
+				drawGlyphRun(m_BatchGlyphs.data() + glyph_start, (int)(m_BatchEnds[i] - glyph_start), stroke_text);
+				run_start = i + 1;
 			}
+			if (source_changed)
+				cairo_set_source(cr, source);
+			cairo_pattern_destroy(source);
 		}
 
-		void clip()
+		// Replaces the current path with the Path2D and returns the old one, or
+		// nullptr when it is empty. Every path call leaves a current point, so a
+		// path without one is empty and is not copied.
+		cairo_path_t* swapPath(Path2D& path)
 		{
-			cairo_clip(cr);
+			cairo_path_t* current = nullptr;
+			if (cairo_has_current_point(cr))
+				current = cairo_copy_path(cr);
+			cairo_matrix_t mat;
+			cairo_get_matrix(cr, &mat);
+			cairo_new_path(cr);
+			cairo_append_path(cr, path.getPath(mat));
+			return current;
 		}
 
-		void arc(double xc, double yc,
-			double radius,
-			double angle1, double angle2)
+		void restorePath(cairo_path_t* current)
 		{
-			cairo_arc(cr, xc, yc, radius, angle1, angle2);
+			cairo_new_path(cr);
+			if (current == nullptr)
+				return;
+			cairo_append_path(cr, current);
+			cairo_path_destroy(current);
 		}
 
-		void stroke()
+		// Greedy line breaking with the cached advance of every word
+		const TextLayout& layoutText(const char* text, double max_width)
 		{
-			if (shadowColor.isTransparent() == false)
+			const char* font_key = font.getFont();
+			const char* features = fontFeatures.getFeatures();
+			TextLayout* cached = m_TextLayouts.find(font_key, features, max_width, text);
+			if (cached)
+				return *cached;
+
+			TextLayout& layout = m_TextLayouts.add();
+			double space_advance = m_TextRuns.getRun(cr, font_key, features, " ").advance;
+			std::string line;
+			std::string word;
+			double line_width = 0.0;
+			const char* p = text;
+			while (true)
 			{
-				save();
+				char ch = *p;
+				if (ch != ' ' && ch != '\n' && ch != '\0')
+				{
+					word += ch;
+					++p;
+					continue;
+				}
 
-				cairo_surface_t* mask_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, m_Width, m_Height);
-				cairo_t* mask_cr = cairo_create(mask_surface);
+				if (!word.empty())
+				{
+					double word_width = m_TextRuns.getRun(cr, font_key, features, word.c_str()).advance;
+					if (!line.empty() && line_width + space_advance + word_width > max_width)
+					{
+						layout.lines.push_back(line);
+						layout.widths.push_back(line_width);
+						line.clear();
+						line_width = 0.0;
+					}
+					if (!line.empty())
+					{
+						line += ' ';
+						line_width += space_advance;
+					}
+					line += word;
+					line_width += word_width;
+					word.clear();
+				}
 
-				cairo_path_t* path = copyPath(cr, mask_cr);
+				if (ch == '\n' || (ch == '\0' && !line.empty()))
+				{
+					layout.lines.push_back(line);
+					layout.widths.push_back(line_width);
+					line.clear();
+					line_width = 0.0;
+				}
+				if (ch == '\0')
+					break;
+				++p;
+			}
+			return layout;
+		}
 
-				cairo_set_source_rgba(mask_cr, 0, 0, 1.0, 1.0);
+		void drawGlyphRun(const cairo_glyph_t* glyphs, int num_glyphs, bool stroke_text)
+		{
+			if (num_glyphs <= 0)
+				return;
 
-				cairo_stroke(mask_cr);
+			if (stroke_text)
+			{
+				cairo_new_path(cr);
+				cairo_glyph_path(cr, glyphs, num_glyphs);
+				cairo_stroke(cr);
+				return;
+			}
 
-				cairo_surface_flush(surface);
-				cairo_surface_flush(mask_surface);
-				unsigned char* dest_pixel = cairo_image_surface_get_data(surface);
+			AtlasState state;
+			if (textRenderMode == TextRenderMode::glyph_atlas && getAtlasState(state) && compositeGlyphs(state, glyphs, num_glyphs))
+				return;
 
-				unsigned char* src_pixel = cairo_image_surface_get_data(mask_surface);
+			cairo_show_glyphs(cr, glyphs, num_glyphs);
+		}
 
-				applyBoxBlur(shadowBlur, src_pixel);
+		void drawTextBatchShadow(bool stroke_text)
+		{
+			if (m_BatchGlyphs.empty())
+				return;
 
-				applyShadow(src_pixel, dest_pixel);
+			double offset_x = shadowOffsetX;
+			double offset_y = shadowOffsetY;
+			m_ShadowGlyphs.assign(m_BatchGlyphs.begin(), m_BatchGlyphs.end());
+			for (size_t i = 0; i < m_ShadowGlyphs.size(); ++i)
+			{
+				m_ShadowGlyphs[i].x += offset_x;
+				m_ShadowGlyphs[i].y += offset_y;
+			}
+			int num_glyphs = (int)m_ShadowGlyphs.size();
 
-				cairo_surface_mark_dirty(surface);
+			int blur_cnt = shadowBlur;
+			if (blur_cnt <= 0)
+			{
+				save();
 
-				cairo_destroy(mask_cr);
-				cairo_surface_destroy(mask_surface);
-				mask_cr = nullptr;
-				mask_surface = nullptr;
+				setShadowColor(cr);
 
-				cairo_path_destroy(path);
+				if (stroke_text)
+				{
+					cairo_new_path(cr);
+					cairo_glyph_path(cr, &m_ShadowGlyphs[0], num_glyphs);
+					cairo_stroke(cr);
+				}
+				else
+					cairo_show_glyphs(cr, &m_ShadowGlyphs[0], num_glyphs);
 
 				restore();
 			}
-
-			cairo_stroke(cr);
-		}
-
-		void fill()
-		{
-			if (shadowColor.isTransparent() == false)
+			else
 			{
 				save();
 
-				cairo_surface_t* mask_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, m_Width, m_Height);
+				// one mask and one blur for the whole batch
+				cairo_surface_t* mask_surface = createMaskSurface();
 				cairo_t* mask_cr = cairo_create(mask_surface);
 
-				cairo_path_t* path = copyPath(cr, mask_cr);
-
 				cairo_set_source_rgba(mask_cr, 0, 0, 1.0, 1.0);
 
-				cairo_fill(mask_cr);
+				setFont(mask_cr, font.getFont());
+				if (stroke_text)
+				{
+					cairo_glyph_path(mask_cr, &m_ShadowGlyphs[0], num_glyphs);
+					cairo_stroke(mask_cr);
+				}
+				else
+					cairo_show_glyphs(mask_cr, &m_ShadowGlyphs[0], num_glyphs);
 
 				cairo_surface_flush(surface);
 				cairo_surface_flush(mask_surface);
 				unsigned char* dest_pixel = cairo_image_surface_get_data(surface);
 
 				unsigned char* src_pixel = cairo_image_surface_get_data(mask_surface);
-				
+
 				applyBoxBlur(shadowBlur, src_pixel);
-				//applyGaussianBlur(shadowBlur, src_pixel);
 
 				applyShadow(src_pixel, dest_pixel);
 
@@ -1179,235 +3383,591 @@ namespace canvas
 				mask_cr = nullptr;
 				mask_surface = nullptr;
 
-				cairo_path_destroy(path);
-
 				restore();
 			}
-
-			cairo_fill(cr);
 		}
 
-		void scale(double sx, double sy)
+		// Current transform as xx, yx, xy, yy, x0, y0
+		void getMatrix(double mat[6])
 		{
-			cairo_scale(cr, sx, sy);
+			cairo_matrix_t m;
+			cairo_get_matrix(cr, &m);
+			mat[0] = m.xx;
+			mat[1] = m.yx;
+			mat[2] = m.xy;
+			mat[3] = m.yy;
+			mat[4] = m.x0;
+			mat[5] = m.y0;
 		}
 
-		void translate(double tx, double ty)
+		void drawPolyline(const Point* points, size_t count)
 		{
-			cairo_translate(cr, tx, ty);
+			cairo_new_path(cr);
+			if (count == 0)
+				return;
+
+			cairo_move_to(cr, points[0].x, points[0].y);
+			for (size_t i = 1; i < count; ++i)
+				cairo_line_to(cr, points[i].x, points[i].y);
+			stroke();
 		}
 
-		void rotate(double angle)
+		// Adds the items of every color to the path with add_item(i) and fills or
+		// strokes them, shadow included, with one cairo call per color.
+		template <typename AddItem>
+		void drawGrouped(size_t count, const unsigned int* colors, bool stroke_path, AddItem add_item)
 		{
-			cairo_rotate(cr, angle);
+			cairo_new_path(cr);
+			if (count == 0)
+				return;
+
+			if (colors == nullptr)
+			{
+				for (size_t i = 0; i < count; ++i)
+					add_item(i);
+				if (stroke_path)
+					stroke();
+				else
+					fill();
+				return;
+			}
+
+			groupByColor(colors, count);
+			cairo_pattern_t* source = cairo_pattern_reference(cairo_get_source(cr));
+			size_t start = 0;
+			for (size_t g = 0; g < m_GroupColors.size(); ++g)
+			{
+				unsigned int color = m_GroupColors[g];
+				cairo_set_source_rgb(cr, ((color & 0xff0000) >> 16) / 255.0, ((color & 0xff00) >> 8) / 255.0, (color & 0xff) / 255.0);
+				for (size_t j = start; j < m_GroupEnds[g]; ++j)
+					add_item(m_GroupItems[j]);
+				start = m_GroupEnds[g];
+				if (stroke_path)
+					stroke();
+				else
+					fill();
+			}
+			cairo_set_source(cr, source);
+			cairo_pattern_destroy(source);
 		}
 
-		void transform(double xx, double xy, double yx, double yy, double x0, double y0)
+		// Counting sort of the item indices by color, in order of first appearance
+		void groupByColor(const unsigned int* colors, size_t count)
 		{
-			_cairo_matrix mat = {};
-			mat.xx = xx;
-			mat.xy = xy;
-			mat.yx = yx;
-			mat.yy = yy;
-			mat.x0 = x0;
-			mat.y0 = y0;
+			m_GroupIndex.clear();
+			m_GroupColors.clear();
+			m_GroupEnds.clear();
+			m_ItemGroups.resize(count);
+			for (size_t i = 0; i < count; ++i)
+			{
+				unsigned int color = colors[i] & 0xffffff;
+				auto it = m_GroupIndex.find(color);
+				if (it == m_GroupIndex.end())
+				{
+					it = m_GroupIndex.insert(std::make_pair(color, m_GroupColors.size())).first;
+					m_GroupColors.push_back(color);
+					m_GroupEnds.push_back(0);
+				}
+				m_ItemGroups[i] = it->second;
+				++m_GroupEnds[it->second];
+			}
 
-			cairo_transform(cr, &mat);
+			size_t end = 0;
+			for (size_t g = 0; g < m_GroupEnds.size(); ++g)
+			{
+				end += m_GroupEnds[g];
+				m_GroupEnds[g] = end;
+			}
+
+			// fill every group from its end so that the items keep their order
+			m_GroupItems.resize(count);
+			for (size_t i = count; i-- > 0;)
+				m_GroupItems[--m_GroupEnds[m_ItemGroups[i]]] = i;
+			for (size_t g = 0; g + 1 < m_GroupEnds.size(); ++g)
+				m_GroupEnds[g] = m_GroupEnds[g + 1];
+			m_GroupEnds.back() = count;
 		}
 
-		void setTransform(double xx, double xy, double yx, double yy, double x0, double y0)
+		struct AtlasGlyph
 		{
-			cairo_identity_matrix(cr);
-			transform(xx, xy, yx, yy, x0, y0);
+			const GlyphAtlas::Glyph* glyph;
+			int x;
+			int y;
+		};
+
+		struct AtlasState
+		{
+			double tx; // device offset of user space
+			double ty;
+			unsigned int color; // premultiplied ARGB32
+			int clip_x0;
+			int clip_y0;
+			int clip_x1;
+			int clip_y1;
+		};
+
+		// Checks that the current transform, operator, source and clip allow writing
+		// pixels directly, as the glyph atlas and the aligned rectangles do. Without
+		// use_source the source is not checked and the color is black.
+		bool getAtlasState(AtlasState& state, bool use_source = true)
+		{
+			cairo_matrix_t mat;
+			cairo_get_matrix(cr, &mat);
+			if (mat.xx != 1.0 || mat.yy != 1.0 || mat.xy != 0.0 || mat.yx != 0.0)
+				return false; // rotated or scaled
+
+			if (cairo_get_operator(cr) != CAIRO_OPERATOR_OVER)
+				return false;
+
+			double r = 0.0, g = 0.0, b = 0.0, a = 1.0;
+			if (use_source && cairo_pattern_get_rgba(cairo_get_source(cr), &r, &g, &b, &a) != CAIRO_STATUS_SUCCESS)
+				return false; // gradient or pattern
+
+			state.tx = mat.x0 - m_OriginX;
+			state.ty = mat.y0 - m_OriginY;
+			state.clip_x0 = 0;
+			state.clip_y0 = 0;
+			state.clip_x1 = m_Width;
+			state.clip_y1 = m_Height;
+			if (!getDeviceClip(mat, &state.clip_x0, &state.clip_y0, &state.clip_x1, &state.clip_y1))
+				return false;
+
+			unsigned int ia = (unsigned int)(a * 255.0 + 0.5);
+			state.color = (ia << 24) |
+				(mul255((unsigned int)(r * 255.0 + 0.5), ia) << 16) |
+				(mul255((unsigned int)(g * 255.0 + 0.5), ia) << 8) |
+				mul255((unsigned int)(b * 255.0 + 0.5), ia);
+			return true;
 		}
 
-		// https://github.com/aleksaro/gloom/wiki/Loading-images-with-stb
-		void drawImage(const char* image_file, double x0, double y0)
+		struct HeatmapJob
 		{
-			int width, height, channels;
-			//stbi_set_flip_vertically_on_load(true);
-			unsigned char* image = stbi_load(image_file,
-				&width,
-				&height,
-				&channels,
-				STBI_rgb);
+			const float* values;
+			int cols;
+			int rows;
+			const unsigned int* colors;
+			float low;
+			float scale;
+			bool bilinear;
+			double left; // device position of dest
+			double top;
+			double step_x; // cells per device pixel
+			double step_y;
+			int x0; // device pixels to write
+			int x1;
+			unsigned char* data;
+			int stride;
+		};
+
+		void drawHeatmapPixels(HeatmapJob& job, const AtlasState& state,
+			double left, double top, double right, double bottom, ThreadPool* pool)
+		{
+			job.left = left;
+			job.top = top;
+			job.step_x = job.cols / (right - left);
+			job.step_y = job.rows / (bottom - top);
+			left = std::max(left, (double)state.clip_x0);
+			top = std::max(top, (double)state.clip_y0);
+			right = std::min(right, (double)state.clip_x1);
+			bottom = std::min(bottom, (double)state.clip_y1);
+			if (left >= right || top >= bottom)
+				return;
 
-			ImageData imgData = createImageData("imgData", width, height);
-			unsigned char* dest_pixel = imgData.data();
-			for (int y = 0; y < imgData.height(); ++y)
+			job.x0 = (int)left;
+			job.x1 = (int)right;
+			int y0 = (int)top;
+			int y1 = (int)bottom;
+			cairo_surface_flush(surface);
+			job.data = cairo_image_surface_get_data(surface);
+			job.stride = cairo_image_surface_get_stride(surface);
+
+			const int band_height = 64;
+			size_t bands = (size_t)((y1 - y0 + band_height - 1) / band_height);
+			if (pool != nullptr && bands > 1)
+			{
+				pool->parallelFor(bands, [&](size_t band)
+				{
+					int band_y0 = y0 + (int)band * band_height;
+					drawHeatmapRows(job, band_y0, std::min(band_y0 + band_height, y1));
+				});
+			}
+			else
+				drawHeatmapRows(job, y0, y1);
+
+			cairo_surface_mark_dirty(surface);
+			addDamage(job.x0 + m_OriginX, y0 + m_OriginY, job.x1 + m_OriginX, y1 + m_OriginY);
+		}
+
+		// Writes the device rows [y0, y1) of the heatmap, safe to run on several threads
+		static void drawHeatmapRows(const HeatmapJob& job, int y0, int y1)
+		{
+			int width = job.x1 - job.x0;
+			std::vector<int> col0(width);
+			std::vector<int> col1(width);
+			std::vector<float> frac(width);
+			std::vector<unsigned char> indices(std::max(width, job.cols));
+			for (int i = 0; i < width; ++i)
+			{
+				double u = (job.x0 + i + 0.5 - job.left) * job.step_x;
+				if (job.bilinear)
+					u -= 0.5; // relative to the cell centres
+				u = std::min(std::max(u, 0.0), job.cols - 1.0);
+				col0[i] = (int)u;
+				col1[i] = std::min(col0[i] + 1, job.cols - 1);
+				frac[i] = (float)(u - col0[i]);
+			}
+
+			if (!job.bilinear)
 			{
-				for (int x = 0; x < imgData.width(); ++x)
+				// the rows of one cell are copies of its first row
+				int mapped_row = -1;
+				const unsigned int* mapped = nullptr;
+				for (int y = y0; y < y1; ++y)
 				{
-					int index = (y * imgData.width() + x) * 4;
-					int src_index = (y * imgData.width() + x) * 3;
-					dest_pixel[index] = image[src_index + 2];
-					dest_pixel[index + 1] = image[src_index + 1];
-					dest_pixel[index + 2] = image[src_index + 0];
-					dest_pixel[index + 3] = 0xff;
+					unsigned int* dest_row = (unsigned int*)(job.data + y * job.stride) + job.x0;
+					double v = (y + 0.5 - job.top) * job.step_y;
+					int row = std::min(std::max((int)v, 0), job.rows - 1);
+					if (row == mapped_row)
+					{
+						memcpy(dest_row, mapped, width * 4);
+						continue;
+					}
+					mapHeatmapValues(job.values + (size_t)row * job.cols, job.cols, job.low, job.scale, indices.data());
+					for (int i = 0; i < width; ++i)
+						dest_row[i] = job.colors[indices[col0[i]]];
+					mapped_row = row;
+					mapped = dest_row;
 				}
-
+				return;
 			}
 
-			putImageData(imgData, x0, y0, 0, 0, width, height);
-
-			stbi_image_free((void*)image);
+			// the values are interpolated before they are mapped to colors
+			std::vector<float> row_values(job.cols);
+			std::vector<float> pixel_values(width);
+			for (int y = y0; y < y1; ++y)
+			{
+				double v = (y + 0.5 - job.top) * job.step_y - 0.5;
+				v = std::min(std::max(v, 0.0), job.rows - 1.0);
+				int row0 = (int)v;
+				int row1 = std::min(row0 + 1, job.rows - 1);
+				lerpHeatmapRows(job.values + (size_t)row0 * job.cols, job.values + (size_t)row1 * job.cols,
+					(float)(v - row0), job.cols, row_values.data());
+				for (int i = 0; i < width; ++i)
+				{
+					float a = row_values[col0[i]];
+					pixel_values[i] = a + (row_values[col1[i]] - a) * frac[i];
+				}
+				mapHeatmapValues(pixel_values.data(), width, job.low, job.scale, indices.data());
+				unsigned int* dest_row = (unsigned int*)(job.data + y * job.stride) + job.x0;
+				for (int i = 0; i < width; ++i)
+					dest_row[i] = job.colors[indices[i]];
+			}
 		}
 
-		Gradient createLinearGradient(const char* name, double x0, double y0, double x1, double y1)
+		// Draws the grid as a cols x rows image scaled over dest
+		// cairo image surfaces are limited to 32767 pixels a side, so the grid is
+		// drawn in blocks of cells, each filling its part of dest. Every block
+		// image keeps a border of the neighbouring cells, so bilinear has no seams.
+		static const int HeatmapBlock = 4096;
+
+		void drawHeatmapImage(const HeatmapJob& job, const Rect& dest)
 		{
-			return std::move(Gradient(cairo_pattern_create_linear(x0, y0, x1, y1)));
+			double cell_width = dest.width / job.cols;
+			double cell_height = dest.height / job.rows;
+			for (int y = 0; y < job.rows; y += HeatmapBlock)
+			{
+				int rows = std::min(HeatmapBlock, job.rows - y);
+				for (int x = 0; x < job.cols; x += HeatmapBlock)
+				{
+					int cols = std::min(HeatmapBlock, job.cols - x);
+					Rect block = { dest.x + x * cell_width, dest.y + y * cell_height, cols * cell_width, rows * cell_height };
+					drawHeatmapBlock(job, dest, x, y, cols, rows, block);
+				}
+			}
 		}
 
-		Gradient createRadialGradient(const char* name, double x0, double y0, double r0, double x1, double y1, double r1)
+		void drawHeatmapBlock(const HeatmapJob& job, const Rect& dest, int x, int y, int cols, int rows, const Rect& block)
 		{
-			return std::move(Gradient(cairo_pattern_create_radial(x0, y0, r0, x1, y1, r1)));
+			int x0 = std::max(x - 1, 0);
+			int y0 = std::max(y - 1, 0);
+			int x1 = std::min(x + cols + 1, job.cols);
+			int y1 = std::min(y + rows + 1, job.rows);
+			cairo_surface_t* image = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, x1 - x0, y1 - y0);
+			if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS)
+			{
+				cairo_surface_destroy(image);
+				return;
+			}
+			unsigned char* data = cairo_image_surface_get_data(image);
+			int stride = cairo_image_surface_get_stride(image);
+			std::vector<unsigned char> indices(x1 - x0);
+			for (int v = y0; v < y1; ++v)
+			{
+				mapHeatmapValues(job.values + (size_t)v * job.cols + x0, x1 - x0, job.low, job.scale, indices.data());
+				unsigned int* row = (unsigned int*)(data + (v - y0) * stride);
+				for (int u = 0; u < x1 - x0; ++u)
+					row[u] = job.colors[indices[u]];
+			}
+			cairo_surface_mark_dirty(image);
+
+			cairo_pattern_t* pattern = cairo_pattern_create_for_surface(image);
+			cairo_pattern_set_filter(pattern, job.bilinear ? CAIRO_FILTER_BILINEAR : CAIRO_FILTER_NEAREST);
+			cairo_pattern_set_extend(pattern, CAIRO_EXTEND_PAD);
+			cairo_matrix_t mat;
+			cairo_matrix_init_translate(&mat, -x0, -y0);
+			cairo_matrix_scale(&mat, job.cols / dest.width, job.rows / dest.height);
+			cairo_matrix_translate(&mat, -dest.x, -dest.y);
+			cairo_pattern_set_matrix(pattern, &mat);
+
+			cairo_pattern_t* source = cairo_pattern_reference(cairo_get_source(cr));
+			cairo_path_t* current = cairo_copy_path(cr);
+			cairo_new_path(cr);
+			cairo_set_source(cr, pattern);
+			cairo_rectangle(cr, block.x, block.y, block.width, block.height);
+			fill();
+			restorePath(current);
+			cairo_set_source(cr, source);
+			cairo_pattern_destroy(source);
+			cairo_pattern_destroy(pattern);
+			cairo_surface_destroy(image);
 		}
 
-		Pattern createPattern(const char* name, const char* image_file, RepeatPattern rp)
+		// Writes the opaque rectangles whose corners fall on whole device pixels
+		// straight into the surface and keeps the others for cairo.
+		void fillAlignedRects(const AtlasState& state, const Rect* rects, size_t count, const unsigned int* colors)
 		{
-			int width, height, channels;
-			//stbi_set_flip_vertically_on_load(true);
-			unsigned char* image = stbi_load(image_file,
-				&width,
-				&height,
-				&channels,
-				STBI_rgb);
+			m_UnalignedRects.clear();
+			m_UnalignedColors.clear();
 
-			unsigned char* dest_pixel = new unsigned char[width * height * 4];
-			for (int y = 0; y < height; ++y)
+			cairo_surface_flush(surface);
+			unsigned char* dest_data = cairo_image_surface_get_data(surface);
+			int dest_stride = cairo_image_surface_get_stride(surface);
+			int damage_x0 = state.clip_x1, damage_y0 = state.clip_y1;
+			int damage_x1 = state.clip_x0, damage_y1 = state.clip_y0;
+			for (size_t i = 0; i < count; ++i)
 			{
-				for (int x = 0; x < width; ++x)
+				double left = rects[i].x + state.tx;
+				double top = rects[i].y + state.ty;
+				double right = left + rects[i].width;
+				double bottom = top + rects[i].height;
+				if (left != floor(left) || top != floor(top) || right != floor(right) || bottom != floor(bottom))
 				{
-					int index = (y * width + x) * 4;
-					int src_index = (y * width + x) * 3;
-					dest_pixel[index] = image[src_index + 2];
-					dest_pixel[index + 1] = image[src_index + 1];
-					dest_pixel[index + 2] = image[src_index + 0];
-					dest_pixel[index + 3] = 0xff;
+					m_UnalignedRects.push_back(rects[i]);
+					if (colors != nullptr)
+						m_UnalignedColors.push_back(colors[i]);
+					continue;
+				}
+				if (right < left)
+					std::swap(left, right);
+				if (bottom < top)
+					std::swap(top, bottom);
+
+				left = std::max(left, (double)state.clip_x0);
+				top = std::max(top, (double)state.clip_y0);
+				right = std::min(right, (double)state.clip_x1);
+				bottom = std::min(bottom, (double)state.clip_y1);
+				if (left >= right || top >= bottom)
+					continue;
+
+				int x0 = (int)left;
+				int y0 = (int)top;
+				int x1 = (int)right;
+				int y1 = (int)bottom;
+
+				unsigned int color = (colors != nullptr) ? (0xff000000 | colors[i]) : state.color;
+				for (int y = y0; y < y1; ++y)
+				{
+					unsigned int* dest_row = (unsigned int*)(dest_data + y * dest_stride);
+					std::fill(dest_row + x0, dest_row + x1, color);
 				}
 
+				if (x0 < damage_x0) damage_x0 = x0;
+				if (y0 < damage_y0) damage_y0 = y0;
+				if (x1 > damage_x1) damage_x1 = x1;
+				if (y1 > damage_y1) damage_y1 = y1;
 			}
+			cairo_surface_mark_dirty(surface);
+			addDamage(damage_x0 + m_OriginX, damage_y0 + m_OriginY, damage_x1 + m_OriginX, damage_y1 + m_OriginY);
+		}
 
-			cairo_surface_t* surface = 
-				cairo_image_surface_create_for_data(dest_pixel,
-					CAIRO_FORMAT_ARGB32,
-					width,
-					height,
-					width * 4);
+		// Composites a cached marker mask at every point in the given order when
+		// pointRenderMode is sprite. The centres are rounded to a quarter pixel.
+		// Returns false without drawing if the state needs cairo.
+		bool stampPoints(const Point* points, size_t count, double radius, PointShape shape,
+			const unsigned int* colors, const unsigned char* indices, const unsigned int* palette)
+		{
+			if (pointRenderMode != PointRenderMode::sprite || shadowColor.isTransparent() == false)
+				return false;
 
-			cairo_pattern_t* pattern =
-				cairo_pattern_create_for_surface(surface);
+			AtlasState state;
+			if (!getAtlasState(state))
+				return false;
 
+			const PointSpriteCache::Sprite* sprites = m_PointSprites.getSprites(shape, radius);
+			if (sprites == nullptr)
+				return false;
 
-			cairo_extend_t extend = CAIRO_EXTEND_REPEAT;
-			if (rp == RepeatPattern::no_repeat)
-				extend = CAIRO_EXTEND_NONE;
+			cairo_new_path(cr);
+			cairo_surface_flush(surface);
+			unsigned char* dest_data = cairo_image_surface_get_data(surface);
+			int dest_stride = cairo_image_surface_get_stride(surface);
+			const int steps = PointSpriteCache::SubpixelSteps;
+			const double reach = PointSpriteCache::MaxRadius + 2.0;
+			int damage_x0 = state.clip_x1, damage_y0 = state.clip_y1;
+			int damage_x1 = state.clip_x0, damage_y1 = state.clip_y0;
+			for (size_t i = 0; i < count; ++i)
+			{
+				double fx = points[i].x + state.tx;
+				double fy = points[i].y + state.ty;
+				if (!(fx > state.clip_x0 - reach && fx < state.clip_x1 + reach &&
+					fy > state.clip_y0 - reach && fy < state.clip_y1 + reach))
+				{
+					continue; // outside, or not a number
+				}
 
-			cairo_pattern_set_extend(pattern, extend);
+				int gx = (int)floor(fx);
+				int gy = (int)floor(fy);
+				int phase_x = (int)((fx - gx) * steps + 0.5);
+				int phase_y = (int)((fy - gy) * steps + 0.5);
+				if (phase_x == steps)
+				{
+					++gx;
+					phase_x = 0;
+				}
+				if (phase_y == steps)
+				{
+					++gy;
+					phase_y = 0;
+				}
 
-			stbi_image_free((void*)image);
+				const PointSpriteCache::Sprite& sprite = sprites[phase_y * steps + phase_x];
+				int left = gx + sprite.left;
+				int top = gy + sprite.top;
+				int x0 = (left > state.clip_x0) ? left : state.clip_x0;
+				int y0 = (top > state.clip_y0) ? top : state.clip_y0;
+				int x1 = (left + sprite.width < state.clip_x1) ? left + sprite.width : state.clip_x1;
+				int y1 = (top + sprite.height < state.clip_y1) ? top + sprite.height : state.clip_y1;
+				if (x0 >= x1 || y0 >= y1)
+					continue;
+
+				unsigned int color = state.color;
+				if (indices != nullptr)
+					color = 0xff000000 | palette[indices[i]];
+				else if (colors != nullptr)
+					color = 0xff000000 | colors[i];
+
+				for (int ty = y0; ty < y1; ++ty)
+				{
+					unsigned int* dest_row = (unsigned int*)(dest_data + ty * dest_stride);
+					const unsigned char* mask_row = sprite.data + (ty - top) * sprite.stride;
+					blendMaskSpan(dest_row + x0, mask_row + (x0 - left), x1 - x0, color);
+				}
 
-			return std::move(Pattern(surface, pattern, dest_pixel));
+				if (x0 < damage_x0) damage_x0 = x0;
+				if (y0 < damage_y0) damage_y0 = y0;
+				if (x1 > damage_x1) damage_x1 = x1;
+				if (y1 > damage_y1) damage_y1 = y1;
+			}
+			cairo_surface_mark_dirty(surface);
+			addDamage(damage_x0 + m_OriginX, damage_y0 + m_OriginY, damage_x1 + m_OriginX, damage_y1 + m_OriginY);
+			return true;
 		}
 
-		// https://cairographics.org/manual/cairo-Image-Surfaces.html
-		ImageData createImageData(const char* name, int width, int height)
+		// Composites user space glyphs of the current font from the atlas.
+		// Returns false without drawing anything if a glyph cannot be cached.
+		bool compositeGlyphs(const AtlasState& state, const cairo_glyph_t* glyphs, int num_glyphs)
 		{
-			unsigned char* data = new unsigned char[width * height * 4];
-			return std::move(ImageData(data, width, height));
-		}
+			cairo_scaled_font_t* scaled_font = cairo_get_scaled_font(cr);
+
+			// resolve every glyph first so that nothing is drawn if one cannot be cached
+			GlyphAtlas::GlyphMap& glyph_map = m_GlyphAtlas.getGlyphs(font.getFont());
+			m_AtlasGlyphs.clear();
+			for (int i = 0; i < num_glyphs; ++i)
+			{
+				double dx = glyphs[i].x + state.tx;
+				int gx = (int)floor(dx);
+				int phase = (int)((dx - gx) * GlyphAtlas::SubpixelSteps + 0.5);
+				if (phase == GlyphAtlas::SubpixelSteps)
+				{
+					++gx;
+					phase = 0;
+				}
+				const GlyphAtlas::Glyph* glyph = m_GlyphAtlas.getGlyph(glyph_map, scaled_font, glyphs[i].index, phase);
+				if (glyph == nullptr)
+					return false;
+
+				AtlasGlyph ag = { glyph, gx, (int)floor(glyphs[i].y + state.ty + 0.5) };
+				m_AtlasGlyphs.push_back(ag);
+			}
 
-		void putImageData(ImageData& imgData, int x, int y, int srcX = 0, int srcY = 0, int srcWidth = 0, int srcHeight = 0)
-		{
 			cairo_surface_flush(surface);
-			unsigned char* dest_pixel = cairo_image_surface_get_data(surface);
-			int dest_width = cairo_image_surface_get_width(surface);
-			int dest_height = cairo_image_surface_get_height(surface);
-			if (srcWidth == 0)
-				srcWidth = imgData.width();
-			if (srcHeight == 0)
-				srcHeight = imgData.height();
+			unsigned char* dest_data = cairo_image_surface_get_data(surface);
+			int dest_stride = cairo_image_surface_get_stride(surface);
 
-			unsigned char* src_pixel = imgData.data();
-			for (int ty = srcY, dirtyY2 = y; ty < imgData.height() && ty < srcHeight && dirtyY2 < dest_height; ++ty, ++dirtyY2)
+			for (size_t i = 0; i < m_AtlasGlyphs.size(); ++i)
 			{
-				for (int tx = srcX, dirtyX2 = x; tx < imgData.width() && tx < srcWidth && dirtyX2 < dest_width; ++tx, ++dirtyX2)
+				const GlyphAtlas::Glyph* glyph = m_AtlasGlyphs[i].glyph;
+				if (glyph->width == 0)
+					continue;
+
+				int left = m_AtlasGlyphs[i].x + glyph->left;
+				int top = m_AtlasGlyphs[i].y + glyph->top;
+				int x0 = (left > state.clip_x0) ? left : state.clip_x0;
+				int y0 = (top > state.clip_y0) ? top : state.clip_y0;
+				int x1 = (left + glyph->width < state.clip_x1) ? left + glyph->width : state.clip_x1;
+				int y1 = (top + glyph->height < state.clip_y1) ? top + glyph->height : state.clip_y1;
+				if (x0 >= x1 || y0 >= y1)
+					continue;
+
+				const unsigned char* mask_data = m_GlyphAtlas.getPageData(glyph->page);
+				int mask_stride = m_GlyphAtlas.getPageStride(glyph->page);
+				for (int ty = y0; ty < y1; ++ty)
 				{
-					int src_index = (ty * imgData.width() + tx) * 4;
-					int dest_index = (dirtyY2 * dest_width + dirtyX2) * 4;
-					dest_pixel[dest_index] = src_pixel[src_index];
-					dest_pixel[dest_index + 1] = src_pixel[src_index + 1];
-					dest_pixel[dest_index + 2] = src_pixel[src_index + 2];
-					dest_pixel[dest_index + 3] = src_pixel[src_index + 3];
+					unsigned int* dest_row = (unsigned int*)(dest_data + ty * dest_stride);
+					const unsigned char* mask_row = mask_data + (glyph->y + ty - top) * mask_stride + glyph->x;
+					blendMaskSpan(dest_row + x0, mask_row + (x0 - left), x1 - x0, state.color);
 				}
 			}
 
 			cairo_surface_mark_dirty(surface);
+			return true;
 		}
 
-		ImageData getImageData(const char* name, int x, int y, int width, int height)
+		// Device space bounds of the clip, or false if the clip is not a pixel aligned rectangle.
+		bool getDeviceClip(const cairo_matrix_t& mat, int* x0, int* y0, int* x1, int* y1)
 		{
-			ImageData imgData = createImageData(name, width, height);
-			unsigned char* src_pixel = cairo_image_surface_get_data(surface);
-			int src_width = cairo_image_surface_get_width(surface);
-			int src_height = cairo_image_surface_get_height(surface);
+			if (!m_Clipped)
+				return true;
 
-			unsigned char* dest_pixel = imgData.data();
-			for (int ty = y, dy = 0; ty < src_height && dy < height; ++ty, ++dy)
+			cairo_rectangle_list_t* list = cairo_copy_clip_rectangle_list(cr);
+			bool aligned = (list->status == CAIRO_STATUS_SUCCESS && list->num_rectangles <= 1);
+			if (aligned && list->num_rectangles == 0)
 			{
-				for (int tx = x, dx = 0; tx < src_width && dx < width; ++tx, ++dx)
+				*x1 = *x0; // everything is clipped away
+			}
+			else if (aligned)
+			{
+				const cairo_rectangle_t& rc = list->rectangles[0];
+				double left = rc.x + mat.x0 - m_OriginX;
+				double top = rc.y + mat.y0 - m_OriginY;
+				double right = left + rc.width;
+				double bottom = top + rc.height;
+				if (left != floor(left) || top != floor(top) || right != floor(right) || bottom != floor(bottom))
 				{
-					int src_index = (ty * src_width + tx) * 4;
-					int dest_index = (dy * width + dx) * 4;
-					dest_pixel[dest_index] = src_pixel[src_index];
-					dest_pixel[dest_index + 1] = src_pixel[src_index + 1];
-					dest_pixel[dest_index + 2] = src_pixel[src_index + 2];
-					dest_pixel[dest_index + 3] = src_pixel[src_index + 3];
+					aligned = false;
+				}
+				else
+				{
+					if ((int)left > *x0) *x0 = (int)left;
+					if ((int)top > *y0) *y0 = (int)top;
+					if ((int)right < *x1) *x1 = (int)right;
+					if ((int)bottom < *y1) *y1 = (int)bottom;
 				}
 			}
-			return std::move(imgData);
-		}
-
-		void save()
-		{
-			cairo_save(cr);
-		}
-
-		void restore()
-		{
-			cairo_restore(cr);
-		}
-
-		bool savePng(const char* file)
-		{
-			cairo_status_t status = cairo_surface_write_to_png(surface, file);
-			return (status == CAIRO_STATUS_SUCCESS);
+			cairo_rectangle_list_destroy(list);
+			return aligned;
 		}
 
-		FillStyleProperty fillStyle;
-		StrokeStyleProperty strokeStyle;
-		FontProperty font;
-		LineCapProperty lineCap;
-		LineJoinProperty lineJoin;
-		LineWidthProperty lineWidth;
-		MiterLimitProperty miterLimit;
-		GlobalCompositeOperationProperty globalCompositeOperation;
-		ShadowOffsetProperty shadowOffsetX;
-		ShadowOffsetProperty shadowOffsetY;
-		ShadowColorProperty shadowColor;
-		ShadowBlurProperty shadowBlur;
-	private:
-		// remove copy constructor and assignment operator
-		Canvas(const Canvas& other) = delete;
-		void operator=(const Canvas& other) = delete;
-
-
-		double hypotenuse(double x1, double y1, double x2, double y2)
-		{
-			double x = x1 - x2;
-			double y = y1 - y2;
-			return sqrt((x * x) + (y * y));
-		}
 
 		unsigned char clamp(double val, int minimum, int maximum)
 		{
@@ -1602,20 +4162,23 @@ namespace canvas
 			unsigned char as = 0;
 			getShadowColor(&rs, &gs, &bs, &as);
 
+			// the mask is packed, the rows of the canvas may be padded
+			int dest_stride = cairo_image_surface_get_stride(surface);
 			for (int ty = 0; ty < m_Height; ++ty)
 			{
 				for (int tx = 0; tx < m_Width; ++tx)
 				{
 					int index = (ty * m_Width + tx) * 4;
+					int dest_index = ty * dest_stride + tx * 4;
 
 					if (src_pixel[index] > 0)
 					{
 						double mix_alpha = (as / 255.0) * (src_pixel[index] / 255.0);
 						unsigned char mix_alpha_int = (unsigned char)(mix_alpha * 255.0);
-						dest_pixel[index] = alphaBlend(rs, dest_pixel[index], mix_alpha_int);
-						dest_pixel[index + 1] = alphaBlend(bs, dest_pixel[index + 1], mix_alpha_int);
-						dest_pixel[index + 2] = alphaBlend(gs, dest_pixel[index + 2], mix_alpha_int);
-						dest_pixel[index + 3] = 0xff;
+						dest_pixel[dest_index] = alphaBlend(rs, dest_pixel[dest_index], mix_alpha_int);
+						dest_pixel[dest_index + 1] = alphaBlend(bs, dest_pixel[dest_index + 1], mix_alpha_int);
+						dest_pixel[dest_index + 2] = alphaBlend(gs, dest_pixel[dest_index + 2], mix_alpha_int);
+						dest_pixel[dest_index + 3] = 0xff;
 					}
 				}
 			}
@@ -1640,6 +4203,170 @@ namespace canvas
 			*b = (color & 0xff);
 		}
 
+		// Adds a device space box, in the coordinates of setOrigin(), to the damage
+		void addDamage(double x0, double y0, double x1, double y1)
+		{
+			int left = (int)floor(x0);
+			int top = (int)floor(y0);
+			int right = (int)ceil(x1);
+			int bottom = (int)ceil(y1);
+			if (left < m_OriginX) left = m_OriginX;
+			if (top < m_OriginY) top = m_OriginY;
+			if (right > m_OriginX + m_Width) right = m_OriginX + m_Width;
+			if (bottom > m_OriginY + m_Height) bottom = m_OriginY + m_Height;
+			if (left >= right || top >= bottom)
+				return;
+
+			if (!m_Damaged)
+			{
+				m_DamageX0 = left;
+				m_DamageY0 = top;
+				m_DamageX1 = right;
+				m_DamageY1 = bottom;
+				m_Damaged = true;
+				return;
+			}
+			if (left < m_DamageX0) m_DamageX0 = left;
+			if (top < m_DamageY0) m_DamageY0 = top;
+			if (right > m_DamageX1) m_DamageX1 = right;
+			if (bottom > m_DamageY1) m_DamageY1 = bottom;
+		}
+
+		void userToDeviceBox(double x0, double y0, double x1, double y1, double box[4])
+		{
+			double xs[4] = { x0, x1, x0, x1 };
+			double ys[4] = { y0, y0, y1, y1 };
+			for (int i = 0; i < 4; ++i)
+			{
+				cairo_user_to_device(cr, &xs[i], &ys[i]);
+				if (i == 0 || xs[i] < box[0]) box[0] = xs[i];
+				if (i == 0 || ys[i] < box[1]) box[1] = ys[i];
+				if (i == 0 || xs[i] > box[2]) box[2] = xs[i];
+				if (i == 0 || ys[i] > box[3]) box[3] = ys[i];
+			}
+		}
+
+		// Damage of a user space box drawn with the current state. The shape and an
+		// unblurred shadow are drawn through the clip, a blurred shadow is not.
+		void addUserDamage(double x0, double y0, double x1, double y1, double stroke_extent)
+		{
+			if (x0 >= x1 || y0 >= y1)
+				return;
+
+			double clip[4];
+			double cx0, cy0, cx1, cy1;
+			cairo_clip_extents(cr, &cx0, &cy0, &cx1, &cy1);
+			userToDeviceBox(cx0, cy0, cx1, cy1, clip);
+
+			cairo_operator_t op = cairo_get_operator(cr);
+			bool unbounded = (op == CAIRO_OPERATOR_CLEAR || op == CAIRO_OPERATOR_SOURCE ||
+				op == CAIRO_OPERATOR_IN || op == CAIRO_OPERATOR_OUT ||
+				op == CAIRO_OPERATOR_DEST_IN || op == CAIRO_OPERATOR_DEST_ATOP);
+
+			double box[4];
+			userToDeviceBox(x0 - stroke_extent, y0 - stroke_extent, x1 + stroke_extent, y1 + stroke_extent, box);
+			if (shadowColor.isTransparent() == false)
+			{
+				double offset_x = shadowOffsetX;
+				double offset_y = shadowOffsetY;
+				int blur = shadowBlur;
+				if (blur <= 0)
+				{
+					double shadow[4];
+					userToDeviceBox(x0 - stroke_extent + offset_x, y0 - stroke_extent + offset_y,
+						x1 + stroke_extent + offset_x, y1 + stroke_extent + offset_y, shadow);
+					addClippedDamage(shadow, clip);
+				}
+				else
+				{
+					// the mask is drawn untransformed and the blur goes one pixel per pass
+					double pad = stroke_extent + blur + 1.0;
+					addDamage(x0 - pad + offset_x, y0 - pad + offset_y, x1 + pad + offset_x, y1 + pad + offset_y);
+				}
+			}
+
+			if (unbounded)
+				addDamage(clip[0], clip[1], clip[2], clip[3]);
+			else
+				addClippedDamage(box, clip);
+		}
+
+		void addClippedDamage(const double box[4], const double clip[4])
+		{
+			addDamage((box[0] > clip[0]) ? box[0] : clip[0], (box[1] > clip[1]) ? box[1] : clip[1],
+				(box[2] < clip[2]) ? box[2] : clip[2], (box[3] < clip[3]) ? box[3] : clip[3]);
+		}
+
+		// Damage of the current path before it is filled or stroked
+		void damagePath(bool stroke_path)
+		{
+			double x0, y0, x1, y1;
+			if (stroke_path)
+				cairo_stroke_extents(cr, &x0, &y0, &x1, &y1);
+			else
+				cairo_fill_extents(cr, &x0, &y0, &x1, &y1);
+			addUserDamage(x0, y0, x1, y1, 0.0);
+		}
+
+		// Half of the widest stroke in user units, including miter joins and square caps
+		double strokeExtent()
+		{
+			double factor = 1.5;
+			if (cairo_get_line_join(cr) == CAIRO_LINE_JOIN_MITER && cairo_get_miter_limit(cr) > factor)
+				factor = cairo_get_miter_limit(cr);
+			return cairo_get_line_width(cr) / 2.0 * factor;
+		}
+
+		// Shadow masks share the pixel grid and the origin of the surface
+		cairo_surface_t* createMaskSurface()
+		{
+			cairo_surface_t* mask_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, m_Width, m_Height);
+			cairo_surface_set_device_offset(mask_surface, -m_OriginX, -m_OriginY);
+			return mask_surface;
+		}
+
+		// 255 / alpha in 16.16 fixed point, 0 for a transparent pixel
+		static const unsigned int* inverseAlphaTable()
+		{
+			static unsigned int table[256];
+			if (table[255] == 0)
+			{
+				for (unsigned int a = 1; a < 256; ++a)
+					table[a] = (255 * 65536 + a / 2) / a;
+			}
+			return table;
+		}
+
+		// Composites the (sx, sy, sw, sh) rectangle of src into (dx, dy, dw, dh)
+		void drawSurface(cairo_surface_t* src, double sx, double sy, double sw, double sh,
+			double dx, double dy, double dw, double dh)
+		{
+			if (sw <= 0.0 || sh <= 0.0 || dw <= 0.0 || dh <= 0.0)
+				return;
+
+			cairo_surface_flush(src);
+			cairo_pattern_t* pattern = cairo_pattern_create_for_surface(src);
+			// from the destination rectangle to the source rectangle
+			cairo_matrix_t mat;
+			cairo_matrix_init_translate(&mat, sx, sy);
+			cairo_matrix_scale(&mat, sw / dw, sh / dh);
+			cairo_matrix_translate(&mat, -dx, -dy);
+			cairo_pattern_set_matrix(pattern, &mat);
+			if (sw == dw && sh == dh)
+				cairo_pattern_set_filter(pattern, CAIRO_FILTER_NEAREST);
+
+			cairo_pattern_t* source = cairo_pattern_reference(cairo_get_source(cr));
+			cairo_path_t* current = cairo_copy_path(cr);
+			cairo_new_path(cr);
+			cairo_set_source(cr, pattern);
+			cairo_rectangle(cr, dx, dy, dw, dh);
+			fill();
+			restorePath(current);
+			cairo_set_source(cr, source);
+			cairo_pattern_destroy(source);
+			cairo_pattern_destroy(pattern);
+		}
+
 		inline unsigned char alphaBlend(unsigned char src, unsigned char dest, unsigned char alpha)
 		{
 			unsigned char invAlpha = 255 - alpha;
@@ -1647,10 +4374,149 @@ namespace canvas
 			return (unsigned char)((src * alpha + dest * invAlpha) >> 8);
 		}
 
+		// What save() keeps besides the state of cairo. The font string keys the
+		// text caches, so it must follow the font that cairo_restore brings back.
+		struct SavedState
+		{
+			bool clipped;
+			std::string font;
+			std::string fontFeatures;
+			TextAlign textAlign;
+			TextBaseline textBaseline;
+			TextRenderMode textRenderMode;
+			PointRenderMode pointRenderMode;
+		};
+
 		cairo_surface_t* surface;
 		cairo_t* cr;
+		SurfacePool* m_Pool;
+		std::string m_Name;
 		int m_Width; 
 		int m_Height;
+		int m_OriginX;
+		int m_OriginY;
+		bool m_Damaged;
+		int m_DamageX0;
+		int m_DamageY0;
+		int m_DamageX1;
+		int m_DamageY1;
+		bool m_Clipped;
+		std::vector<SavedState> m_SaveStack;
+		FontMetricsCache m_FontMetrics;
+		TextRunCache m_TextRuns;
+		TextLayoutCache m_TextLayouts;
+		std::vector<TextItem> m_BoxItems;
+		GlyphAtlas m_GlyphAtlas;
+		std::vector<AtlasGlyph> m_AtlasGlyphs;
+		std::vector<cairo_glyph_t> m_BatchGlyphs;
+		std::vector<size_t> m_BatchEnds;
+		std::vector<cairo_glyph_t> m_ShadowGlyphs;
+		std::unordered_map<unsigned int, size_t> m_GroupIndex;
+		std::vector<unsigned int> m_GroupColors;
+		std::vector<size_t> m_GroupEnds;
+		std::vector<size_t> m_GroupItems;
+		std::vector<size_t> m_ItemGroups;
+		std::vector<Rect> m_UnalignedRects;
+		std::vector<unsigned int> m_UnalignedColors;
+		std::vector<Rect> m_PointRects;
+		std::vector<unsigned int> m_PaletteColors;
+		std::vector<Point> m_PolylinePoints;
+		PointSpriteCache m_PointSprites;
+		SurfacePool m_SurfacePool;
+		std::vector<unsigned char> m_PresentPixels;
+		std::vector<unsigned char> m_Pixels;
+	};
+
+	// Transparent off-screen canvas on a surface of the pool of its parent, for
+	// content that is drawn once and composited with drawCanvas() every frame.
+	// A layer must be destroyed before its parent.
+	class Layer : public Canvas
+	{
+	public:
+		Layer(Canvas& parent, int width, int height)
+			: Canvas(parent.getSurfacePool(), width, height) {}
+		explicit Layer(Canvas& parent)
+			: Canvas(parent.getSurfacePool(), cairo_image_surface_get_width(parent.getSurface()),
+				cairo_image_surface_get_height(parent.getSurface())) {}
+	};
+
+	// Canvases kept for reuse, so that a short-lived canvas costs a reset()
+	// instead of the allocation of its pixels, context and caches. They are kept
+	// by size class, the width and height rounded up to a power of two from 64,
+	// and every canvas of a class has the pixels for any size in it. acquire()
+	// and release() may be called from any thread, a canvas is drawn on by one
+	// thread at a time.
+	class CanvasPool
+	{
+	public:
+		static const size_t MaxPerClass = 16;
+
+		CanvasPool() {}
+		~CanvasPool()
+		{
+			for (auto it = m_Canvases.begin(); it != m_Canvases.end(); ++it)
+			{
+				for (size_t i = 0; i < it->second.size(); ++i)
+					delete it->second[i];
+			}
+		}
+
+		// Transparent canvas with the default state, to be given back with release()
+		Canvas* acquire(int width, int height)
+		{
+			int class_width = sizeClass(width);
+			int class_height = sizeClass(height);
+			Canvas* canvas = nullptr;
+			{
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				std::vector<Canvas*>& canvases = m_Canvases[key(class_width, class_height)];
+				if (!canvases.empty())
+				{
+					canvas = canvases.back();
+					canvases.pop_back();
+				}
+			}
+			if (canvas == nullptr)
+				canvas = new Canvas("", class_width, class_height);
+
+			canvas->resize(width, height);
+			return canvas;
+		}
+
+		// Its layers must have been destroyed
+		void release(Canvas* canvas)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				std::vector<Canvas*>& canvases = m_Canvases[key(sizeClass(canvas->getWidth()), sizeClass(canvas->getHeight()))];
+				if (canvases.size() < MaxPerClass)
+				{
+					canvases.push_back(canvas);
+					return;
+				}
+			}
+			delete canvas;
+		}
+	private:
+		// remove copy constructor and assignment operator
+		CanvasPool(const CanvasPool& other) = delete;
+		void operator=(const CanvasPool& other) = delete;
+
+		static int sizeClass(int size)
+		{
+			int size_class = 64;
+			while (size_class < size)
+				size_class *= 2;
+			return size_class;
+		}
+
+		static unsigned long long key(int class_width, int class_height)
+		{
+			return ((unsigned long long)class_width << 32) | (unsigned int)class_height;
+		}
+
+		std::mutex m_Mutex;
+		std::unordered_map<unsigned long long, std::vector<Canvas*> > m_Canvases;
 	};
 
 	const char* getColorValue(const char* color_name)
@@ -1670,8 +4536,14 @@ namespace canvas
 		return it->second.c_str();
 	}
 
-	// https://www.w3schools.com/colors/colors_names.asp
+	// Canvases can be created on several threads at once, as by CanvasPool
 	void initColorNameMap()
+	{
+		std::call_once(g_ColorNameMapOnce, fillColorNameMap);
+	}
+
+	// https://www.w3schools.com/colors/colors_names.asp
+	void fillColorNameMap()
 	{
 		if (g_ColorNameMap.size() == 0)
 		{
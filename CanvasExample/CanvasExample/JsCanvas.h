@@ -9,51 +9,282 @@
 
 #pragma once
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <cmath>
+#include <algorithm>
+#include <cstdio>
+#include "CanvasCommon.h"
 #include <emscripten.h>
 
 namespace canvas
 {
-	enum class LineCap
+	// The JavaScript objects live in the slots array of jscanvas.js and every
+	// call passes the integer handle of its slot. Handle 0 is never used.
+
+	// Commands of the command buffer, in the order of the switch in run_commands
+	// of jscanvas.js. The setters come first.
+	enum class JsOp
 	{
-		butt,
-		round,
-		square
+		line_width,
+		miter_limit,
+		shadow_offset_x,
+		shadow_offset_y,
+		shadow_blur,
+		font,
+		line_cap,
+		line_join,
+		text_align,
+		text_baseline,
+		shadow_color,
+		composite_op,
+		fill_style,
+		stroke_style,
+		fill_slot,
+		stroke_slot,
+		select,
+		release_slot,
+		release_layer,
+		gradient_stop,
+		path_move_to,
+		path_line_to,
+		path_bezier_curve_to,
+		path_quadratic_curve_to,
+		path_arc,
+		path_rect,
+		path_close,
+		fill_rect,
+		clear_rect,
+		stroke_rect,
+		fill_text,
+		stroke_text,
+		rect,
+		begin_path,
+		close_path,
+		move_to,
+		line_to,
+		bezier_curve_to,
+		quadratic_curve_to,
+		arc,
+		clip,
+		clip_path,
+		stroke,
+		stroke_path,
+		fill,
+		fill_path,
+		scale,
+		translate,
+		rotate,
+		transform,
+		set_transform,
+		draw_image,
+		draw_canvas,
+		save,
+		restore
 	};
-	
-	enum class LineJoin
+
+	// Draw calls are encoded here as an opcode and doubles, with their strings
+	// in a text buffer, and run_commands in jscanvas.js runs them all in one
+	// crossing into JavaScript. The buffer is flushed by flush(), before any call
+	// that goes to JavaScript directly, so the calls still run in order, and in
+	// a microtask when the code that drew returns to the browser. A frame drawn
+	// in an animation frame callback or a main loop iteration is so rendered in
+	// that frame, without calling flush(). A setter replaces the pending value
+	// of the same property while no other command comes between them. In the
+	// worker mode of jscanvas.js, the worker presents its OffscreenCanvas when
+	// its task ends, after the microtask.
+	class CommandBuffer
 	{
-		miter,
-		round,
-		bevel
+	public:
+		static const size_t MaxArgs = 1 << 16;
+
+		static CommandBuffer& get()
+		{
+			static CommandBuffer buffer;
+			return buffer;
+		}
+
+		// Command on the canvas with the handle
+		void add(int canvas, JsOp op)
+		{
+			select(canvas);
+			clearSetters();
+			m_Args.push_back((double)op);
+			added();
+		}
+
+		template<typename... Args>
+		void add(int canvas, JsOp op, Args... args)
+		{
+			select(canvas);
+			clearSetters();
+			m_Args.push_back((double)op);
+			const double values[] = { (double)args... };
+			m_Args.insert(m_Args.end(), values, values + sizeof...(args));
+			added();
+		}
+
+		// Command on a gradient, a Path2D or a slot, which does not need a canvas
+		template<typename... Args>
+		void addResource(JsOp op, Args... args)
+		{
+			m_Args.push_back((double)op);
+			const double values[] = { (double)args... };
+			m_Args.insert(m_Args.end(), values, values + sizeof...(args));
+			added();
+		}
+
+		void set(int canvas, JsOp op, double value)
+		{
+			select(canvas);
+			size_t key = (size_t)property(op);
+			size_t index = m_Setters[key];
+			if (index != NoSetter && m_Args[index] == (double)op)
+			{
+				m_Args[index + 1] = value;
+				return;
+			}
+			m_Setters[key] = m_Args.size();
+			m_Args.push_back((double)op);
+			m_Args.push_back(value);
+			added();
+		}
+
+		void setText(int canvas, JsOp op, const char* value)
+		{
+			set(canvas, op, text(value));
+		}
+
+		// Offset of a copy of value in the text buffer
+		double text(const char* value)
+		{
+			size_t offset = m_Text.size();
+			m_Text.append(value);
+			m_Text.push_back('\0');
+			return (double)offset;
+		}
+
+		void flush()
+		{
+			if (m_Args.empty())
+				return;
+
+			EM_ASM_({
+				run_commands($0, $1, $2);
+				}, m_Args.data(), (int)m_Args.size(), m_Text.data());
+			m_Args.clear();
+			m_Text.clear();
+			m_Canvas = 0;
+			clearSetters();
+		}
+
+		// Runs in the microtask that added() queues
+		void scheduledFlush()
+		{
+			m_Scheduled = false;
+			flush();
+		}
+
+	private:
+		// remove copy constructor and assignment operator
+		CommandBuffer(const CommandBuffer& other) = delete;
+		void operator=(const CommandBuffer& other) = delete;
+
+		static const size_t NoSetter = (size_t)-1;
+		static const size_t SetterCount = (size_t)JsOp::fill_slot;
+
+		CommandBuffer() : m_Canvas(0), m_Scheduled(false)
+		{
+			clearSetters();
+		}
+
+		static JsOp property(JsOp op)
+		{
+			if (op == JsOp::fill_slot)
+				return JsOp::fill_style;
+			if (op == JsOp::stroke_slot)
+				return JsOp::stroke_style;
+			return op;
+		}
+
+		void select(int canvas)
+		{
+			if (canvas == m_Canvas)
+				return;
+			clearSetters();
+			m_Args.push_back((double)JsOp::select);
+			m_Args.push_back(canvas);
+			m_Canvas = canvas;
+		}
+
+		void clearSetters()
+		{
+			for (size_t i = 0; i < SetterCount; ++i)
+				m_Setters[i] = NoSetter;
+		}
+
+		void added()
+		{
+			if (m_Args.size() >= MaxArgs)
+			{
+				flush();
+				return;
+			}
+			if (!m_Scheduled)
+			{
+				m_Scheduled = true;
+				EM_ASM({
+					Promise.resolve().then(function() { _canvas_flush_commands(); });
+					});
+			}
+		}
+
+		std::vector<double> m_Args;
+		std::string m_Text;
+		size_t m_Setters[SetterCount];
+		int m_Canvas;
+		bool m_Scheduled;
 	};
-	
-	unsigned int fromRGB(unsigned char r, unsigned char g, unsigned char b)
+
+	// Microtask of the command buffer, runs before the browser renders
+	extern "C" inline EMSCRIPTEN_KEEPALIVE void canvas_flush_commands()
 	{
-		return (unsigned int)((r << 16) | (g << 8) | b);
+		CommandBuffer::get().scheduledFlush();
 	}
-	
-	// https://cairographics.org/manual/cairo-Image-Surfaces.html
+
+	// The pixels are RGBA and not premultiplied as in the browser ImageData, and
+	// live in the WASM heap. putImageData hands them to the browser as a
+	// Uint8ClampedArray view of HEAPU8 and getImageData copies straight into them.
+	// CppCanvas keeps the premultiplied BGRA of cairo, layout() tells them apart.
 	class ImageData
 	{
 	public:
-		ImageData(const char* name, int width, int height) 
-			: m_Name(name), m_Width(width), m_Height(height) {}
-		ImageData(ImageData&& other)
+		ImageData(unsigned char* data, int width, int height)
+			: m_Data(data), m_Width(width), m_Height(height) {}
+		static PixelLayout layout()
+		{
+			PixelLayout rgba = { 0, 1, 2, 3, false };
+			return rgba;
+		}
+		ImageData(ImageData&& other) noexcept
 		{
-			m_Name = std::move(other.m_Name);
+			m_Data = other.m_Data;
 			m_Width = other.m_Width;
 			m_Height = other.m_Height;
+
+			other.m_Data = nullptr;
 		}
 		~ImageData()
 		{
-			EM_ASM_({
-				remove_imgdata(UTF8ToString($0));
-
-			}, m_Name.c_str());
+			if (m_Data)
+			{
+				delete[] m_Data;
+				m_Data = nullptr;
+			}
 		}
-		const char* name() const
+		unsigned char* data() const
 		{
-			return m_Name.c_str();
+			return m_Data;
 		}
 		int width() const
 		{
@@ -68,7 +299,7 @@ namespace canvas
 		ImageData(const ImageData& other) = delete;
 		void operator=(const ImageData& other) = delete;
 
-		std::string m_Name;
+		unsigned char* m_Data;
 		int m_Width;
 		int m_Height;
 	};
@@ -76,114 +307,202 @@ namespace canvas
 	class Gradient
 	{
 	public:
-		Gradient(const char* name) : m_Name(name) {}
+		Gradient(int handle) : m_Handle(handle) {}
 		Gradient(Gradient&& other)
 		{
-			m_Name = std::move(other.m_Name);
+			m_Handle = other.m_Handle;
+			other.m_Handle = 0;
 		}
 		~Gradient()
 		{
-			EM_ASM_({
-				remove_gradient(UTF8ToString($0));
-
-				}, m_Name.c_str());
+			if (m_Handle == 0)
+				return;
+			CommandBuffer::get().addResource(JsOp::release_slot, m_Handle);
 		}
 		void addColorStop(double stop, const char* color)
 		{
-			EM_ASM_({
-				var grad = get_gradient(UTF8ToString($0));
-
-				grad.addColorStop($1, UTF8ToString($2));
-				}, m_Name.c_str(), stop, color);
+			CommandBuffer& commands = CommandBuffer::get();
+			commands.addResource(JsOp::gradient_stop, m_Handle, stop, commands.text(color));
 		}
 		void addColorStop(double stop, unsigned int color)
 		{
 			color &= 0xffffff;
 			char buf[20];
 			sprintf(buf, "#%06x", color);
-			EM_ASM_({
-				var grad = get_gradient(UTF8ToString($0));
-
-				grad.addColorStop($1, UTF8ToString($2));
-				}, m_Name.c_str(), stop, buf);
+			CommandBuffer& commands = CommandBuffer::get();
+			commands.addResource(JsOp::gradient_stop, m_Handle, stop, commands.text(buf));
 		}
-		const char* getName() const
+		int getHandle() const
 		{
-			return m_Name.c_str();
+			return m_Handle;
 		}
 	private:
 		// remove copy constructor and assignment operator
 		Gradient(const Gradient& other) = delete;
 		void operator=(const Gradient& other) = delete;
 	
-		std::string m_Name;
-	};
-
-	enum class RepeatPattern
-	{
-		repeat,
-		no_repeat
+		int m_Handle;
 	};
 
 	class Pattern
 	{
 	public:
-		Pattern(const char* name) : m_Name(name) {}
+		Pattern(int handle) : m_Handle(handle) {}
 		Pattern(Pattern&& other)
 		{
-			m_Name = std::move(other.m_Name);
+			m_Handle = other.m_Handle;
+			other.m_Handle = 0;
 		}
 		~Pattern()
 		{
-			EM_ASM_({
-				remove_pattern(UTF8ToString($0));
-
-				}, m_Name.c_str());
+			if (m_Handle == 0)
+				return;
+			CommandBuffer::get().addResource(JsOp::release_slot, m_Handle);
 		}
-		const char* getName() const
+		int getHandle() const
 		{
-			return m_Name.c_str();
+			return m_Handle;
 		}
 	private:
 		// remove copy constructor and assignment operator
 		Pattern(const Pattern& other) = delete;
 		void operator=(const Pattern& other) = delete;
 	
-		std::string m_Name;
+		int m_Handle;
+	};
+
+	// An image registered once in its slot by Canvas::loadImage() or createImage(),
+	// so that drawImage() and createPattern() index the slot instead of looking up
+	// the element on every call
+	class Image
+	{
+	public:
+		Image(int handle) : m_Handle(handle) {}
+		Image(Image&& other)
+		{
+			m_Handle = other.m_Handle;
+			other.m_Handle = 0;
+		}
+		~Image()
+		{
+			if (m_Handle == 0)
+				return;
+			CommandBuffer::get().addResource(JsOp::release_slot, m_Handle);
+		}
+		int getHandle() const
+		{
+			return m_Handle;
+		}
+	private:
+		// remove copy constructor and assignment operator
+		Image(const Image& other) = delete;
+		void operator=(const Image& other) = delete;
+	
+		int m_Handle;
+	};
+
+	// The JavaScript Path2D is created once and kept in its slot, the name is not used
+	class Path2D
+	{
+	public:
+		Path2D(const char* = "")
+		{
+			CommandBuffer::get().flush();
+			m_Handle = EM_ASM_INT({
+				return add_slot(new Path2D());
+				});
+		}
+		Path2D(Path2D&& other)
+		{
+			m_Handle = other.m_Handle;
+			other.m_Handle = 0;
+		}
+		~Path2D()
+		{
+			if (m_Handle == 0)
+				return;
+			CommandBuffer::get().addResource(JsOp::release_slot, m_Handle);
+		}
+
+		void moveTo(double x, double y)
+		{
+			CommandBuffer::get().addResource(JsOp::path_move_to, m_Handle, x, y);
+		}
+		void lineTo(double x, double y)
+		{
+			CommandBuffer::get().addResource(JsOp::path_line_to, m_Handle, x, y);
+		}
+		void bezierCurveTo(double cp1x, double cp1y, double cp2x, double cp2y, double endx, double endy)
+		{
+			CommandBuffer::get().addResource(JsOp::path_bezier_curve_to, m_Handle, cp1x, cp1y, cp2x, cp2y, endx, endy);
+		}
+		void quadraticCurveTo(double cpx, double cpy, double endx, double endy)
+		{
+			CommandBuffer::get().addResource(JsOp::path_quadratic_curve_to, m_Handle, cpx, cpy, endx, endy);
+		}
+		void arc(double xc, double yc, double radius, double angle1, double angle2)
+		{
+			CommandBuffer::get().addResource(JsOp::path_arc, m_Handle, xc, yc, radius, angle1, angle2);
+		}
+		void rect(double x, double y, double width, double height)
+		{
+			CommandBuffer::get().addResource(JsOp::path_rect, m_Handle, x, y, width, height);
+		}
+		void closePath()
+		{
+			CommandBuffer::get().addResource(JsOp::path_close, m_Handle);
+		}
+		int getHandle() const
+		{
+			return m_Handle;
+		}
+	private:
+		// remove copy constructor and assignment operator
+		Path2D(const Path2D& other) = delete;
+		void operator=(const Path2D& other) = delete;
+
+		int m_Handle;
 	};
 
-	enum class GlobalCompositeOperationType
+	// Drawing state of a canvas as the browser holds it. The properties answer
+	// their getters from here and drop the setters that do not change a value,
+	// and save() and restore() keep a stack of it like the context does.
+	// fillStyle and strokeStyle are empty while a gradient or pattern is set.
+	struct DrawState
 	{
-		source_over,
-		source_atop,
-		source_in,
-		source_out,
-		destination_over,
-		destination_atop,
-		destination_in,
-		destination_out,
-		lighter,
-		copy,
-		exclusive_or,
+		double lineWidth = 1.0;
+		double miterLimit = 10.0;
+		double shadowOffsetX = 0.0;
+		double shadowOffsetY = 0.0;
+		unsigned int shadowBlur = 0;
+		std::string lineCap = "butt";
+		std::string lineJoin = "miter";
+		std::string textAlign = "start";
+		std::string textBaseline = "alphabetic";
+		std::string font = "10px sans-serif";
+		std::string shadowColor = "rgba(0, 0, 0, 0)";
+		std::string compositeOp = "source-over";
+		std::string fillStyle = "#000000";
+		std::string strokeStyle = "#000000";
 	};
 
 	class GlobalCompositeOperationProperty
 	{
 	public:
-		GlobalCompositeOperationProperty() {}
+		GlobalCompositeOperationProperty() : m_Handle(0), m_State(nullptr) {}
 
-		void init(const char* name)
+		void init(int handle, DrawState& state)
 		{
-			m_Name = name;
+			m_Handle = handle;
+			m_State = &state;
 		}
 
 		void operator=(const char* op)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.globalCompositeOperation = UTF8ToString($1);
-				}, m_Name.c_str(), op);
+			if (m_State->compositeOp == op)
+				return;
+			m_State->compositeOp = op;
+			CommandBuffer::get().setText(m_Handle, JsOp::composite_op, op);
 		}
 		void operator=(GlobalCompositeOperationType type)
 		{
@@ -211,11 +530,7 @@ namespace canvas
 			else if (type == GlobalCompositeOperationType::exclusive_or)
 				op = "xor";
 
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.globalCompositeOperation = UTF8ToString($1);
-				}, m_Name.c_str(), op);
+			operator=(op);
 		}
 
 	private:
@@ -223,26 +538,27 @@ namespace canvas
 		GlobalCompositeOperationProperty(const GlobalCompositeOperationProperty& other) = delete;
 		void operator=(const GlobalCompositeOperationProperty& other) = delete;
 
-		std::string m_Name;
+		int m_Handle;
+		DrawState* m_State;
 	};
 
 	class FillStyleProperty
 	{
 	public:
-		FillStyleProperty() {}
+		FillStyleProperty() : m_Handle(0), m_State(nullptr) {}
 
-		void init(const char* name)
+		void init(int handle, DrawState& state)
 		{
-			m_Name = name;
+			m_Handle = handle;
+			m_State = &state;
 		}
 
 		void operator=(const char* color)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.fillStyle = UTF8ToString($1);
-				}, m_Name.c_str(), color);
+			if (m_State->fillStyle == color)
+				return;
+			m_State->fillStyle = color;
+			CommandBuffer::get().setText(m_Handle, JsOp::fill_style, color);
 		}
 		void operator=(unsigned int color)
 		{
@@ -250,53 +566,45 @@ namespace canvas
 
 			char buf[20];
 			sprintf(buf, "#%06x", color);
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.fillStyle = UTF8ToString($1);
-				}, m_Name.c_str(), buf);
+			operator=(buf);
 		}
+		// slot handles are reused, so these are always sent
 		void operator=(const canvas::Gradient& gradient)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.fillStyle = get_gradient(UTF8ToString($1));
-				}, m_Name.c_str(), gradient.getName());
+			m_State->fillStyle.clear();
+			CommandBuffer::get().set(m_Handle, JsOp::fill_slot, gradient.getHandle());
 		}
 		void operator=(const canvas::Pattern& pat)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.fillStyle = get_pattern(UTF8ToString($1));
-				}, m_Name.c_str(), pat.getName());
+			m_State->fillStyle.clear();
+			CommandBuffer::get().set(m_Handle, JsOp::fill_slot, pat.getHandle());
 		}
 	private:
 		// remove copy constructor and assignment operator
 		FillStyleProperty(const FillStyleProperty& other) = delete;
 		void operator=(const FillStyleProperty& other) = delete;
 
-		std::string m_Name;
+		int m_Handle;
+		DrawState* m_State;
 	};
 
 	class StrokeStyleProperty
 	{
 	public:
-		StrokeStyleProperty() {}
+		StrokeStyleProperty() : m_Handle(0), m_State(nullptr) {}
 
-		void init(const char* name)
+		void init(int handle, DrawState& state)
 		{
-			m_Name = name;
+			m_Handle = handle;
+			m_State = &state;
 		}
 
 		void operator=(const char* color)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.strokeStyle = UTF8ToString($1);
-				}, m_Name.c_str(), color);
+			if (m_State->strokeStyle == color)
+				return;
+			m_State->strokeStyle = color;
+			CommandBuffer::get().setText(m_Handle, JsOp::stroke_style, color);
 		}
 		void operator=(unsigned int color)
 		{
@@ -304,70 +612,222 @@ namespace canvas
 
 			char buf[20];
 			sprintf(buf, "#%06x", color);
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.strokeStyle = UTF8ToString($1);
-				}, m_Name.c_str(), buf);
+			operator=(buf);
 		}
+		// slot handles are reused, so these are always sent
 		void operator=(const canvas::Gradient& gradient)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.strokeStyle = get_gradient(UTF8ToString($1));
-				}, m_Name.c_str(), gradient.getName());
+			m_State->strokeStyle.clear();
+			CommandBuffer::get().set(m_Handle, JsOp::stroke_slot, gradient.getHandle());
 		}
 		void operator=(const canvas::Pattern& pat)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.strokeStyle = get_pattern(UTF8ToString($1));
-				}, m_Name.c_str(), pat.getName());
+			m_State->strokeStyle.clear();
+			CommandBuffer::get().set(m_Handle, JsOp::stroke_slot, pat.getHandle());
 		}
 	private:
 		// remove copy constructor and assignment operator
 		StrokeStyleProperty(const StrokeStyleProperty& other) = delete;
 		void operator=(const StrokeStyleProperty& other) = delete;
 
-		std::string m_Name;
+		int m_Handle;
+		DrawState* m_State;
 	};
 
 	class FontProperty
 	{
 	public:
-		FontProperty() {}
+		FontProperty() : m_Handle(0), m_State(nullptr) {}
 
-		void init(const char* name)
+		void init(int handle, DrawState& state)
 		{
-			m_Name = name;
+			m_Handle = handle;
+			m_State = &state;
 		}
 
 		void operator=(const char* value)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.font = UTF8ToString($1);
-				}, m_Name.c_str(), value);
+			if (m_State->font == value)
+				return;
+			m_State->font = value;
+			CommandBuffer::get().setText(m_Handle, JsOp::font, value);
+		}
+		const char* getFont() const
+		{
+			return m_State->font.c_str();
 		}
 	private:
 		// remove copy constructor and assignment operator
 		FontProperty(const FontProperty& other) = delete;
 		void operator=(const FontProperty& other) = delete;
 
-		std::string m_Name;
+		int m_Handle;
+		DrawState* m_State;
+	};
+
+	class TextAlignProperty
+	{
+	public:
+		TextAlignProperty() : m_Handle(0), m_State(nullptr) {}
+
+		void init(int handle, DrawState& state)
+		{
+			m_Handle = handle;
+			m_State = &state;
+		}
+
+		void operator=(const char* value)
+		{
+			if (m_State->textAlign == value)
+				return;
+			m_State->textAlign = value;
+			CommandBuffer::get().setText(m_Handle, JsOp::text_align, value);
+		}
+		void operator=(TextAlign align)
+		{
+			const char* value = "start";
+			if (align == TextAlign::start)
+				value = "start";
+			else if (align == TextAlign::end)
+				value = "end";
+			else if (align == TextAlign::left)
+				value = "left";
+			else if (align == TextAlign::right)
+				value = "right";
+			else if (align == TextAlign::center)
+				value = "center";
+
+			operator=(value);
+		}
+		operator TextAlign()
+		{
+			const std::string& value = m_State->textAlign;
+			TextAlign align = TextAlign::start;
+			if (value == "end")
+				align = TextAlign::end;
+			else if (value == "left")
+				align = TextAlign::left;
+			else if (value == "right")
+				align = TextAlign::right;
+			else if (value == "center")
+				align = TextAlign::center;
+
+			return align;
+		}
+	private:
+		// remove copy constructor and assignment operator
+		TextAlignProperty(const TextAlignProperty& other) = delete;
+		void operator=(const TextAlignProperty& other) = delete;
+
+		int m_Handle;
+		DrawState* m_State;
+	};
+
+	class TextBaselineProperty
+	{
+	public:
+		TextBaselineProperty() : m_Handle(0), m_State(nullptr) {}
+
+		void init(int handle, DrawState& state)
+		{
+			m_Handle = handle;
+			m_State = &state;
+		}
+
+		void operator=(const char* value)
+		{
+			if (m_State->textBaseline == value)
+				return;
+			m_State->textBaseline = value;
+			CommandBuffer::get().setText(m_Handle, JsOp::text_baseline, value);
+		}
+		void operator=(TextBaseline baseline)
+		{
+			const char* value = "alphabetic";
+			if (baseline == TextBaseline::top)
+				value = "top";
+			else if (baseline == TextBaseline::hanging)
+				value = "hanging";
+			else if (baseline == TextBaseline::middle)
+				value = "middle";
+			else if (baseline == TextBaseline::alphabetic)
+				value = "alphabetic";
+			else if (baseline == TextBaseline::ideographic)
+				value = "ideographic";
+			else if (baseline == TextBaseline::bottom)
+				value = "bottom";
+
+			operator=(value);
+		}
+		operator TextBaseline()
+		{
+			const std::string& value = m_State->textBaseline;
+			TextBaseline baseline = TextBaseline::alphabetic;
+			if (value == "top")
+				baseline = TextBaseline::top;
+			else if (value == "hanging")
+				baseline = TextBaseline::hanging;
+			else if (value == "middle")
+				baseline = TextBaseline::middle;
+			else if (value == "ideographic")
+				baseline = TextBaseline::ideographic;
+			else if (value == "bottom")
+				baseline = TextBaseline::bottom;
+
+			return baseline;
+		}
+	private:
+		// remove copy constructor and assignment operator
+		TextBaselineProperty(const TextBaselineProperty& other) = delete;
+		void operator=(const TextBaselineProperty& other) = delete;
+
+		int m_Handle;
+		DrawState* m_State;
+	};
+
+	// The browser shapes text itself, the features are kept only for API compatibility with CppCanvas.
+	class FontFeaturesProperty
+	{
+	public:
+		FontFeaturesProperty() {}
+
+		void operator=(const char* value)
+		{
+			m_Features = value;
+		}
+		const char* getFeatures() const
+		{
+			return m_Features.c_str();
+		}
+	private:
+		// remove copy constructor and assignment operator
+		FontFeaturesProperty(const FontFeaturesProperty& other) = delete;
+		void operator=(const FontFeaturesProperty& other) = delete;
+
+		std::string m_Features;
 	};
 
+	// Makes the font at url available as family in the font property once the browser has loaded it.
+	bool loadFontFile(const char* family, const char* url)
+	{
+		CommandBuffer::get().flush();
+		EM_ASM_({
+			var face = new FontFace(UTF8ToString($0), "url(" + UTF8ToString($1) + ")");
+			var fonts = (typeof document === 'undefined') ? self.fonts : document.fonts;
+			face.load().then(function(loaded) { fonts.add(loaded); });
+			}, family, url);
+		return true;
+	}
+
 	class LineCapProperty
 	{
 	public:
-		LineCapProperty() {}
+		LineCapProperty() : m_Handle(0), m_State(nullptr) {}
 
-		void init(const char* name)
+		void init(int handle, DrawState& state)
 		{
-			m_Name = name;
+			m_Handle = handle;
+			m_State = &state;
 		}
 
 		void operator=(LineCap cap)
@@ -380,34 +840,19 @@ namespace canvas
 			else if (cap == LineCap::square)
 				cairo_cap = "square";
 
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.lineCap = UTF8ToString($1);
-				}, m_Name.c_str(), cairo_cap);
+			if (m_State->lineCap == cairo_cap)
+				return;
+			m_State->lineCap = cairo_cap;
+			CommandBuffer::get().setText(m_Handle, JsOp::line_cap, cairo_cap);
 		}
 		
 		operator LineCap()
 		{
-			int cap_val = EM_ASM_INT({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				if(ctx.lineCap == 'butt')
-					return 0;
-				else if(ctx.lineCap == 'round')
-					return 1;
-				else if(ctx.lineCap == 'square')
-					return 2;
-
-				return 0;
-				}, m_Name.c_str());
-
+			const std::string& value = m_State->lineCap;
 			LineCap cap = LineCap::butt;
-			if (cap_val == 0)
-				cap = LineCap::butt;
-			else if (cap_val == 1)
+			if (value == "round")
 				cap = LineCap::round;
-			else if (cap_val == 2)
+			else if (value == "square")
 				cap = LineCap::square;
 
 			return cap;
@@ -418,17 +863,19 @@ namespace canvas
 		LineCapProperty(const LineCapProperty& other) = delete;
 		void operator=(const LineCapProperty& other) = delete;
 
-		std::string m_Name;
+		int m_Handle;
+		DrawState* m_State;
 	};
 
 	class LineJoinProperty
 	{
 	public:
-		LineJoinProperty() {}
+		LineJoinProperty() : m_Handle(0), m_State(nullptr) {}
 
-		void init(const char* name)
+		void init(int handle, DrawState& state)
 		{
-			m_Name = name;
+			m_Handle = handle;
+			m_State = &state;
 		}
 
 		void operator=(LineJoin join)
@@ -441,33 +888,18 @@ namespace canvas
 			else if (join == LineJoin::bevel)
 				cairo_join = "bevel";
 
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.lineJoin = UTF8ToString($1);
-				}, m_Name.c_str(), cairo_join);
+			if (m_State->lineJoin == cairo_join)
+				return;
+			m_State->lineJoin = cairo_join;
+			CommandBuffer::get().setText(m_Handle, JsOp::line_join, cairo_join);
 		}
 		operator LineJoin()
 		{
-			int join_val = EM_ASM_INT({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				if(ctx.lineJoin == 'miter')
-					return 0;
-				else if(ctx.lineJoin == 'round')
-					return 1;
-				else if(ctx.lineJoin == 'bevel')
-					return 2;
-				
-				}, m_Name.c_str());
-				
+			const std::string& value = m_State->lineJoin;
 			LineJoin join = LineJoin::miter;
-
-			if (join_val == 0)
-				join = LineJoin::miter;
-			else if (join_val == 1)
+			if (value == "round")
 				join = LineJoin::round;
-			else if (join_val == 2)
+			else if (value == "bevel")
 				join = LineJoin::bevel;
 
 			return join;
@@ -478,68 +910,65 @@ namespace canvas
 		LineJoinProperty(const LineJoinProperty& other) = delete;
 		void operator=(const LineJoinProperty& other) = delete;
 
-		std::string m_Name;
+		int m_Handle;
+		DrawState* m_State;
 	};
 
 	class LineWidthProperty
 	{
 	public:
-		LineWidthProperty() {}
+		LineWidthProperty() : m_Handle(0), m_State(nullptr) {}
 
-		void init(const char* name)
+		void init(int handle, DrawState& state)
 		{
-			m_Name = name;
+			m_Handle = handle;
+			m_State = &state;
 		}
 
+		// the browser ignores the values it does not accept
 		void operator=(double width)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.lineWidth = $1;
-				}, m_Name.c_str(), width);
+			if (!std::isfinite(width) || width <= 0.0 || m_State->lineWidth == width)
+				return;
+			m_State->lineWidth = width;
+			CommandBuffer::get().set(m_Handle, JsOp::line_width, width);
 		}
 		operator double()
 		{
-			return EM_ASM_DOUBLE({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				return ctx.lineWidth;
-				}, m_Name.c_str());
+			return m_State->lineWidth;
 		}
+
 	private:
 		// remove copy constructor and assignment operator
 		LineWidthProperty(const LineWidthProperty& other) = delete;
 		void operator=(const LineWidthProperty& other) = delete;
 
-		std::string m_Name;
+		int m_Handle;
+		DrawState* m_State;
 	};
 
 	class MiterLimitProperty
 	{
 	public:
-		MiterLimitProperty() {}
+		MiterLimitProperty() : m_Handle(0), m_State(nullptr) {}
 
-		void init(const char* name)
+		void init(int handle, DrawState& state)
 		{
-			m_Name = name;
+			m_Handle = handle;
+			m_State = &state;
 		}
 
+		// the browser ignores the values it does not accept
 		void operator=(double limit)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.miterLimit = $1;
-				}, m_Name.c_str(), limit);
+			if (!std::isfinite(limit) || limit <= 0.0 || m_State->miterLimit == limit)
+				return;
+			m_State->miterLimit = limit;
+			CommandBuffer::get().set(m_Handle, JsOp::miter_limit, limit);
 		}
 		operator double()
 		{
-			return EM_ASM_DOUBLE({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				return ctx.miterLimit;
-				}, m_Name.c_str());
+			return m_State->miterLimit;
 		}
 
 	private:
@@ -547,35 +976,32 @@ namespace canvas
 		MiterLimitProperty(const MiterLimitProperty& other) = delete;
 		void operator=(const MiterLimitProperty& other) = delete;
 
-		std::string m_Name;
+		int m_Handle;
+		DrawState* m_State;
 	};
 
 	class ShadowOffsetXProperty
 	{
 	public:
-		ShadowOffsetXProperty() {}
+		ShadowOffsetXProperty() : m_Handle(0), m_State(nullptr) {}
 
-		void init(const char* name)
+		void init(int handle, DrawState& state)
 		{
-			m_Name = name;
+			m_Handle = handle;
+			m_State = &state;
 		}
 
+		// the browser ignores the values it does not accept
 		void operator=(double offset)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.shadowOffsetX = $1;
-				}, m_Name.c_str(), offset);
+			if (!std::isfinite(offset) || m_State->shadowOffsetX == offset)
+				return;
+			m_State->shadowOffsetX = offset;
+			CommandBuffer::get().set(m_Handle, JsOp::shadow_offset_x, offset);
 		}
-
 		operator double()
 		{
-			return EM_ASM_DOUBLE({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				return ctx.shadowOffsetX;
-				}, m_Name.c_str());
+			return m_State->shadowOffsetX;
 		}
 
 	private:
@@ -583,35 +1009,32 @@ namespace canvas
 		ShadowOffsetXProperty(const ShadowOffsetXProperty& other) = delete;
 		void operator=(const ShadowOffsetXProperty& other) = delete;
 
-		std::string m_Name;
+		int m_Handle;
+		DrawState* m_State;
 	};
 
 	class ShadowOffsetYProperty
 	{
 	public:
-		ShadowOffsetYProperty() {}
+		ShadowOffsetYProperty() : m_Handle(0), m_State(nullptr) {}
 
-		void init(const char* name)
+		void init(int handle, DrawState& state)
 		{
-			m_Name = name;
+			m_Handle = handle;
+			m_State = &state;
 		}
 
+		// the browser ignores the values it does not accept
 		void operator=(double offset)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.shadowOffsetY = $1;
-				}, m_Name.c_str(), offset);
+			if (!std::isfinite(offset) || m_State->shadowOffsetY == offset)
+				return;
+			m_State->shadowOffsetY = offset;
+			CommandBuffer::get().set(m_Handle, JsOp::shadow_offset_y, offset);
 		}
-
 		operator double()
 		{
-			return EM_ASM_DOUBLE({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				return ctx.shadowOffsetY;
-				}, m_Name.c_str());
+			return m_State->shadowOffsetY;
 		}
 
 	private:
@@ -619,26 +1042,27 @@ namespace canvas
 		ShadowOffsetYProperty(const ShadowOffsetYProperty& other) = delete;
 		void operator=(const ShadowOffsetYProperty& other) = delete;
 
-		std::string m_Name;
+		int m_Handle;
+		DrawState* m_State;
 	};
 
 	class ShadowColorProperty
 	{
 	public:
-		ShadowColorProperty() {}
+		ShadowColorProperty() : m_Handle(0), m_State(nullptr) {}
 
-		void init(const char* name)
+		void init(int handle, DrawState& state)
 		{
-			m_Name = name;
+			m_Handle = handle;
+			m_State = &state;
 		}
 
 		void operator=(const char* color)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.shadowColor = UTF8ToString($1);
-				}, m_Name.c_str(), color);
+			if (m_State->shadowColor == color)
+				return;
+			m_State->shadowColor = color;
+			CommandBuffer::get().setText(m_Handle, JsOp::shadow_color, color);
 		}
 
 		void operator=(unsigned int color)
@@ -650,11 +1074,7 @@ namespace canvas
 			char buf[300];
 			sprintf(buf, "rgba(%f, %f, %f, %f)", r/255.0, g/255.0, b/255.0, a/255.0);
 			
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.shadowColor = UTF8ToString($1);
-				}, m_Name.c_str(), buf);
+			operator=(buf);
 		}
 
 	private:
@@ -662,35 +1082,32 @@ namespace canvas
 		ShadowColorProperty(const ShadowColorProperty& other) = delete;
 		void operator=(const ShadowColorProperty& other) = delete;
 
-		std::string m_Name;
+		int m_Handle;
+		DrawState* m_State;
 	};
 
 	class ShadowBlurProperty
 	{
 	public:
-		ShadowBlurProperty() {}
+		ShadowBlurProperty() : m_Handle(0), m_State(nullptr) {}
 
-		void init(const char* name)
+		void init(int handle, DrawState& state)
 		{
-			m_Name = name;
+			m_Handle = handle;
+			m_State = &state;
 		}
 
 		void operator=(unsigned int blur)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.shadowBlur = $1;
-				}, m_Name.c_str(), blur);
+			if (m_State->shadowBlur == blur)
+				return;
+			m_State->shadowBlur = blur;
+			CommandBuffer::get().set(m_Handle, JsOp::shadow_blur, blur);
 		}
 		
 		operator unsigned int()
 		{
-			return EM_ASM_INT({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				return ctx.shadowBlur;
-				}, m_Name.c_str());
+			return m_State->shadowBlur;
 		}
 
 	private:
@@ -698,351 +1115,720 @@ namespace canvas
 		ShadowBlurProperty(const ShadowBlurProperty& other) = delete;
 		void operator=(const ShadowBlurProperty& other) = delete;
 
-		std::string m_Name;
+		int m_Handle;
+		DrawState* m_State;
 	};
 
-	class Canvas
+	// heatmaps are drawn by the browser, the pool is not used
+	class ThreadPool;
+
+	// Colormap indices of count values, low mapping to 0 and low + 255 / scale to 255.
+	// Values out of range are clamped and NaN maps to 0.
+	inline void mapHeatmapValues(const float* values, int count, float low, float scale, unsigned char* indices)
 	{
-	public: 
-		Canvas(const char* name, int width, int height) : m_Name(name)
+		for (int i = 0; i < count; ++i)
 		{
-			EM_ASM_({
-				add_canvas(UTF8ToString($0))
+			float v = (values[i] - low) * scale;
+			v = (v > 0.0f) ? v : 0.0f;
+			v = (v < 255.0f) ? v : 255.0f;
+			indices[i] = (unsigned char)(v + 0.5f);
+		}
+	}
+
+	// The browser keeps the released layer canvases in layer_pool, so there is
+	// nothing to hold here. Kept for API compatibility with CppCanvas.
+	class SurfacePool
+	{
+	public:
+		SurfacePool() {}
+	private:
+		// remove copy constructor and assignment operator
+		SurfacePool(const SurfacePool& other) = delete;
+		void operator=(const SurfacePool& other) = delete;
+	};
+
+	class Canvas
+	{
+	public: 
+		// name is the id of the canvas element, whose size is read once here and
+		// then kept in C++, so the element must only be resized with resize()
+		Canvas(const char* name, int width, int height) : m_Name(name), m_Layer(false)
+		{
+			CommandBuffer::get().flush();
+			m_Handle = EM_ASM_INT({
+				return add_canvas(UTF8ToString($0));
 				}, m_Name.c_str());
-				
-			fillStyle.init(name);
-			strokeStyle.init(name);
-			font.init(name);
-			lineCap.init(name);
-			lineJoin.init(name);
-			lineWidth.init(name);
-			miterLimit.init(name);
-			globalCompositeOperation.init(name);
-			shadowOffsetX.init(name);
-			shadowOffsetY.init(name);
-			shadowColor.init(name);
-			shadowBlur.init(name);
+			m_Width = EM_ASM_INT({
+				return get_canvas($0).canvas.width;
+				}, m_Handle);
+			m_Height = EM_ASM_INT({
+				return get_canvas($0).canvas.height;
+				}, m_Handle);
+
+			init();
 		}
 		~Canvas()
 		{
+			if (m_Layer)
+				CommandBuffer::get().addResource(JsOp::release_layer, m_Handle);
+			else
+				CommandBuffer::get().addResource(JsOp::release_slot, m_Handle);
+		}
+
+		const char* getName() const
+		{
+			return m_Name.c_str();
+		}
+
+		int getHandle() const
+		{
+			return m_Handle;
+		}
+
+		int getWidth() const
+		{
+			return m_Width;
+		}
+		int getHeight() const
+		{
+			return m_Height;
+		}
+
+		// Runs the pending commands of every canvas now instead of when the current task ends
+		void flush()
+		{
+			CommandBuffer::get().flush();
+		}
+
+		// The browser shows what is drawn, kept for API compatibility with the
+		// software renderer of CppCanvas
+		void present()
+		{
+			CommandBuffer::get().flush();
+		}
+
+		// Makes the canvas like a new one: setting the size of the canvas element
+		// clears it to transparent and resets the context, and reset_state()
+		// brings it to the state that m_State mirrors.
+		void reset()
+		{
+			CommandBuffer::get().flush();
 			EM_ASM_({
-				remove_canvas(UTF8ToString($0));
+				var ctx = get_canvas($0);
 
-			}, m_Name.c_str());
+				ctx.canvas.width = ctx.canvas.width;
+				reset_state(ctx);
+				}, m_Handle);
+			m_State = DrawState();
+			m_StateStack.clear();
 		}
 
-		void fillRect(double x, double y, double width, double height)
+		// Resizes and resets the canvas, the browser keeps the backing store when it can
+		void resize(int width, int height)
 		{
+			CommandBuffer::get().flush();
 			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
+				var ctx = get_canvas($0);
+
+				ctx.canvas.width = $1;
+				ctx.canvas.height = $2;
+				reset_state(ctx);
+				}, m_Handle, width, height);
+			m_Width = width;
+			m_Height = height;
+			m_State = DrawState();
+			m_StateStack.clear();
+		}
+
+		// Shared by the layers of this canvas
+		SurfacePool& getSurfacePool()
+		{
+			return m_SurfacePool;
+		}
 
-				ctx.fillRect($1, $2, $3, $4);
-				}, m_Name.c_str(), x, y, width, height);
+		// Composites src like drawImage, straight from its canvas element. src must not be this canvas.
+		void drawCanvas(const Canvas& src, double x, double y)
+		{
+			CommandBuffer::get().add(m_Handle, JsOp::draw_canvas, src.m_Handle, 2, x, y);
+		}
+
+		void drawCanvas(const Canvas& src, double x, double y, double width, double height)
+		{
+			CommandBuffer::get().add(m_Handle, JsOp::draw_canvas, src.m_Handle, 4, x, y, width, height);
+		}
+
+		void drawCanvas(const Canvas& src, double sx, double sy, double sw, double sh,
+			double dx, double dy, double dw, double dh)
+		{
+			CommandBuffer::get().add(m_Handle, JsOp::draw_canvas, src.m_Handle, 8, sx, sy, sw, sh, dx, dy, dw, dh);
+		}
+
+		void fillRect(double x, double y, double width, double height)
+		{
+			CommandBuffer::get().add(m_Handle, JsOp::fill_rect, x, y, width, height);
 		}
 		
 		void clearRect(double x, double y, double width, double height)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.clearRect($1, $2, $3, $4);
-				}, m_Name.c_str(), x, y, width, height);
+			CommandBuffer::get().add(m_Handle, JsOp::clear_rect, x, y, width, height);
 		}
 		
 		void strokeRect(double x, double y, double width, double height)
 		{
+			CommandBuffer::get().add(m_Handle, JsOp::stroke_rect, x, y, width, height);
+		}
+
+		// Bulk versions of fillRect, of moveTo, lineTo and stroke per line, and of
+		// a filled arc or square per point. colors holds one 0xRRGGBB per item, or
+		// is null to use the current style. The items of one color are drawn as one
+		// path in order of first appearance of the color, so overlapping items of
+		// different colors may not stack in the order given. The current path is
+		// replaced. The items are read from the heap by one JavaScript call.
+		void fillRects(const Rect* rects, size_t count, const unsigned int* colors = nullptr)
+		{
+			CommandBuffer::get().flush();
 			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
+				var ctx = get_canvas($0);
 
-				ctx.strokeRect($1, $2, $3, $4);
-				}, m_Name.c_str(), x, y, width, height);
+				fill_rects(ctx, $1, $2, $3);
+				}, m_Handle, rects, (int)count, colors);
 		}
 
-		void fillText(const char* text, double x, double y)
+		void fillRects(const std::vector<Rect>& rects)
 		{
+			fillRects(rects.data(), rects.size());
+		}
+
+		void fillRects(const std::vector<Rect>& rects, const std::vector<unsigned int>& colors)
+		{
+			fillRects(rects.data(), rects.size(), colors.empty() ? nullptr : colors.data());
+		}
+
+		void strokeSegments(const Line* lines, size_t count, const unsigned int* colors = nullptr)
+		{
+			CommandBuffer::get().flush();
 			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
+				var ctx = get_canvas($0);
 
-				ctx.fillText( UTF8ToString($1), $2, $3);
-				}, m_Name.c_str(), text, x, y);
+				stroke_segments(ctx, $1, $2, $3);
+				}, m_Handle, lines, (int)count, colors);
+		}
+
+		void strokeSegments(const std::vector<Line>& lines)
+		{
+			strokeSegments(lines.data(), lines.size());
+		}
+
+		void strokeSegments(const std::vector<Line>& lines, const std::vector<unsigned int>& colors)
+		{
+			strokeSegments(lines.data(), lines.size(), colors.empty() ? nullptr : colors.data());
+		}
+
+		void drawPoints(const Point* points, size_t count, double radius, PointShape shape, const unsigned int* colors = nullptr)
+		{
+			CommandBuffer::get().flush();
+			EM_ASM_({
+				var ctx = get_canvas($0);
+
+				draw_points(ctx, $1, $2, $3, $4, $5);
+				}, m_Handle, points, (int)count, radius, (shape == PointShape::square) ? 1 : 0, colors);
+		}
+
+		void drawPoints(const std::vector<Point>& points, double radius, PointShape shape)
+		{
+			drawPoints(points.data(), points.size(), radius, shape);
+		}
+
+		void drawPoints(const std::vector<Point>& points, double radius, PointShape shape, const std::vector<unsigned int>& colors)
+		{
+			drawPoints(points.data(), points.size(), radius, shape, colors.empty() ? nullptr : colors.data());
+		}
+
+		// Points colored by palette[indices[i]]
+		void drawPoints(const Point* points, size_t count, double radius, PointShape shape,
+			const unsigned char* indices, const unsigned int* palette)
+		{
+			m_PaletteColors.resize(count);
+			for (size_t i = 0; i < count; ++i)
+				m_PaletteColors[i] = palette[indices[i]];
+			drawPoints(points, count, radius, shape, m_PaletteColors.data());
+		}
+
+		void drawPoints(const std::vector<Point>& points, double radius, PointShape shape,
+			const std::vector<unsigned char>& indices, const std::vector<unsigned int>& palette)
+		{
+			drawPoints(points.data(), points.size(), radius, shape, indices.data(), palette.data());
+		}
+
+		// Strokes the points as one polyline, decimated under the current transform
+		// by decimatePolyline with PolylineLod::m4. The current path is replaced.
+		void strokePolyline(const Point* points, size_t count, PolylineLod lod = PolylineLod::m4)
+		{
+			if (lod == PolylineLod::m4)
+			{
+				double mat[6];
+				getMatrix(mat);
+				m_PolylinePoints.clear();
+				decimatePolyline(points, count, mat, m_PolylinePoints);
+				points = m_PolylinePoints.data();
+				count = m_PolylinePoints.size();
+			}
+			drawPolyline(points, count);
+		}
+
+		void strokePolyline(const std::vector<Point>& points, PolylineLod lod = PolylineLod::m4)
+		{
+			strokePolyline(points.data(), points.size(), lod);
+		}
+
+		// Draws a grid of rows x cols values, stored row by row, over dest. low and
+		// high map to the first and the last color of the colormap, NaN to the first.
+		// The grid is mapped to colors here and drawn as one scaled image, so
+		// bilinear blends colors instead of values.
+		void drawHeatmap(const float* values, int cols, int rows, const Rect& dest, const Colormap& colormap,
+			double low, double high, HeatmapFilter filter = HeatmapFilter::nearest, ThreadPool* = nullptr)
+		{
+			if (cols <= 0 || rows <= 0 || dest.width <= 0.0 || dest.height <= 0.0)
+				return;
+
+			float scale = (high > low) ? (float)(255.0 / (high - low)) : 0.0f;
+			const unsigned int* colors = colormap.data();
+			std::vector<unsigned char> indices(cols);
+			m_HeatmapPixels.resize((size_t)cols * rows * 4);
+			unsigned char* pixel = m_HeatmapPixels.data();
+			for (int y = 0; y < rows; ++y)
+			{
+				mapHeatmapValues(values + (size_t)y * cols, cols, (float)low, scale, indices.data());
+				for (int x = 0; x < cols; ++x, pixel += 4)
+				{
+					unsigned int color = colors[indices[x]];
+					pixel[0] = (color >> 16) & 0xff;
+					pixel[1] = (color >> 8) & 0xff;
+					pixel[2] = color & 0xff;
+					pixel[3] = 0xff;
+				}
+			}
+
+			CommandBuffer::get().flush();
+			EM_ASM_({
+				var ctx = get_canvas($0);
+
+				draw_heatmap(ctx, $1, $2, $3, $4, $5, $6, $7, $8);
+				}, m_Handle, m_HeatmapPixels.data(), cols, rows, dest.x, dest.y, dest.width, dest.height,
+				(filter == HeatmapFilter::bilinear) ? 1 : 0);
+		}
+
+		void drawHeatmap(const std::vector<float>& values, int cols, int rows, const Rect& dest, const Colormap& colormap,
+			double low, double high, HeatmapFilter filter = HeatmapFilter::nearest, ThreadPool* pool = nullptr)
+		{
+			drawHeatmap(values.data(), cols, rows, dest, colormap, low, high, filter, pool);
+		}
+
+		// Only the columns of the canvas and their neighbours are visited
+		void strokePolyline(const PolylinePyramid& pyramid)
+		{
+			double mat[6];
+			getMatrix(mat);
+			double pad = m_State.lineWidth / 2 * std::max(1.5, m_State.miterLimit) * fabs(mat[0]) + 1;
+			m_PolylinePoints.clear();
+			decimatePolyline(pyramid, mat, -pad, m_Width + pad, m_PolylinePoints);
+			drawPolyline(m_PolylinePoints.data(), m_PolylinePoints.size());
+		}
+
+		void fillText(const char* text, double x, double y)
+		{
+			CommandBuffer& commands = CommandBuffer::get();
+			commands.add(m_Handle, JsOp::fill_text, commands.text(text), x, y);
 		}
 		
 		void strokeText(const char* text, double x, double y)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
+			CommandBuffer& commands = CommandBuffer::get();
+			commands.add(m_Handle, JsOp::stroke_text, commands.text(text), x, y);
+		}
+
+		TextMetrics measureText(const char* text)
+		{
+			TextMetrics tm;
+			CommandBuffer::get().flush();
+			tm.width = EM_ASM_DOUBLE({
+				var ctx = get_canvas($0);
+
+				return ctx.measureText(UTF8ToString($1)).width;
+				}, m_Handle, text);
+			return tm;
+		}
 
-				ctx.strokeText( UTF8ToString($1), $2, $3);
-				}, m_Name.c_str(), text, x, y);
+		void fillTextBatch(const TextItem* items, size_t count)
+		{
+			drawTextBatch(items, count, false);
+		}
+
+		void fillTextBatch(const std::vector<TextItem>& items)
+		{
+			drawTextBatch(items.data(), items.size(), false);
+		}
+
+		void strokeTextBatch(const TextItem* items, size_t count)
+		{
+			drawTextBatch(items, count, true);
+		}
+
+		void strokeTextBatch(const std::vector<TextItem>& items)
+		{
+			drawTextBatch(items.data(), items.size(), true);
+		}
+
+		// Wraps text at spaces to fit maxWidth and draws one line every lineHeight,
+		// aligned inside [x, x + maxWidth]. Line i is placed at y + i * lineHeight
+		// like fillText with the current textBaseline. Returns the ink box of the lines.
+		Rect fillTextBox(const char* text, double x, double y, double maxWidth, double lineHeight, TextAlign align)
+		{
+			const TextLayout& layout = layoutText(text, maxWidth);
+
+			m_BoxItems.clear();
+			Rect box = { x, y, 0.0, 0.0 };
+			double left = x + maxWidth;
+			double right = x;
+			for (size_t i = 0; i < layout.lines.size(); ++i)
+			{
+				double line_x = x;
+				if (align == TextAlign::end || align == TextAlign::right)
+					line_x = x + maxWidth - layout.widths[i];
+				else if (align == TextAlign::center)
+					line_x = x + (maxWidth - layout.widths[i]) / 2.0;
+
+				if (line_x < left)
+					left = line_x;
+				if (line_x + layout.widths[i] > right)
+					right = line_x + layout.widths[i];
+
+				TextItem item = { layout.lines[i].c_str(), line_x, y + i * lineHeight, false, 0 };
+				m_BoxItems.push_back(item);
+			}
+			if (m_BoxItems.empty())
+				return box;
+
+			// lines are already aligned horizontally, the ascent is measured
+			// against the current textBaseline
+			CommandBuffer::get().flush();
+			double ascent = EM_ASM_DOUBLE({
+				var ctx = get_canvas($0);
+
+				ctx.save();
+				ctx.textAlign = 'left';
+				var tm = ctx.measureText('M');
+				return (tm.fontBoundingBoxAscent !== undefined) ? tm.fontBoundingBoxAscent : tm.actualBoundingBoxAscent;
+				}, m_Handle);
+			double descent = EM_ASM_DOUBLE({
+				var ctx = get_canvas($0);
+
+				var tm = ctx.measureText('M');
+				return (tm.fontBoundingBoxDescent !== undefined) ? tm.fontBoundingBoxDescent : tm.actualBoundingBoxDescent;
+				}, m_Handle);
+
+			drawTextBatch(m_BoxItems.data(), m_BoxItems.size(), false);
+
+			CommandBuffer::get().add(m_Handle, JsOp::restore);
+
+			box.x = left;
+			box.y = y - ascent;
+			box.width = right - left;
+			box.height = (layout.lines.size() - 1) * lineHeight + ascent + descent;
+			return box;
 		}
 		
 		void rect(double x, double y, double width, double height)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.rect($1, $2, $3, $4);
-				}, m_Name.c_str(), x, y, width, height);
+			CommandBuffer::get().add(m_Handle, JsOp::rect, x, y, width, height);
 		}
 
 		void beginPath()
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.beginPath();
-				}, m_Name.c_str());
+			CommandBuffer::get().add(m_Handle, JsOp::begin_path);
 		}
 		
 		void closePath()
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.closePath();
-				}, m_Name.c_str());
+			CommandBuffer::get().add(m_Handle, JsOp::close_path);
 		}
 		
 		bool isPointInPath(double x, double y)
 		{
+			CommandBuffer::get().flush();
 			int ret = EM_ASM_INT({
-				var ctx = get_canvas(UTF8ToString($0));
+				var ctx = get_canvas($0);
 
 				return ctx.isPointInPath($1, $2);
-				}, m_Name.c_str(), x, y);
+				}, m_Handle, x, y);
 				
 			return (ret > 0);
 		}
 
-		void moveTo(double x, double y)
+		bool isPointInPath(Path2D& path, double x, double y)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
+			CommandBuffer::get().flush();
+			int ret = EM_ASM_INT({
+				var ctx = get_canvas($0);
+
+				return ctx.isPointInPath(get_path($1), $2, $3);
+				}, m_Handle, path.getHandle(), x, y);
+
+			return (ret > 0);
+		}
 
-				ctx.moveTo($1, $2);
-				}, m_Name.c_str(), x, y);
+		void moveTo(double x, double y)
+		{
+			CommandBuffer::get().add(m_Handle, JsOp::move_to, x, y);
 		}
 		
 		void lineTo(double x, double y)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.lineTo($1, $2);
-				}, m_Name.c_str(), x, y);
+			CommandBuffer::get().add(m_Handle, JsOp::line_to, x, y);
 		}
 		
 		void bezierCurveTo(double cp1x, double cp1y, double cp2x, double cp2y, double endx, double endy)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-                ctx.bezierCurveTo($1, $2, $3, $4, $5, $6);
-            }, m_Name.c_str(), cp1x, cp1y, cp2x, cp2y, endx, endy);
+			CommandBuffer::get().add(m_Handle, JsOp::bezier_curve_to, cp1x, cp1y, cp2x, cp2y, endx, endy);
 		}
 		
 		void quadraticCurveTo(double cpx, double cpy, double endx, double endy)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-                ctx.quadraticCurveTo($1, $2, $3, $4);
-            }, m_Name.c_str(), cpx, cpy, endx, endy);
+			CommandBuffer::get().add(m_Handle, JsOp::quadratic_curve_to, cpx, cpy, endx, endy);
 		}
 		
 		void clip()
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
+			CommandBuffer::get().add(m_Handle, JsOp::clip);
+		}
 
-				ctx.clip();
-				}, m_Name.c_str());
+		void clip(Path2D& path)
+		{
+			CommandBuffer::get().add(m_Handle, JsOp::clip_path, path.getHandle());
 		}
 		
 		void arc(double xc, double yc,
 			double radius,
 			double angle1, double angle2)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.arc($1, $2, $3, $4, $5);
-				}, m_Name.c_str(), xc, yc, radius, angle1, angle2);
+			CommandBuffer::get().add(m_Handle, JsOp::arc, xc, yc, radius, angle1, angle2);
 		}
 
 		void stroke()
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.stroke();
-				}, m_Name.c_str());
+			CommandBuffer::get().add(m_Handle, JsOp::stroke);
 		}
 		
 		void fill()
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
+			CommandBuffer::get().add(m_Handle, JsOp::fill);
+		}
 
-				ctx.fill();
-				}, m_Name.c_str());
+		void fill(Path2D& path)
+		{
+			CommandBuffer::get().add(m_Handle, JsOp::fill_path, path.getHandle());
 		}
 
-		void scale(double sx, double sy)
+		void stroke(Path2D& path)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
+			CommandBuffer::get().add(m_Handle, JsOp::stroke_path, path.getHandle());
+		}
 
-				ctx.scale($1, $2);
-				}, m_Name.c_str(), sx, sy);
+		void scale(double sx, double sy)
+		{
+			CommandBuffer::get().add(m_Handle, JsOp::scale, sx, sy);
 		}
 		
 		void translate(double tx, double ty)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.translate($1, $2);
-				}, m_Name.c_str(), tx, ty);
+			CommandBuffer::get().add(m_Handle, JsOp::translate, tx, ty);
 		}
 		
 		void rotate(double angle)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.rotate($1);
-				}, m_Name.c_str(), angle);
+			CommandBuffer::get().add(m_Handle, JsOp::rotate, angle);
 		}
 
 		void transform(double xx, double xy, double yx, double yy, double x0, double y0)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.transform($1, $2, $3, $4, $5, $6);
-				}, m_Name.c_str(), xx, xy, yx, yy, x0, y0);
+			CommandBuffer::get().add(m_Handle, JsOp::transform, xx, xy, yx, yy, x0, y0);
 		}
 
 		void setTransform(double xx, double xy, double yx, double yy, double x0, double y0)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.setTransform($1, $2, $3, $4, $5, $6);
-				}, m_Name.c_str(), xx, xy, yx, yy, x0, y0);
+			CommandBuffer::get().add(m_Handle, JsOp::set_transform, xx, xy, yx, yy, x0, y0);
 		}
 
-		Gradient createLinearGradient(const char* name, double x0, double y0, double x1, double y1)
+		// The names of the resources are optional, the browser does not use them
+		Gradient createLinearGradient(double x0, double y0, double x1, double y1)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
+			CommandBuffer::get().flush();
+			int handle = EM_ASM_INT({
+				var ctx = get_canvas($0);
 
 				var grad = ctx.createLinearGradient($1, $2, $3, $4);
-				add_gradient(UTF8ToString($5), grad);
-				}, m_Name.c_str(), x0, y0, x1, y1, name);
-			
-			return std::move(Gradient(name));
+				return add_slot(grad);
+				}, m_Handle, x0, y0, x1, y1);
+
+			return std::move(Gradient(handle));
 		}
-		
-		Gradient createRadialGradient(const char* name, double x0, double y0, double r0, double x1, double y1, double r1)
+
+		Gradient createLinearGradient(const char* name, double x0, double y0, double x1, double y1)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
+			return createLinearGradient(x0, y0, x1, y1);
+		}
+
+		Gradient createRadialGradient(double x0, double y0, double r0, double x1, double y1, double r1)
+		{
+			CommandBuffer::get().flush();
+			int handle = EM_ASM_INT({
+				var ctx = get_canvas($0);
 
 				var grad = ctx.createRadialGradient($1, $2, $3, $4, $5, $6);
-				add_gradient(UTF8ToString($7), grad);
-				}, m_Name.c_str(), x0, y0, r0, x1, y1, r1, name);
-			
-			return std::move(Gradient(name));
+				return add_slot(grad);
+				}, m_Handle, x0, y0, r0, x1, y1, r1);
+
+			return std::move(Gradient(handle));
 		}
 
-		Pattern createPattern(const char* name, const char* image_file, RepeatPattern rp)
+		Gradient createRadialGradient(const char* name, double x0, double y0, double r0, double x1, double y1, double r1)
+		{
+			return createRadialGradient(x0, y0, r0, x1, y1, r1);
+		}
+
+		Pattern createPattern(const Image& image, RepeatPattern rp)
 		{
 			const char* rep = "repeat";
 			if(rp == RepeatPattern::no_repeat)
 				rep = "no-repeat";
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
+			CommandBuffer::get().flush();
+			int handle = EM_ASM_INT({
+				var ctx = get_canvas($0);
 
-				var img = document.getElementById(UTF8ToString($3));
-				var pat = ctx.createPattern(img, UTF8ToString($2));
-				add_pattern(UTF8ToString($1), pat);
-				}, m_Name.c_str(), name, rep, image_file);
-			
-			return std::move(Pattern(name));
+				var pat = ctx.createPattern(slots[$2], UTF8ToString($1));
+				return add_slot(pat);
+				}, m_Handle, rep, image.getHandle());
+
+			return std::move(Pattern(handle));
+		}
+
+		// image_file is the id of an img element, registered on the first call
+		Pattern createPattern(const char* image_file, RepeatPattern rp)
+		{
+			return createPattern(cachedImage(image_file), rp);
+		}
+
+		Pattern createPattern(const char* name, const char* image_file, RepeatPattern rp)
+		{
+			return createPattern(image_file, rp);
+		}
+
+		// image is the id of an img element or a url. The browser decodes it into
+		// an ImageBitmap once it has loaded, which then takes the place of the
+		// element in the slot. Draws before that use the element.
+		Image loadImage(const char* image)
+		{
+			CommandBuffer::get().flush();
+			int handle = EM_ASM_INT({
+				return add_image(UTF8ToString($0));
+				}, image);
+
+			return std::move(Image(handle));
+		}
+
+		// An ImageBitmap of the pixels of imgData
+		Image createImage(const ImageData& imgData)
+		{
+			CommandBuffer::get().flush();
+			int handle = EM_ASM_INT({
+				return add_image_data($0, $1, $2);
+				}, imgData.data(), imgData.width(), imgData.height());
+
+			return std::move(Image(handle));
+		}
+
+		void drawImage(const Image& image, double x, double y)
+		{
+			CommandBuffer::get().add(m_Handle, JsOp::draw_image, image.getHandle(), 2, x, y);
 		}
 
+		void drawImage(const Image& image, double x, double y, double width, double height)
+		{
+			CommandBuffer::get().add(m_Handle, JsOp::draw_image, image.getHandle(), 4, x, y, width, height);
+		}
+
+		// image is registered on the first call
 		void drawImage(const char* image, double x, double y)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
+			drawImage(cachedImage(image), x, y);
+		}
 
-                var img = document.getElementById(UTF8ToString($1));
-                ctx.drawImage(img, $2, $3);
-            }, m_Name.c_str(), image, x, y);
+		// transparent black, as in the browser
+		ImageData createImageData(int width, int height)
+		{
+			unsigned char* data = new unsigned char[width * height * 4]();
+			return std::move(ImageData(data, width, height));
 		}
 
 		ImageData createImageData(const char* name, int width, int height)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				var imgdata = ctx.createImageData($1, $2);
-				add_imgdata(UTF8ToString($3), imgdata);
-				}, m_Name.c_str(), width, height, name);
-			
-			return std::move(ImageData(name, width, height));
+			return createImageData(width, height);
 		}
-		
-		void putImageData(ImageData& imgData, int x, int y)
+
+		// A dirtyWidth or dirtyHeight of 0 reaches the edge of imgData, as in CppCanvas
+		void putImageData(ImageData& imgData, int x, int y, int dirtyX = 0, int dirtyY = 0, int dirtyWidth = 0, int dirtyHeight = 0)
 		{
+			if (dirtyWidth == 0)
+				dirtyWidth = imgData.width() - dirtyX;
+			if (dirtyHeight == 0)
+				dirtyHeight = imgData.height() - dirtyY;
+			CommandBuffer::get().flush();
 			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
+				var ctx = get_canvas($0);
 
-				var imgdata = get_imgdata(UTF8ToString($3));
-				ctx.putImageData(imgdata, $1, $2);
-				}, m_Name.c_str(), x, y, imgData.name());
+				var view = new Uint8ClampedArray(HEAPU8.buffer, $1, $2 * $3 * 4);
+				ctx.putImageData(new ImageData(view, $2, $3), $4, $5, $6, $7, $8, $9);
+				}, m_Handle, imgData.data(), imgData.width(), imgData.height(), x, y, dirtyX, dirtyY, dirtyWidth, dirtyHeight);
 		}
-		
-		void putImageData(ImageData& imgData, int x, int y, int dirtyX, int dirtyY, int dirtyWidth, int dirtyHeight)
+
+		ImageData getImageData(int x, int y, int width, int height)
 		{
+			ImageData imgData = createImageData(width, height);
+			getImageData(imgData, x, y);
+			return imgData;
+		}
+
+		// Reads into the pixels of imgData, so that an effect run every frame does not allocate
+		void getImageData(ImageData& imgData, int x, int y)
+		{
+			CommandBuffer::get().flush();
 			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
+				var ctx = get_canvas($0);
 
-				var imgdata = get_imgdata(UTF8ToString($7));
-				ctx.putImageData(imgdata, $1, $2, $3, $4, $5, $6);
-				}, m_Name.c_str(), x, y, dirtyX, dirtyY, dirtyWidth, dirtyHeight, imgData.name());
+				var src = ctx.getImageData($2, $3, $4, $5);
+				HEAPU8.set(src.data, $1);
+				}, m_Handle, imgData.data(), x, y, imgData.width(), imgData.height());
 		}
-		
+
 		ImageData getImageData(const char* name, int x, int y, int width, int height)
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				var imgdata = ctx.getImageData($1, $2, $3, $4);
-				add_imgdata(UTF8ToString($5), imgdata);
-				}, m_Name.c_str(), x, y, width, height, name);
-			
-			return std::move(ImageData(name, width, height));
+			return getImageData(x, y, width, height);
 		}
-		
+
 		void save()
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.save();
-				}, m_Name.c_str());
+			m_StateStack.push_back(m_State);
+			CommandBuffer::get().add(m_Handle, JsOp::save);
 		}
 
+		// like the context, a restore without a save does nothing
 		void restore()
 		{
-			EM_ASM_({
-				var ctx = get_canvas(UTF8ToString($0));
-
-				ctx.restore();
-				}, m_Name.c_str());
+			if (m_StateStack.empty())
+				return;
+			m_State = m_StateStack.back();
+			m_StateStack.pop_back();
+			CommandBuffer::get().add(m_Handle, JsOp::restore);
 		}
 
 		bool savePng(const char* file)
@@ -1051,6 +1837,19 @@ namespace canvas
 			return true;
 		}
 
+		bool savePng(const char* file, const Rect& area)
+		{
+			// do nothing here.
+			return true;
+		}
+
+		// The browser composites the canvas by itself, so the whole canvas is reported
+		Rect takeDamage()
+		{
+			Rect damage = { 0.0, 0.0, (double)m_Width, (double)m_Height };
+			return damage;
+		}
+
 		FillStyleProperty fillStyle;
 		StrokeStyleProperty strokeStyle;
 		FontProperty font;
@@ -1063,11 +1862,215 @@ namespace canvas
 		ShadowOffsetYProperty shadowOffsetY;
 		ShadowColorProperty shadowColor;
 		ShadowBlurProperty shadowBlur;
+		TextRenderModeProperty textRenderMode;
+		PointRenderModeProperty pointRenderMode;
+		TextAlignProperty textAlign;
+		TextBaselineProperty textBaseline;
+		FontFeaturesProperty fontFeatures;
+	protected:
+		// Transparent off-screen canvas element from layer_pool, given back on destruction
+		Canvas(SurfacePool& pool, int width, int height) : m_Width(width), m_Height(height), m_Layer(true)
+		{
+			CommandBuffer::get().flush();
+			m_Handle = EM_ASM_INT({
+				return acquire_layer($0, $1);
+				}, width, height);
+
+			init();
+		}
+
 	private:
 		// remove copy constructor and assignment operator
 		Canvas(const Canvas& other) = delete;
 		void operator=(const Canvas& other) = delete;
 
+		void init()
+		{
+			int handle = m_Handle;
+			fillStyle.init(handle, m_State);
+			strokeStyle.init(handle, m_State);
+			font.init(handle, m_State);
+			lineCap.init(handle, m_State);
+			lineJoin.init(handle, m_State);
+			lineWidth.init(handle, m_State);
+			miterLimit.init(handle, m_State);
+			globalCompositeOperation.init(handle, m_State);
+			shadowOffsetX.init(handle, m_State);
+			shadowOffsetY.init(handle, m_State);
+			shadowColor.init(handle, m_State);
+			shadowBlur.init(handle, m_State);
+			textAlign.init(handle, m_State);
+			textBaseline.init(handle, m_State);
+		}
+
+		const Image& cachedImage(const char* image)
+		{
+			m_ImageKey = image;
+			auto it = m_Images.find(m_ImageKey);
+			if (it == m_Images.end())
+				it = m_Images.emplace(m_ImageKey, loadImage(image)).first;
+			return it->second;
+		}
+
+		// Current transform as xx, yx, xy, yy, x0, y0
+		void getMatrix(double mat[6])
+		{
+			CommandBuffer::get().flush();
+			EM_ASM_({
+				var ctx = get_canvas($0);
+
+				var m = ctx.getTransform();
+				var index = $1 >> 3;
+				HEAPF64[index] = m.a;
+				HEAPF64[index + 1] = m.b;
+				HEAPF64[index + 2] = m.c;
+				HEAPF64[index + 3] = m.d;
+				HEAPF64[index + 4] = m.e;
+				HEAPF64[index + 5] = m.f;
+				}, m_Handle, mat);
+		}
+
+		void drawPolyline(const Point* points, size_t count)
+		{
+			CommandBuffer::get().flush();
+			EM_ASM_({
+				var ctx = get_canvas($0);
+
+				stroke_polyline(ctx, $1, $2);
+				}, m_Handle, points, (int)count);
+		}
+
+		// Packs the batch as doubles so that it crosses into JavaScript in one call
+		void drawTextBatch(const TextItem* items, size_t count, bool stroke_text)
+		{
+			if (count == 0)
+				return;
+
+			m_BatchArgs.resize(count * 5);
+			for (size_t i = 0; i < count; ++i)
+			{
+				double* args = &m_BatchArgs[i * 5];
+				args[0] = (double)(size_t)items[i].text;
+				args[1] = items[i].x;
+				args[2] = items[i].y;
+				args[3] = items[i].hasColor ? 1.0 : 0.0;
+				args[4] = items[i].color & 0xffffff;
+			}
+
+			CommandBuffer::get().flush();
+			EM_ASM_({
+				var ctx = get_canvas($0);
+
+				draw_text_batch(ctx, $1, $2, $3);
+				}, m_Handle, m_BatchArgs.data(), (int)count, stroke_text ? 1 : 0);
+		}
+
+		// Greedy line breaking with the cached advance of every word
+		const TextLayout& layoutText(const char* text, double max_width)
+		{
+			const char* font_key = font.getFont();
+			TextLayout* cached = m_TextLayouts.find(font_key, fontFeatures.getFeatures(), max_width, text);
+			if (cached)
+				return *cached;
+
+			TextLayout& layout = m_TextLayouts.add();
+			double space_advance = wordAdvance(font_key, " ");
+			std::string line;
+			std::string word;
+			double line_width = 0.0;
+			const char* p = text;
+			while (true)
+			{
+				char ch = *p;
+				if (ch != ' ' && ch != '\n' && ch != '\0')
+				{
+					word += ch;
+					++p;
+					continue;
+				}
+
+				if (!word.empty())
+				{
+					double word_width = wordAdvance(font_key, word);
+					if (!line.empty() && line_width + space_advance + word_width > max_width)
+					{
+						layout.lines.push_back(line);
+						layout.widths.push_back(line_width);
+						line.clear();
+						line_width = 0.0;
+					}
+					if (!line.empty())
+					{
+						line += ' ';
+						line_width += space_advance;
+					}
+					line += word;
+					line_width += word_width;
+					word.clear();
+				}
+
+				if (ch == '\n' || (ch == '\0' && !line.empty()))
+				{
+					layout.lines.push_back(line);
+					layout.widths.push_back(line_width);
+					line.clear();
+					line_width = 0.0;
+				}
+				if (ch == '\0')
+					break;
+				++p;
+			}
+			return layout;
+		}
+
+		// measureText crosses into JavaScript, so every word is measured once per font
+		double wordAdvance(const char* font_key, const std::string& word)
+		{
+			m_WordKey = font_key;
+			m_WordKey += '\n';
+			m_WordKey += word;
+			auto it = m_WordAdvances.find(m_WordKey);
+			if (it != m_WordAdvances.end())
+				return it->second;
+
+			if (m_WordAdvances.size() >= MaxWordAdvances)
+				m_WordAdvances.clear();
+
+			double advance = measureText(word.c_str()).width;
+			m_WordAdvances[m_WordKey] = advance;
+			return advance;
+		}
+
+		static const size_t MaxWordAdvances = 16384;
+
 		std::string m_Name;
+		int m_Handle;
+		int m_Width;
+		int m_Height;
+		bool m_Layer;
+		DrawState m_State;
+		std::vector<DrawState> m_StateStack;
+		SurfacePool m_SurfacePool;
+		std::vector<double> m_BatchArgs;
+		std::vector<unsigned int> m_PaletteColors;
+		std::vector<Point> m_PolylinePoints;
+		std::vector<unsigned char> m_HeatmapPixels;
+		std::vector<TextItem> m_BoxItems;
+		TextLayoutCache m_TextLayouts;
+		std::unordered_map<std::string, double> m_WordAdvances;
+		std::unordered_map<std::string, Image> m_Images;
+		std::string m_ImageKey;
+		std::string m_WordKey;
+	};
+
+	// Transparent off-screen canvas for content that is drawn once and composited
+	// with drawCanvas() every frame. A layer must be destroyed before its parent.
+	class Layer : public Canvas
+	{
+	public:
+		Layer(Canvas& parent, int width, int height)
+			: Canvas(parent.getSurfacePool(), width, height) {}
+		explicit Layer(Canvas& parent)
+			: Canvas(parent.getSurfacePool(), parent.getWidth(), parent.getHeight()) {}
 	};
 }
\ No newline at end of file
@@ -0,0 +1,447 @@
+// Copyright 2019 Shao Voon Wong
+// No warranties expressed or implied
+// use it at your risk!
+
+#pragma once
+#if defined(__EMSCRIPTEN__) && !defined(CANVAS_SOFTWARE_RENDERER)
+	#include "JsCanvas.h"
+#else
+	#include "CppCanvas.h"
+#endif
+#include <string>
+
+namespace canvas
+{
+	class NullStyleProperty
+	{
+	public:
+		NullStyleProperty() : m_Calls(nullptr) {}
+
+		void init(size_t* calls)
+		{
+			m_Calls = calls;
+		}
+
+		void operator=(const char* color)
+		{
+			++*m_Calls;
+		}
+		void operator=(unsigned int color)
+		{
+			++*m_Calls;
+		}
+		void operator=(const canvas::Gradient& gradient)
+		{
+			++*m_Calls;
+		}
+		void operator=(const canvas::Pattern& pat)
+		{
+			++*m_Calls;
+		}
+	private:
+		// remove copy constructor and assignment operator
+		NullStyleProperty(const NullStyleProperty& other) = delete;
+		void operator=(const NullStyleProperty& other) = delete;
+
+		size_t* m_Calls;
+	};
+
+	class NullStringProperty
+	{
+	public:
+		NullStringProperty() : m_Calls(nullptr) {}
+
+		void init(size_t* calls, const char* value)
+		{
+			m_Calls = calls;
+			m_Value = value;
+		}
+
+		void operator=(const char* value)
+		{
+			m_Value = value;
+			++*m_Calls;
+		}
+		operator const char*() const
+		{
+			return m_Value.c_str();
+		}
+	private:
+		// remove copy constructor and assignment operator
+		NullStringProperty(const NullStringProperty& other) = delete;
+		void operator=(const NullStringProperty& other) = delete;
+
+		size_t* m_Calls;
+		std::string m_Value;
+	};
+
+	// Keeps the last value so that it can be read back like the Canvas properties
+	template<typename T>
+	class NullValueProperty
+	{
+	public:
+		NullValueProperty() : m_Calls(nullptr), m_Value() {}
+
+		void init(size_t* calls, T value)
+		{
+			m_Calls = calls;
+			m_Value = value;
+		}
+
+		void operator=(T value)
+		{
+			m_Value = value;
+			++*m_Calls;
+		}
+		operator T() const
+		{
+			return m_Value;
+		}
+	private:
+		// remove copy constructor and assignment operator
+		NullValueProperty(const NullValueProperty& other) = delete;
+		void operator=(const NullValueProperty& other) = delete;
+
+	protected:
+		size_t* m_Calls;
+		T m_Value;
+	};
+
+	// Value that can also be set by its name, which is not parsed
+	template<typename T>
+	class NullNamedValueProperty : public NullValueProperty<T>
+	{
+	public:
+		NullNamedValueProperty() {}
+
+		void operator=(T value)
+		{
+			NullValueProperty<T>::operator=(value);
+		}
+
+		void operator=(const char* name)
+		{
+			++*this->m_Calls;
+		}
+	private:
+		// remove copy constructor and assignment operator
+		NullNamedValueProperty(const NullNamedValueProperty& other) = delete;
+		void operator=(const NullNamedValueProperty& other) = delete;
+	};
+
+	// Same drawing API as RecordingCanvas, but every call and property assignment
+	// only adds to a count. As the backend of BasicCanvas, it measures the cost of
+	// the API itself without any drawing.
+	class NullCanvas
+	{
+	public:
+		NullCanvas(int width, int height)
+			: m_Width(width)
+			, m_Height(height)
+			, m_Calls(0)
+		{
+			fillStyle.init(&m_Calls);
+			strokeStyle.init(&m_Calls);
+			font.init(&m_Calls, "10px sans-serif");
+			fontFeatures.init(&m_Calls, "");
+			lineCap.init(&m_Calls, LineCap::butt);
+			lineJoin.init(&m_Calls, LineJoin::miter);
+			lineWidth.init(&m_Calls, 1.0);
+			miterLimit.init(&m_Calls, 10.0);
+			globalCompositeOperation.init(&m_Calls, GlobalCompositeOperationType::source_over);
+			shadowOffsetX.init(&m_Calls, 0.0);
+			shadowOffsetY.init(&m_Calls, 0.0);
+			shadowColor.init(&m_Calls, 0u);
+			shadowBlur.init(&m_Calls, 0u);
+			textRenderMode.init(&m_Calls, TextRenderMode::cairo);
+			pointRenderMode.init(&m_Calls, PointRenderMode::cairo);
+			textAlign.init(&m_Calls, TextAlign::start);
+			textBaseline.init(&m_Calls, TextBaseline::alphabetic);
+		}
+
+		int getWidth() const
+		{
+			return m_Width;
+		}
+		int getHeight() const
+		{
+			return m_Height;
+		}
+		// Calls and property assignments since the construction or resetCalls()
+		size_t getCalls() const
+		{
+			return m_Calls;
+		}
+		void resetCalls()
+		{
+			m_Calls = 0;
+		}
+
+		void fillRect(double x, double y, double width, double height)
+		{
+			++m_Calls;
+		}
+
+		void clearRect(double x, double y, double width, double height)
+		{
+			++m_Calls;
+		}
+
+		void strokeRect(double x, double y, double width, double height)
+		{
+			++m_Calls;
+		}
+
+		void fillText(const char* text, double x, double y)
+		{
+			++m_Calls;
+		}
+
+		void strokeText(const char* text, double x, double y)
+		{
+			++m_Calls;
+		}
+
+		void fillTextBatch(const TextItem* items, size_t count)
+		{
+			++m_Calls;
+		}
+
+		void fillTextBatch(const std::vector<TextItem>& items)
+		{
+			++m_Calls;
+		}
+
+		void strokeTextBatch(const TextItem* items, size_t count)
+		{
+			++m_Calls;
+		}
+
+		void strokeTextBatch(const std::vector<TextItem>& items)
+		{
+			++m_Calls;
+		}
+
+		void fillTextBox(const char* text, double x, double y, double maxWidth, double lineHeight, TextAlign align)
+		{
+			++m_Calls;
+		}
+
+		void fillRects(const Rect* rects, size_t count, const unsigned int* colors = nullptr)
+		{
+			++m_Calls;
+		}
+
+		void fillRects(const std::vector<Rect>& rects)
+		{
+			++m_Calls;
+		}
+
+		void fillRects(const std::vector<Rect>& rects, const std::vector<unsigned int>& colors)
+		{
+			++m_Calls;
+		}
+
+		void strokeSegments(const Line* lines, size_t count, const unsigned int* colors = nullptr)
+		{
+			++m_Calls;
+		}
+
+		void strokeSegments(const std::vector<Line>& lines)
+		{
+			++m_Calls;
+		}
+
+		void strokeSegments(const std::vector<Line>& lines, const std::vector<unsigned int>& colors)
+		{
+			++m_Calls;
+		}
+
+		void drawPoints(const Point* points, size_t count, double radius, PointShape shape, const unsigned int* colors = nullptr)
+		{
+			++m_Calls;
+		}
+
+		void drawPoints(const std::vector<Point>& points, double radius, PointShape shape)
+		{
+			++m_Calls;
+		}
+
+		void drawPoints(const std::vector<Point>& points, double radius, PointShape shape, const std::vector<unsigned int>& colors)
+		{
+			++m_Calls;
+		}
+
+		void strokePolyline(const Point* points, size_t count, PolylineLod lod = PolylineLod::m4)
+		{
+			++m_Calls;
+		}
+
+		void strokePolyline(const std::vector<Point>& points, PolylineLod lod = PolylineLod::m4)
+		{
+			++m_Calls;
+		}
+
+		void strokePolyline(const PolylinePyramid& pyramid)
+		{
+			++m_Calls;
+		}
+
+		void rect(double x, double y, double width, double height)
+		{
+			++m_Calls;
+		}
+
+		void beginPath()
+		{
+			++m_Calls;
+		}
+
+		void closePath()
+		{
+			++m_Calls;
+		}
+
+		void moveTo(double x, double y)
+		{
+			++m_Calls;
+		}
+
+		void lineTo(double x, double y)
+		{
+			++m_Calls;
+		}
+
+		void bezierCurveTo(double cp1x, double cp1y, double cp2x, double cp2y, double endx, double endy)
+		{
+			++m_Calls;
+		}
+
+		void quadraticCurveTo(double cpx, double cpy, double endx, double endy)
+		{
+			++m_Calls;
+		}
+
+		void arc(double xc, double yc, double radius, double angle1, double angle2)
+		{
+			++m_Calls;
+		}
+
+		void clip()
+		{
+			++m_Calls;
+		}
+
+		void clip(Path2D& path)
+		{
+			++m_Calls;
+		}
+
+		void stroke()
+		{
+			++m_Calls;
+		}
+
+		void stroke(Path2D& path)
+		{
+			++m_Calls;
+		}
+
+		void fill()
+		{
+			++m_Calls;
+		}
+
+		void fill(Path2D& path)
+		{
+			++m_Calls;
+		}
+
+		void scale(double sx, double sy)
+		{
+			++m_Calls;
+		}
+
+		void translate(double tx, double ty)
+		{
+			++m_Calls;
+		}
+
+		void rotate(double angle)
+		{
+			++m_Calls;
+		}
+
+		void transform(double xx, double xy, double yx, double yy, double x0, double y0)
+		{
+			++m_Calls;
+		}
+
+		void setTransform(double xx, double xy, double yx, double yy, double x0, double y0)
+		{
+			++m_Calls;
+		}
+
+		void drawImage(const char* image_file, double x0, double y0)
+		{
+			++m_Calls;
+		}
+
+		void drawCanvas(const Canvas& src, double x, double y)
+		{
+			++m_Calls;
+		}
+
+		void drawCanvas(const Canvas& src, double x, double y, double width, double height)
+		{
+			++m_Calls;
+		}
+
+		void drawCanvas(const Canvas& src, double sx, double sy, double sw, double sh,
+			double dx, double dy, double dw, double dh)
+		{
+			++m_Calls;
+		}
+
+		void putImageData(ImageData& imgData, int x, int y, int dirtyX = 0, int dirtyY = 0, int dirtyWidth = 0, int dirtyHeight = 0)
+		{
+			++m_Calls;
+		}
+
+		void save()
+		{
+			++m_Calls;
+		}
+
+		void restore()
+		{
+			++m_Calls;
+		}
+
+		NullStyleProperty fillStyle;
+		NullStyleProperty strokeStyle;
+		NullStringProperty font;
+		NullStringProperty fontFeatures;
+		NullValueProperty<LineCap> lineCap;
+		NullValueProperty<LineJoin> lineJoin;
+		NullValueProperty<double> lineWidth;
+		NullValueProperty<double> miterLimit;
+		NullNamedValueProperty<GlobalCompositeOperationType> globalCompositeOperation;
+		NullValueProperty<double> shadowOffsetX;
+		NullValueProperty<double> shadowOffsetY;
+		NullNamedValueProperty<unsigned int> shadowColor;
+		NullValueProperty<unsigned int> shadowBlur;
+		NullValueProperty<TextRenderMode> textRenderMode;
+		NullValueProperty<PointRenderMode> pointRenderMode;
+		NullNamedValueProperty<TextAlign> textAlign;
+		NullNamedValueProperty<TextBaseline> textBaseline;
+	private:
+		// remove copy constructor and assignment operator
+		NullCanvas(const NullCanvas& other) = delete;
+		void operator=(const NullCanvas& other) = delete;
+
+		int m_Width;
+		int m_Height;
+		size_t m_Calls;
+	};
+}
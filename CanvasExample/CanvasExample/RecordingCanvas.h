@@ -0,0 +1,1731 @@
+// Copyright 2019 Shao Voon Wong
+// No warranties expressed or implied
+// use it at your risk!
+
+#pragma once
+#if defined(__EMSCRIPTEN__) && !defined(CANVAS_SOFTWARE_RENDERER)
+	#include "JsCanvas.h"
+#else
+	#include "CppCanvas.h"
+#endif
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+namespace canvas
+{
+	enum class DisplayOp : unsigned char
+	{
+		fill_style_color,
+		fill_style_string,
+		fill_style_gradient,
+		fill_style_pattern,
+		stroke_style_color,
+		stroke_style_string,
+		stroke_style_gradient,
+		stroke_style_pattern,
+		font,
+		font_features,
+		line_cap,
+		line_join,
+		line_width,
+		miter_limit,
+		global_composite_operation,
+		global_composite_operation_string,
+		shadow_offset_x,
+		shadow_offset_y,
+		shadow_color,
+		shadow_color_string,
+		shadow_blur,
+		text_render_mode,
+		point_render_mode,
+		text_align,
+		text_align_string,
+		text_baseline,
+		text_baseline_string,
+		fill_rect,
+		clear_rect,
+		stroke_rect,
+		fill_text,
+		stroke_text,
+		fill_text_batch,
+		stroke_text_batch,
+		fill_text_box,
+		fill_rects,
+		stroke_segments,
+		draw_points,
+		stroke_polyline,
+		stroke_polyline_pyramid,
+		draw_heatmap,
+		rect,
+		begin_path,
+		close_path,
+		move_to,
+		line_to,
+		bezier_curve_to,
+		quadratic_curve_to,
+		arc,
+		clip,
+		clip_path,
+		stroke,
+		stroke_path,
+		fill,
+		fill_path,
+		scale,
+		translate,
+		rotate,
+		transform,
+		set_transform,
+		draw_image,
+		draw_canvas,
+		put_image_data,
+		save,
+		restore
+	};
+
+	// Compact command buffer: one opcode per command, its arguments as doubles,
+	// strings interned once and resources kept as indices into a pointer table.
+	// Gradients, patterns, paths, image data, heatmap values, thread pools and
+	// source canvases are not owned and must outlive the list. Colormaps are
+	// small values, often temporaries such as Colormap::viridis(), so they are copied.
+	// Drawing commands can carry device space bounds so that replay can skip them.
+	class DisplayList
+	{
+	public:
+		DisplayList() {}
+
+		void clear()
+		{
+			m_Ops.clear();
+			m_Offsets.clear();
+			m_Bounds.clear();
+			m_Args.clear();
+			m_Strings.clear();
+			m_StringIndex.clear();
+			m_Resources.clear();
+			m_Colormaps.clear();
+		}
+
+		size_t size() const
+		{
+			return m_Ops.size();
+		}
+
+		void add(DisplayOp op)
+		{
+			begin(op);
+		}
+		void add(DisplayOp op, double a)
+		{
+			begin(op);
+			m_Args.push_back(a);
+		}
+		void add(DisplayOp op, double a, double b)
+		{
+			begin(op);
+			m_Args.push_back(a);
+			m_Args.push_back(b);
+		}
+		void add(DisplayOp op, double a, double b, double c, double d)
+		{
+			begin(op);
+			const double args[] = { a, b, c, d };
+			m_Args.insert(m_Args.end(), args, args + 4);
+		}
+		void add(DisplayOp op, double a, double b, double c, double d, double e, double f)
+		{
+			begin(op);
+			const double args[] = { a, b, c, d, e, f };
+			m_Args.insert(m_Args.end(), args, args + 6);
+		}
+		void addArg(double a)
+		{
+			m_Args.push_back(a);
+		}
+		void addString(const char* str)
+		{
+			auto it = m_StringIndex.find(str);
+			if (it == m_StringIndex.end())
+			{
+				it = m_StringIndex.insert(std::make_pair(std::string(str), (unsigned int)m_Strings.size())).first;
+				m_Strings.push_back(str);
+			}
+			m_Args.push_back(it->second);
+		}
+		void addResource(const void* resource)
+		{
+			m_Args.push_back((double)m_Resources.size());
+			m_Resources.push_back(resource);
+		}
+		// Copy of the colormap, shared with the previous one when they are the same
+		void addColormap(const Colormap& colormap)
+		{
+			if (m_Colormaps.empty() ||
+				memcmp(m_Colormaps.back().data(), colormap.data(), Colormap::Size * sizeof(unsigned int)) != 0)
+				m_Colormaps.push_back(colormap);
+			m_Args.push_back((double)(m_Colormaps.size() - 1));
+		}
+		// Bounds of the last command, which is otherwise always executed
+		void setBounds(const Rect& bounds)
+		{
+			m_Bounds.back() = bounds;
+		}
+
+		void replay(Canvas& canvas) const
+		{
+			ReplayItems items;
+			const double* a = m_Args.data();
+			for (DisplayOp op : m_Ops)
+				a = execute(canvas, op, a, items);
+		}
+
+		// Union of the bounds of the drawing commands. A drawing command without
+		// bounds, such as an image, covers everything.
+		Rect getBounds() const
+		{
+			double x0 = 0.0, y0 = 0.0, x1 = 0.0, y1 = 0.0;
+			bool empty = true;
+			for (size_t i = 0; i < m_Ops.size(); ++i)
+			{
+				if (!draws(m_Ops[i]))
+					continue;
+
+				Rect bounds = m_Bounds[i];
+				if (bounds.width < 0.0)
+				{
+					Rect everything = { -1e30, -1e30, 2e30, 2e30 };
+					return everything;
+				}
+				if (bounds.width == 0.0 || bounds.height == 0.0)
+					continue;
+				if (empty || bounds.x < x0) x0 = bounds.x;
+				if (empty || bounds.y < y0) y0 = bounds.y;
+				if (empty || bounds.x + bounds.width > x1) x1 = bounds.x + bounds.width;
+				if (empty || bounds.y + bounds.height > y1) y1 = bounds.y + bounds.height;
+				empty = false;
+			}
+			Rect rc = { x0, y0, x1 - x0, y1 - y0 };
+			return rc;
+		}
+
+		// Skips the drawing commands whose bounds miss cull. A skipped command
+		// that draws the current path clears it, as CppCanvas does.
+		void replay(Canvas& canvas, const Rect& cull) const
+		{
+			ReplayItems items;
+			for (size_t i = 0; i < m_Ops.size(); ++i)
+			{
+				const Rect& bounds = m_Bounds[i];
+				if (bounds.width >= 0.0 &&
+					(bounds.x >= cull.x + cull.width || bounds.x + bounds.width <= cull.x ||
+					bounds.y >= cull.y + cull.height || bounds.y + bounds.height <= cull.y))
+				{
+					if (clearsPath(m_Ops[i]))
+						canvas.beginPath();
+					continue;
+				}
+				execute(canvas, m_Ops[i], m_Args.data() + m_Offsets[i], items);
+			}
+		}
+
+	private:
+		// remove copy constructor and assignment operator
+		DisplayList(const DisplayList& other) = delete;
+		void operator=(const DisplayList& other) = delete;
+
+		void begin(DisplayOp op)
+		{
+			m_Ops.push_back(op);
+			m_Offsets.push_back(m_Args.size());
+			Rect always = { 0.0, 0.0, -1.0, -1.0 };
+			m_Bounds.push_back(always);
+		}
+
+		static bool draws(DisplayOp op)
+		{
+			return op == DisplayOp::fill_rect || op == DisplayOp::clear_rect || op == DisplayOp::stroke_rect ||
+				op == DisplayOp::fill_text || op == DisplayOp::stroke_text ||
+				op == DisplayOp::fill_text_batch || op == DisplayOp::stroke_text_batch ||
+				op == DisplayOp::fill_text_box || op == DisplayOp::fill_rects || op == DisplayOp::stroke_segments ||
+				op == DisplayOp::draw_points || op == DisplayOp::stroke_polyline || op == DisplayOp::stroke_polyline_pyramid ||
+				op == DisplayOp::draw_heatmap || op == DisplayOp::stroke || op == DisplayOp::stroke_path ||
+				op == DisplayOp::fill || op == DisplayOp::fill_path ||
+				op == DisplayOp::draw_image || op == DisplayOp::draw_canvas || op == DisplayOp::put_image_data;
+		}
+
+		static bool clearsPath(DisplayOp op)
+		{
+			return op == DisplayOp::fill || op == DisplayOp::stroke ||
+				op == DisplayOp::fill_rect || op == DisplayOp::stroke_rect ||
+				op == DisplayOp::stroke_text || op == DisplayOp::stroke_text_batch ||
+				op == DisplayOp::fill_rects || op == DisplayOp::stroke_segments || op == DisplayOp::draw_points ||
+				op == DisplayOp::stroke_polyline || op == DisplayOp::stroke_polyline_pyramid;
+		}
+
+		const char* str(double index) const
+		{
+			return m_Strings[(size_t)index].c_str();
+		}
+		template<typename T>
+		T& resource(double index) const
+		{
+			return *(T*)m_Resources[(size_t)index];
+		}
+		template<typename T>
+		T* pointer(double index) const
+		{
+			return (T*)m_Resources[(size_t)index];
+		}
+
+		// Item arrays rebuilt from the arguments of the batch commands
+		struct ReplayItems
+		{
+			std::vector<TextItem> texts;
+			std::vector<Rect> rects;
+			std::vector<Line> lines;
+			std::vector<Point> points;
+			std::vector<unsigned int> colors;
+		};
+
+		// Reads the colors after the items if the command has them
+		const unsigned int* readColors(const double*& a, size_t count, bool has_colors, ReplayItems& items) const
+		{
+			if (!has_colors)
+				return nullptr;
+			items.colors.resize(count);
+			for (size_t i = 0; i < count; ++i)
+				items.colors[i] = (unsigned int)a[i];
+			a += count;
+			return items.colors.data();
+		}
+
+		// Executes one command and returns its end in the argument buffer
+		const double* execute(Canvas& canvas, DisplayOp op, const double* a, ReplayItems& items) const
+		{
+			switch (op)
+			{
+			case DisplayOp::fill_style_color:
+				canvas.fillStyle = (unsigned int)a[0];
+				return a + 1;
+			case DisplayOp::fill_style_string:
+				canvas.fillStyle = str(a[0]);
+				return a + 1;
+			case DisplayOp::fill_style_gradient:
+				canvas.fillStyle = resource<Gradient>(a[0]);
+				return a + 1;
+			case DisplayOp::fill_style_pattern:
+				canvas.fillStyle = resource<Pattern>(a[0]);
+				return a + 1;
+			case DisplayOp::stroke_style_color:
+				canvas.strokeStyle = (unsigned int)a[0];
+				return a + 1;
+			case DisplayOp::stroke_style_string:
+				canvas.strokeStyle = str(a[0]);
+				return a + 1;
+			case DisplayOp::stroke_style_gradient:
+				canvas.strokeStyle = resource<Gradient>(a[0]);
+				return a + 1;
+			case DisplayOp::stroke_style_pattern:
+				canvas.strokeStyle = resource<Pattern>(a[0]);
+				return a + 1;
+			case DisplayOp::font:
+				canvas.font = str(a[0]);
+				return a + 1;
+			case DisplayOp::font_features:
+				canvas.fontFeatures = str(a[0]);
+				return a + 1;
+			case DisplayOp::line_cap:
+				canvas.lineCap = (LineCap)(int)a[0];
+				return a + 1;
+			case DisplayOp::line_join:
+				canvas.lineJoin = (LineJoin)(int)a[0];
+				return a + 1;
+			case DisplayOp::line_width:
+				canvas.lineWidth = a[0];
+				return a + 1;
+			case DisplayOp::miter_limit:
+				canvas.miterLimit = a[0];
+				return a + 1;
+			case DisplayOp::global_composite_operation:
+				canvas.globalCompositeOperation = (GlobalCompositeOperationType)(int)a[0];
+				return a + 1;
+			case DisplayOp::global_composite_operation_string:
+				canvas.globalCompositeOperation = str(a[0]);
+				return a + 1;
+			case DisplayOp::shadow_offset_x:
+				canvas.shadowOffsetX = a[0];
+				return a + 1;
+			case DisplayOp::shadow_offset_y:
+				canvas.shadowOffsetY = a[0];
+				return a + 1;
+			case DisplayOp::shadow_color:
+				canvas.shadowColor = (unsigned int)a[0];
+				return a + 1;
+			case DisplayOp::shadow_color_string:
+				canvas.shadowColor = str(a[0]);
+				return a + 1;
+			case DisplayOp::shadow_blur:
+				canvas.shadowBlur = (unsigned int)a[0];
+				return a + 1;
+			case DisplayOp::text_render_mode:
+				canvas.textRenderMode = (TextRenderMode)(int)a[0];
+				return a + 1;
+			case DisplayOp::point_render_mode:
+				canvas.pointRenderMode = (PointRenderMode)(int)a[0];
+				return a + 1;
+			case DisplayOp::text_align:
+				canvas.textAlign = (TextAlign)(int)a[0];
+				return a + 1;
+			case DisplayOp::text_align_string:
+				canvas.textAlign = str(a[0]);
+				return a + 1;
+			case DisplayOp::text_baseline:
+				canvas.textBaseline = (TextBaseline)(int)a[0];
+				return a + 1;
+			case DisplayOp::text_baseline_string:
+				canvas.textBaseline = str(a[0]);
+				return a + 1;
+			case DisplayOp::fill_rect:
+				canvas.fillRect(a[0], a[1], a[2], a[3]);
+				return a + 4;
+			case DisplayOp::clear_rect:
+				canvas.clearRect(a[0], a[1], a[2], a[3]);
+				return a + 4;
+			case DisplayOp::stroke_rect:
+				canvas.strokeRect(a[0], a[1], a[2], a[3]);
+				return a + 4;
+			case DisplayOp::fill_text:
+				canvas.fillText(str(a[0]), a[1], a[2]);
+				return a + 3;
+			case DisplayOp::stroke_text:
+				canvas.strokeText(str(a[0]), a[1], a[2]);
+				return a + 3;
+			case DisplayOp::fill_text_batch:
+			case DisplayOp::stroke_text_batch:
+			{
+				// count, then text, x, y, has color and color of every item
+				size_t count = (size_t)a[0];
+				++a;
+				items.texts.resize(count);
+				for (size_t i = 0; i < count; ++i, a += 5)
+				{
+					TextItem& item = items.texts[i];
+					item.text = str(a[0]);
+					item.x = a[1];
+					item.y = a[2];
+					item.hasColor = (a[3] != 0.0);
+					item.color = (unsigned int)a[4];
+				}
+				if (op == DisplayOp::fill_text_batch)
+					canvas.fillTextBatch(items.texts);
+				else
+					canvas.strokeTextBatch(items.texts);
+				return a;
+			}
+			case DisplayOp::fill_text_box:
+				canvas.fillTextBox(str(a[0]), a[1], a[2], a[3], a[4], (TextAlign)(int)a[5]);
+				return a + 6;
+			case DisplayOp::fill_rects:
+			case DisplayOp::stroke_segments:
+			{
+				// count and has colors, then x, y, width, height or x0, y0, x1, y1
+				// of every item and the colors
+				size_t count = (size_t)a[0];
+				bool has_colors = (a[1] != 0.0);
+				a += 2;
+				items.rects.resize(count);
+				items.lines.resize(count);
+				for (size_t i = 0; i < count; ++i, a += 4)
+				{
+					Rect rc = { a[0], a[1], a[2], a[3] };
+					Line line = { a[0], a[1], a[2], a[3] };
+					items.rects[i] = rc;
+					items.lines[i] = line;
+				}
+				const unsigned int* colors = readColors(a, count, has_colors, items);
+				if (op == DisplayOp::fill_rects)
+					canvas.fillRects(items.rects.data(), count, colors);
+				else
+					canvas.strokeSegments(items.lines.data(), count, colors);
+				return a;
+			}
+			case DisplayOp::draw_points:
+			{
+				// count, radius, shape and has colors, then x, y of every item and the colors
+				size_t count = (size_t)a[0];
+				double radius = a[1];
+				PointShape shape = (PointShape)(int)a[2];
+				bool has_colors = (a[3] != 0.0);
+				a += 4;
+				items.points.resize(count);
+				for (size_t i = 0; i < count; ++i, a += 2)
+				{
+					Point pt = { a[0], a[1] };
+					items.points[i] = pt;
+				}
+				const unsigned int* colors = readColors(a, count, has_colors, items);
+				canvas.drawPoints(items.points.data(), count, radius, shape, colors);
+				return a;
+			}
+			case DisplayOp::stroke_polyline:
+			{
+				// count and lod, then x, y of every point
+				size_t count = (size_t)a[0];
+				PolylineLod lod = (PolylineLod)(int)a[1];
+				a += 2;
+				items.points.resize(count);
+				for (size_t i = 0; i < count; ++i, a += 2)
+				{
+					Point pt = { a[0], a[1] };
+					items.points[i] = pt;
+				}
+				canvas.strokePolyline(items.points.data(), count, lod);
+				return a;
+			}
+			case DisplayOp::stroke_polyline_pyramid:
+				canvas.strokePolyline(resource<PolylinePyramid>(a[0]));
+				return a + 1;
+			case DisplayOp::draw_heatmap:
+			{
+				// values, cols, rows, dest, colormap, low, high, filter and pool
+				Rect dest = { a[3], a[4], a[5], a[6] };
+				canvas.drawHeatmap(pointer<const float>(a[0]), (int)a[1], (int)a[2], dest, m_Colormaps[(size_t)a[7]],
+					a[8], a[9], (HeatmapFilter)(int)a[10], pointer<ThreadPool>(a[11]));
+				return a + 12;
+			}
+			case DisplayOp::rect:
+				canvas.rect(a[0], a[1], a[2], a[3]);
+				return a + 4;
+			case DisplayOp::begin_path:
+				canvas.beginPath();
+				return a;
+			case DisplayOp::close_path:
+				canvas.closePath();
+				return a;
+			case DisplayOp::move_to:
+				canvas.moveTo(a[0], a[1]);
+				return a + 2;
+			case DisplayOp::line_to:
+				canvas.lineTo(a[0], a[1]);
+				return a + 2;
+			case DisplayOp::bezier_curve_to:
+				canvas.bezierCurveTo(a[0], a[1], a[2], a[3], a[4], a[5]);
+				return a + 6;
+			case DisplayOp::quadratic_curve_to:
+				canvas.quadraticCurveTo(a[0], a[1], a[2], a[3]);
+				return a + 4;
+			case DisplayOp::arc:
+				canvas.arc(a[0], a[1], a[2], a[3], a[4]);
+				return a + 5;
+			case DisplayOp::clip:
+				canvas.clip();
+				return a;
+			case DisplayOp::clip_path:
+				canvas.clip(resource<Path2D>(a[0]));
+				return a + 1;
+			case DisplayOp::stroke:
+				canvas.stroke();
+				return a;
+			case DisplayOp::stroke_path:
+				canvas.stroke(resource<Path2D>(a[0]));
+				return a + 1;
+			case DisplayOp::fill:
+				canvas.fill();
+				return a;
+			case DisplayOp::fill_path:
+				canvas.fill(resource<Path2D>(a[0]));
+				return a + 1;
+			case DisplayOp::scale:
+				canvas.scale(a[0], a[1]);
+				return a + 2;
+			case DisplayOp::translate:
+				canvas.translate(a[0], a[1]);
+				return a + 2;
+			case DisplayOp::rotate:
+				canvas.rotate(a[0]);
+				return a + 1;
+			case DisplayOp::transform:
+				canvas.transform(a[0], a[1], a[2], a[3], a[4], a[5]);
+				return a + 6;
+			case DisplayOp::set_transform:
+				canvas.setTransform(a[0], a[1], a[2], a[3], a[4], a[5]);
+				return a + 6;
+			case DisplayOp::draw_image:
+				canvas.drawImage(str(a[0]), a[1], a[2]);
+				return a + 3;
+			case DisplayOp::draw_canvas:
+			{
+				// source, argument count and the arguments of the overload
+				const Canvas& src = resource<Canvas>(a[0]);
+				int count = (int)a[1];
+				const double* args = a + 2;
+				if (count == 2)
+					canvas.drawCanvas(src, args[0], args[1]);
+				else if (count == 4)
+					canvas.drawCanvas(src, args[0], args[1], args[2], args[3]);
+				else
+					canvas.drawCanvas(src, args[0], args[1], args[2], args[3], args[4], args[5], args[6], args[7]);
+				return args + count;
+			}
+			case DisplayOp::put_image_data:
+				canvas.putImageData(resource<ImageData>(a[0]), (int)a[1], (int)a[2], (int)a[3], (int)a[4], (int)a[5], (int)a[6]);
+				return a + 7;
+			case DisplayOp::save:
+				canvas.save();
+				return a;
+			case DisplayOp::restore:
+				canvas.restore();
+				return a;
+			}
+			return a;
+		}
+
+		std::vector<DisplayOp> m_Ops;
+		std::vector<size_t> m_Offsets;
+		std::vector<Rect> m_Bounds;
+		std::vector<double> m_Args;
+		std::vector<std::string> m_Strings;
+		std::unordered_map<std::string, unsigned int> m_StringIndex;
+		std::vector<const void*> m_Resources;
+		std::vector<Colormap> m_Colormaps;
+	};
+
+	class RecordingStyleProperty
+	{
+	public:
+		RecordingStyleProperty() : m_List(nullptr), m_Op(DisplayOp::fill_style_color) {}
+
+		// op is the color opcode, the string, gradient and pattern opcodes follow it
+		void init(DisplayList* list, DisplayOp op)
+		{
+			m_List = list;
+			m_Op = op;
+		}
+
+		void operator=(const char* color)
+		{
+			m_List->add(nextOp(1));
+			m_List->addString(color);
+		}
+		void operator=(unsigned int color)
+		{
+			m_List->add(m_Op, color);
+		}
+		void operator=(const canvas::Gradient& gradient)
+		{
+			m_List->add(nextOp(2));
+			m_List->addResource(&gradient);
+		}
+		void operator=(const canvas::Pattern& pat)
+		{
+			m_List->add(nextOp(3));
+			m_List->addResource(&pat);
+		}
+	private:
+		// remove copy constructor and assignment operator
+		RecordingStyleProperty(const RecordingStyleProperty& other) = delete;
+		void operator=(const RecordingStyleProperty& other) = delete;
+
+		DisplayOp nextOp(int offset) const
+		{
+			return (DisplayOp)((int)m_Op + offset);
+		}
+
+		DisplayList* m_List;
+		DisplayOp m_Op;
+	};
+
+	class RecordingStringProperty
+	{
+	public:
+		RecordingStringProperty() : m_List(nullptr), m_Op(DisplayOp::font) {}
+
+		void init(DisplayList* list, DisplayOp op, const char* value)
+		{
+			m_List = list;
+			m_Op = op;
+			m_Value = value;
+		}
+
+		void operator=(const char* value)
+		{
+			m_Value = value;
+			m_List->add(m_Op);
+			m_List->addString(value);
+		}
+		operator const char*() const
+		{
+			return m_Value.c_str();
+		}
+		// Changes the value without recording it, for restore()
+		void setValue(const std::string& value)
+		{
+			m_Value = value;
+		}
+	private:
+		// remove copy constructor and assignment operator
+		RecordingStringProperty(const RecordingStringProperty& other) = delete;
+		void operator=(const RecordingStringProperty& other) = delete;
+
+		DisplayList* m_List;
+		DisplayOp m_Op;
+		std::string m_Value;
+	};
+
+	// Keeps the last value so that it can be read back like the Canvas properties
+	template<typename T>
+	class RecordingValueProperty
+	{
+	public:
+		RecordingValueProperty() : m_List(nullptr), m_Op(DisplayOp::line_width), m_Value() {}
+
+		void init(DisplayList* list, DisplayOp op, T value)
+		{
+			m_List = list;
+			m_Op = op;
+			m_Value = value;
+		}
+
+		void operator=(T value)
+		{
+			m_Value = value;
+			m_Name.clear();
+			m_List->add(m_Op, (double)value);
+		}
+		operator T() const
+		{
+			return m_Value;
+		}
+		// Name of the value if it was last set by name, otherwise an empty string
+		const char* getName() const
+		{
+			return m_Name.c_str();
+		}
+		// Changes the value without recording it, for restore()
+		void setValue(T value, const std::string& name)
+		{
+			m_Value = value;
+			m_Name = name;
+		}
+	private:
+		// remove copy constructor and assignment operator
+		RecordingValueProperty(const RecordingValueProperty& other) = delete;
+		void operator=(const RecordingValueProperty& other) = delete;
+
+	protected:
+		DisplayList* m_List;
+		DisplayOp m_Op;
+		T m_Value;
+		std::string m_Name;
+	};
+
+	// Value that can also be set by its name, recorded with the opcode that follows
+	template<typename T>
+	class RecordingNamedValueProperty : public RecordingValueProperty<T>
+	{
+	public:
+		RecordingNamedValueProperty() {}
+
+		void operator=(T value)
+		{
+			RecordingValueProperty<T>::operator=(value);
+		}
+
+		void operator=(const char* name)
+		{
+			this->m_Name = name;
+			this->m_List->add((DisplayOp)((int)this->m_Op + 1));
+			this->m_List->addString(name);
+		}
+	private:
+		// remove copy constructor and assignment operator
+		RecordingNamedValueProperty(const RecordingNamedValueProperty& other) = delete;
+		void operator=(const RecordingNamedValueProperty& other) = delete;
+	};
+
+	template<typename T>
+	class RecordingEnumProperty : public RecordingValueProperty<T>
+	{
+	public:
+		RecordingEnumProperty() {}
+
+		void operator=(T value)
+		{
+			this->m_Value = value;
+			this->m_Name.clear();
+			this->m_List->add(this->m_Op, (double)(int)value);
+		}
+	private:
+		// remove copy constructor and assignment operator
+		RecordingEnumProperty(const RecordingEnumProperty& other) = delete;
+		void operator=(const RecordingEnumProperty& other) = delete;
+	};
+
+	template<typename T>
+	class RecordingNamedEnumProperty : public RecordingEnumProperty<T>
+	{
+	public:
+		RecordingNamedEnumProperty() {}
+
+		void operator=(T value)
+		{
+			RecordingEnumProperty<T>::operator=(value);
+		}
+
+		void operator=(const char* name)
+		{
+			this->m_Name = name;
+			this->m_List->add((DisplayOp)((int)this->m_Op + 1));
+			this->m_List->addString(name);
+		}
+	private:
+		// remove copy constructor and assignment operator
+		RecordingNamedEnumProperty(const RecordingNamedEnumProperty& other) = delete;
+		void operator=(const RecordingNamedEnumProperty& other) = delete;
+	};
+
+	// Same drawing API as Canvas, but every call is appended to a DisplayList
+	// that replay() executes later on a CppCanvas or JsCanvas.
+	// Queries such as measureText and getImageData need a real Canvas.
+	// The transform and path are tracked to give the drawing commands conservative
+	// device bounds, following the CppCanvas rules for shadows and the current path.
+	class RecordingCanvas
+	{
+	public:
+		RecordingCanvas(int width, int height)
+			: m_Width(width)
+			, m_Height(height)
+			, m_MaxShadowBlur(0)
+		{
+			m_Matrix.init();
+			fillStyle.init(&m_List, DisplayOp::fill_style_color);
+			strokeStyle.init(&m_List, DisplayOp::stroke_style_color);
+			font.init(&m_List, DisplayOp::font, "10px sans-serif");
+			fontFeatures.init(&m_List, DisplayOp::font_features, "");
+			lineCap.init(&m_List, DisplayOp::line_cap, LineCap::butt);
+			lineJoin.init(&m_List, DisplayOp::line_join, LineJoin::miter);
+			lineWidth.init(&m_List, DisplayOp::line_width, 1.0);
+			miterLimit.init(&m_List, DisplayOp::miter_limit, 10.0);
+			globalCompositeOperation.init(&m_List, DisplayOp::global_composite_operation, GlobalCompositeOperationType::source_over);
+			shadowOffsetX.init(&m_List, DisplayOp::shadow_offset_x, 0.0);
+			shadowOffsetY.init(&m_List, DisplayOp::shadow_offset_y, 0.0);
+			shadowColor.init(&m_List, DisplayOp::shadow_color, 0);
+			shadowBlur.init(&m_List, DisplayOp::shadow_blur, 0);
+			textRenderMode.init(&m_List, DisplayOp::text_render_mode, TextRenderMode::cairo);
+			pointRenderMode.init(&m_List, DisplayOp::point_render_mode, PointRenderMode::cairo);
+			textAlign.init(&m_List, DisplayOp::text_align, TextAlign::start);
+			textBaseline.init(&m_List, DisplayOp::text_baseline, TextBaseline::alphabetic);
+		}
+
+		int getWidth() const
+		{
+			return m_Width;
+		}
+		int getHeight() const
+		{
+			return m_Height;
+		}
+		const DisplayList& getDisplayList() const
+		{
+			return m_List;
+		}
+		void clear()
+		{
+			m_List.clear();
+			m_Matrix.init();
+			m_States.clear();
+			m_Path.clear();
+			m_RawPath.clear();
+			m_MaxShadowBlur = 0;
+		}
+		// Largest shadow blur of the recorded drawing commands
+		unsigned int getMaxShadowBlur() const
+		{
+			return m_MaxShadowBlur;
+		}
+
+		void replay(Canvas& canvas) const
+		{
+			m_List.replay(canvas);
+		}
+
+		void fillRect(double x, double y, double width, double height)
+		{
+			m_List.add(DisplayOp::fill_rect, x, y, width, height);
+			setRectBounds(x, y, width, height, 0.0);
+		}
+
+		void clearRect(double x, double y, double width, double height)
+		{
+			m_List.add(DisplayOp::clear_rect, x, y, width, height);
+			m_Path.clear();
+			m_RawPath.clear();
+		}
+
+		void strokeRect(double x, double y, double width, double height)
+		{
+			m_List.add(DisplayOp::stroke_rect, x, y, width, height);
+			setRectBounds(x, y, width, height, strokeExtent());
+		}
+
+		void fillText(const char* text, double x, double y)
+		{
+			m_List.add(DisplayOp::fill_text);
+			m_List.addString(text);
+			m_List.addArg(x);
+			m_List.addArg(y);
+			TextItem item = { text, x, y, false, 0 };
+			setTextBounds(&item, 1, false);
+		}
+
+		void strokeText(const char* text, double x, double y)
+		{
+			m_List.add(DisplayOp::stroke_text);
+			m_List.addString(text);
+			m_List.addArg(x);
+			m_List.addArg(y);
+			TextItem item = { text, x, y, false, 0 };
+			setTextBounds(&item, 1, true);
+		}
+
+		void fillTextBatch(const TextItem* items, size_t count)
+		{
+			addTextBatch(DisplayOp::fill_text_batch, items, count);
+		}
+
+		void fillTextBatch(const std::vector<TextItem>& items)
+		{
+			addTextBatch(DisplayOp::fill_text_batch, items.data(), items.size());
+		}
+
+		void strokeTextBatch(const TextItem* items, size_t count)
+		{
+			addTextBatch(DisplayOp::stroke_text_batch, items, count);
+		}
+
+		void strokeTextBatch(const std::vector<TextItem>& items)
+		{
+			addTextBatch(DisplayOp::stroke_text_batch, items.data(), items.size());
+		}
+
+		// The lines are only laid out on replay, so the box is not known here
+		void fillTextBox(const char* text, double x, double y, double maxWidth, double lineHeight, TextAlign align)
+		{
+			m_List.add(DisplayOp::fill_text_box);
+			m_List.addString(text);
+			m_List.addArg(x);
+			m_List.addArg(y);
+			m_List.addArg(maxWidth);
+			m_List.addArg(lineHeight);
+			m_List.addArg((int)align);
+			setBounds(nullptr, nullptr);
+		}
+
+		void fillRects(const Rect* rects, size_t count, const unsigned int* colors = nullptr)
+		{
+			m_List.add(DisplayOp::fill_rects, (double)count, (colors != nullptr) ? 1.0 : 0.0);
+			Extent device;
+			Extent raw;
+			for (size_t i = 0; i < count; ++i)
+			{
+				const double args[] = { rects[i].x, rects[i].y, rects[i].width, rects[i].height };
+				for (double arg : args)
+					m_List.addArg(arg);
+				addRect(device, raw, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+			}
+			addColors(colors, count);
+			setItemBounds(device, raw, 0.0);
+		}
+
+		void fillRects(const std::vector<Rect>& rects)
+		{
+			fillRects(rects.data(), rects.size());
+		}
+
+		void fillRects(const std::vector<Rect>& rects, const std::vector<unsigned int>& colors)
+		{
+			fillRects(rects.data(), rects.size(), colors.empty() ? nullptr : colors.data());
+		}
+
+		void strokeSegments(const Line* lines, size_t count, const unsigned int* colors = nullptr)
+		{
+			m_List.add(DisplayOp::stroke_segments, (double)count, (colors != nullptr) ? 1.0 : 0.0);
+			Extent device;
+			Extent raw;
+			for (size_t i = 0; i < count; ++i)
+			{
+				const double args[] = { lines[i].x0, lines[i].y0, lines[i].x1, lines[i].y1 };
+				for (double arg : args)
+					m_List.addArg(arg);
+				addPoint(device, raw, lines[i].x0, lines[i].y0);
+				addPoint(device, raw, lines[i].x1, lines[i].y1);
+			}
+			addColors(colors, count);
+			setItemBounds(device, raw, strokeExtent());
+		}
+
+		void strokeSegments(const std::vector<Line>& lines)
+		{
+			strokeSegments(lines.data(), lines.size());
+		}
+
+		void strokeSegments(const std::vector<Line>& lines, const std::vector<unsigned int>& colors)
+		{
+			strokeSegments(lines.data(), lines.size(), colors.empty() ? nullptr : colors.data());
+		}
+
+		void drawPoints(const Point* points, size_t count, double radius, PointShape shape, const unsigned int* colors = nullptr)
+		{
+			m_List.add(DisplayOp::draw_points, (double)count, radius, (double)(int)shape, (colors != nullptr) ? 1.0 : 0.0);
+			Extent device;
+			Extent raw;
+			for (size_t i = 0; i < count; ++i)
+			{
+				m_List.addArg(points[i].x);
+				m_List.addArg(points[i].y);
+				addRect(device, raw, points[i].x - radius, points[i].y - radius, 2.0 * radius, 2.0 * radius);
+			}
+			addColors(colors, count);
+			setItemBounds(device, raw, 0.0);
+		}
+
+		void drawPoints(const std::vector<Point>& points, double radius, PointShape shape)
+		{
+			drawPoints(points.data(), points.size(), radius, shape);
+		}
+
+		void drawPoints(const std::vector<Point>& points, double radius, PointShape shape, const std::vector<unsigned int>& colors)
+		{
+			drawPoints(points.data(), points.size(), radius, shape, colors.empty() ? nullptr : colors.data());
+		}
+
+		// The palette colors are recorded per point
+		void drawPoints(const Point* points, size_t count, double radius, PointShape shape,
+			const unsigned char* indices, const unsigned int* palette)
+		{
+			std::vector<unsigned int> colors(count);
+			for (size_t i = 0; i < count; ++i)
+				colors[i] = palette[indices[i]];
+			drawPoints(points, count, radius, shape, colors.data());
+		}
+
+		void drawPoints(const std::vector<Point>& points, double radius, PointShape shape,
+			const std::vector<unsigned char>& indices, const std::vector<unsigned int>& palette)
+		{
+			drawPoints(points.data(), points.size(), radius, shape, indices.data(), palette.data());
+		}
+
+		void strokePolyline(const Point* points, size_t count, PolylineLod lod = PolylineLod::m4)
+		{
+			m_List.add(DisplayOp::stroke_polyline, (double)count, (double)(int)lod);
+			Extent device;
+			Extent raw;
+			for (size_t i = 0; i < count; ++i)
+			{
+				m_List.addArg(points[i].x);
+				m_List.addArg(points[i].y);
+				addPoint(device, raw, points[i].x, points[i].y);
+			}
+			setItemBounds(device, raw, strokeExtent());
+		}
+
+		void strokePolyline(const std::vector<Point>& points, PolylineLod lod = PolylineLod::m4)
+		{
+			strokePolyline(points.data(), points.size(), lod);
+		}
+
+		void drawHeatmap(const float* values, int cols, int rows, const Rect& dest, const Colormap& colormap,
+			double low, double high, HeatmapFilter filter = HeatmapFilter::nearest, ThreadPool* pool = nullptr)
+		{
+			m_List.add(DisplayOp::draw_heatmap);
+			m_List.addResource(values);
+			const double args[] = { (double)cols, (double)rows, dest.x, dest.y, dest.width, dest.height };
+			for (double arg : args)
+				m_List.addArg(arg);
+			m_List.addColormap(colormap);
+			m_List.addArg(low);
+			m_List.addArg(high);
+			m_List.addArg((int)filter);
+			m_List.addResource(pool);
+			// the current path is kept
+			Extent device;
+			Extent raw;
+			addRect(device, raw, dest.x, dest.y, dest.width, dest.height);
+			setBounds(&device, &raw);
+		}
+
+		void drawHeatmap(const std::vector<float>& values, int cols, int rows, const Rect& dest, const Colormap& colormap,
+			double low, double high, HeatmapFilter filter = HeatmapFilter::nearest, ThreadPool* pool = nullptr)
+		{
+			drawHeatmap(values.data(), cols, rows, dest, colormap, low, high, filter, pool);
+		}
+
+		// The points of the pyramid are not visited, so it is always replayed
+		void strokePolyline(const PolylinePyramid& pyramid)
+		{
+			m_List.add(DisplayOp::stroke_polyline_pyramid);
+			m_List.addResource(&pyramid);
+			setBounds(nullptr, nullptr);
+			m_Path.clear();
+			m_RawPath.clear();
+		}
+
+		void rect(double x, double y, double width, double height)
+		{
+			m_List.add(DisplayOp::rect, x, y, width, height);
+			addRect(m_Path, m_RawPath, x, y, width, height);
+		}
+
+		void beginPath()
+		{
+			m_List.add(DisplayOp::begin_path);
+			m_Path.clear();
+			m_RawPath.clear();
+		}
+
+		void closePath()
+		{
+			m_List.add(DisplayOp::close_path);
+		}
+
+		void moveTo(double x, double y)
+		{
+			m_List.add(DisplayOp::move_to, x, y);
+			addPoint(m_Path, m_RawPath, x, y);
+		}
+
+		void lineTo(double x, double y)
+		{
+			m_List.add(DisplayOp::line_to, x, y);
+			addPoint(m_Path, m_RawPath, x, y);
+		}
+
+		void bezierCurveTo(double cp1x, double cp1y, double cp2x, double cp2y, double endx, double endy)
+		{
+			m_List.add(DisplayOp::bezier_curve_to, cp1x, cp1y, cp2x, cp2y, endx, endy);
+			// the curve stays inside the hull of its control points
+			addPoint(m_Path, m_RawPath, cp1x, cp1y);
+			addPoint(m_Path, m_RawPath, cp2x, cp2y);
+			addPoint(m_Path, m_RawPath, endx, endy);
+		}
+
+		void quadraticCurveTo(double cpx, double cpy, double endx, double endy)
+		{
+			m_List.add(DisplayOp::quadratic_curve_to, cpx, cpy, endx, endy);
+			addPoint(m_Path, m_RawPath, cpx, cpy);
+			addPoint(m_Path, m_RawPath, endx, endy);
+		}
+
+		void arc(double xc, double yc,
+			double radius,
+			double angle1, double angle2)
+		{
+			m_List.add(DisplayOp::arc, xc, yc, radius, angle1);
+			m_List.addArg(angle2);
+			addRect(m_Path, m_RawPath, xc - radius, yc - radius, 2.0 * radius, 2.0 * radius);
+		}
+
+		void clip()
+		{
+			m_List.add(DisplayOp::clip);
+		}
+
+		void clip(Path2D& path)
+		{
+			m_List.add(DisplayOp::clip_path);
+			m_List.addResource(&path);
+		}
+
+		void stroke()
+		{
+			m_List.add(DisplayOp::stroke);
+			setPathBounds(strokeExtent());
+		}
+
+		void stroke(Path2D& path)
+		{
+			m_List.add(DisplayOp::stroke_path);
+			m_List.addResource(&path);
+			setBounds(nullptr, nullptr);
+		}
+
+		void fill()
+		{
+			m_List.add(DisplayOp::fill);
+			setPathBounds(0.0);
+		}
+
+		void fill(Path2D& path)
+		{
+			m_List.add(DisplayOp::fill_path);
+			m_List.addResource(&path);
+			setBounds(nullptr, nullptr);
+		}
+
+		void scale(double sx, double sy)
+		{
+			m_List.add(DisplayOp::scale, sx, sy);
+			m_Matrix.scale(sx, sy);
+		}
+
+		void translate(double tx, double ty)
+		{
+			m_List.add(DisplayOp::translate, tx, ty);
+			m_Matrix.translate(tx, ty);
+		}
+
+		void rotate(double angle)
+		{
+			m_List.add(DisplayOp::rotate, angle);
+			m_Matrix.rotate(angle);
+		}
+
+		void transform(double xx, double xy, double yx, double yy, double x0, double y0)
+		{
+			m_List.add(DisplayOp::transform, xx, xy, yx, yy, x0, y0);
+			m_Matrix.transform(xx, xy, yx, yy, x0, y0);
+		}
+
+		void setTransform(double xx, double xy, double yx, double yy, double x0, double y0)
+		{
+			m_List.add(DisplayOp::set_transform, xx, xy, yx, yy, x0, y0);
+			m_Matrix.init();
+			m_Matrix.transform(xx, xy, yx, yy, x0, y0);
+		}
+
+		void drawImage(const char* image_file, double x0, double y0)
+		{
+			m_List.add(DisplayOp::draw_image);
+			m_List.addString(image_file);
+			m_List.addArg(x0);
+			m_List.addArg(y0);
+		}
+
+		// The size of src is not known here, so this is always replayed
+		void drawCanvas(const Canvas& src, double x, double y)
+		{
+			const double args[] = { x, y };
+			addDrawCanvas(src, args, 2);
+			// the current path is kept
+			setBounds(nullptr, nullptr);
+		}
+
+		void drawCanvas(const Canvas& src, double x, double y, double width, double height)
+		{
+			const double args[] = { x, y, width, height };
+			addDrawCanvas(src, args, 4);
+			Extent device;
+			Extent raw;
+			addRect(device, raw, x, y, width, height);
+			setBounds(&device, &raw);
+		}
+
+		void drawCanvas(const Canvas& src, double sx, double sy, double sw, double sh,
+			double dx, double dy, double dw, double dh)
+		{
+			const double args[] = { sx, sy, sw, sh, dx, dy, dw, dh };
+			addDrawCanvas(src, args, 8);
+			Extent device;
+			Extent raw;
+			addRect(device, raw, dx, dy, dw, dh);
+			setBounds(&device, &raw);
+		}
+
+		void putImageData(ImageData& imgData, int x, int y, int dirtyX = 0, int dirtyY = 0, int dirtyWidth = 0, int dirtyHeight = 0)
+		{
+			m_List.add(DisplayOp::put_image_data);
+			m_List.addResource(&imgData);
+			const double args[] = { (double)x, (double)y, (double)dirtyX, (double)dirtyY, (double)dirtyWidth, (double)dirtyHeight };
+			for (double arg : args)
+				m_List.addArg(arg);
+		}
+
+		void save()
+		{
+			m_List.add(DisplayOp::save);
+
+			DisplayState state;
+			state.matrix = m_Matrix;
+			state.lineWidth = lineWidth;
+			state.miterLimit = miterLimit;
+			state.lineJoin = lineJoin;
+			state.compositeOp = globalCompositeOperation;
+			state.compositeName = globalCompositeOperation.getName();
+			state.font = font;
+			state.fontFeatures = fontFeatures;
+			m_States.push_back(state);
+		}
+
+		// Restores what CppCanvas restores, which keeps the shadow. Like the
+		// context, a restore without a save does nothing. It is not recorded, so
+		// that a replayed list cannot pop the states of its caller.
+		void restore()
+		{
+			if (m_States.empty())
+				return;
+			m_List.add(DisplayOp::restore);
+
+			const DisplayState& state = m_States.back();
+			m_Matrix = state.matrix;
+			lineWidth.setValue(state.lineWidth, "");
+			miterLimit.setValue(state.miterLimit, "");
+			lineJoin.setValue(state.lineJoin, "");
+			globalCompositeOperation.setValue(state.compositeOp, state.compositeName);
+			font.setValue(state.font);
+			fontFeatures.setValue(state.fontFeatures);
+			m_States.pop_back();
+		}
+
+		RecordingStyleProperty fillStyle;
+		RecordingStyleProperty strokeStyle;
+		RecordingStringProperty font;
+		RecordingStringProperty fontFeatures;
+		RecordingEnumProperty<LineCap> lineCap;
+		RecordingEnumProperty<LineJoin> lineJoin;
+		RecordingValueProperty<double> lineWidth;
+		RecordingValueProperty<double> miterLimit;
+		RecordingNamedEnumProperty<GlobalCompositeOperationType> globalCompositeOperation;
+		RecordingValueProperty<double> shadowOffsetX;
+		RecordingValueProperty<double> shadowOffsetY;
+		RecordingNamedValueProperty<unsigned int> shadowColor;
+		RecordingValueProperty<unsigned int> shadowBlur;
+		RecordingEnumProperty<TextRenderMode> textRenderMode;
+		RecordingEnumProperty<PointRenderMode> pointRenderMode;
+		RecordingNamedEnumProperty<TextAlign> textAlign;
+		RecordingNamedEnumProperty<TextBaseline> textBaseline;
+	private:
+		// remove copy constructor and assignment operator
+		RecordingCanvas(const RecordingCanvas& other) = delete;
+		void operator=(const RecordingCanvas& other) = delete;
+
+		// cairo matrix, transform() takes its arguments in the CppCanvas order
+		struct DisplayMatrix
+		{
+			double xx, yx, xy, yy, x0, y0;
+
+			void init()
+			{
+				xx = yy = 1.0;
+				yx = xy = x0 = y0 = 0.0;
+			}
+			void transform(double a_xx, double a_xy, double a_yx, double a_yy, double a_x0, double a_y0)
+			{
+				DisplayMatrix m = *this;
+				xx = m.xx * a_xx + m.xy * a_yx;
+				xy = m.xx * a_xy + m.xy * a_yy;
+				yx = m.yx * a_xx + m.yy * a_yx;
+				yy = m.yx * a_xy + m.yy * a_yy;
+				x0 = m.xx * a_x0 + m.xy * a_y0 + m.x0;
+				y0 = m.yx * a_x0 + m.yy * a_y0 + m.y0;
+			}
+			void translate(double tx, double ty)
+			{
+				transform(1.0, 0.0, 0.0, 1.0, tx, ty);
+			}
+			void scale(double sx, double sy)
+			{
+				transform(sx, 0.0, 0.0, sy, 0.0, 0.0);
+			}
+			void rotate(double angle)
+			{
+				double c = cos(angle);
+				double s = sin(angle);
+				transform(c, -s, s, c, 0.0, 0.0);
+			}
+			void apply(double x, double y, double& dx, double& dy) const
+			{
+				dx = xx * x + xy * y + x0;
+				dy = yx * x + yy * y + y0;
+			}
+			// Largest stretch of a unit length
+			double maxScale() const
+			{
+				double sx = sqrt(xx * xx + yx * yx);
+				double sy = sqrt(xy * xy + yy * yy);
+				return (sx > sy) ? sx : sy;
+			}
+		};
+
+		struct DisplayState
+		{
+			DisplayMatrix matrix;
+			double lineWidth;
+			double miterLimit;
+			LineJoin lineJoin;
+			GlobalCompositeOperationType compositeOp;
+			std::string compositeName;
+			std::string font;
+			std::string fontFeatures;
+		};
+
+		struct Extent
+		{
+			double x0, y0, x1, y1;
+			bool empty;
+
+			Extent() : x0(0.0), y0(0.0), x1(0.0), y1(0.0), empty(true) {}
+
+			void clear()
+			{
+				empty = true;
+			}
+			void add(double x, double y)
+			{
+				if (empty)
+				{
+					x0 = x1 = x;
+					y0 = y1 = y;
+					empty = false;
+					return;
+				}
+				if (x < x0) x0 = x;
+				if (x > x1) x1 = x;
+				if (y < y0) y0 = y;
+				if (y > y1) y1 = y;
+			}
+			void add(const Extent& other)
+			{
+				if (!other.empty)
+				{
+					add(other.x0, other.y0);
+					add(other.x1, other.y1);
+				}
+			}
+		};
+
+		void addTextBatch(DisplayOp op, const TextItem* items, size_t count)
+		{
+			m_List.add(op, (double)count);
+			for (size_t i = 0; i < count; ++i)
+			{
+				m_List.addString(items[i].text);
+				m_List.addArg(items[i].x);
+				m_List.addArg(items[i].y);
+				m_List.addArg(items[i].hasColor ? 1.0 : 0.0);
+				m_List.addArg(items[i].color);
+			}
+			setTextBounds(items, count, op == DisplayOp::stroke_text_batch);
+		}
+
+		// device is the transformed point, raw is the point as the shadow masks draw it
+		void addPoint(Extent& device, Extent& raw, double x, double y) const
+		{
+			double dx = 0.0, dy = 0.0;
+			m_Matrix.apply(x, y, dx, dy);
+			device.add(dx, dy);
+			raw.add(x, y);
+		}
+
+		void addRect(Extent& device, Extent& raw, double x, double y, double width, double height) const
+		{
+			addPoint(device, raw, x, y);
+			addPoint(device, raw, x + width, y);
+			addPoint(device, raw, x, y + height);
+			addPoint(device, raw, x + width, y + height);
+		}
+
+		// Half of the widest stroke in user units, including miter joins and square caps
+		double strokeExtent() const
+		{
+			double factor = 1.5;
+			if (lineJoin == LineJoin::miter && miterLimit > factor)
+				factor = miterLimit;
+			return lineWidth / 2.0 * factor;
+		}
+
+		// Size in pixels of the font property, or 10 if it has none
+		static double parseFontSize(const char* value)
+		{
+			for (const char* p = value; *p; ++p)
+			{
+				if (*p < '0' || *p > '9')
+					continue;
+				char* end = nullptr;
+				double size = strtod(p, &end);
+				if (end[0] == 'p' && end[1] == 'x')
+					return size;
+				if (end[0] == 'p' && end[1] == 't')
+					return size * 4.0 / 3.0;
+				p = end - 1;
+			}
+			return 10.0;
+		}
+
+		void setRectBounds(double x, double y, double width, double height, double stroke_extent)
+		{
+			Extent device;
+			Extent raw;
+			addRect(device, raw, x, y, width, height);
+			setBounds(&device, &raw, stroke_extent);
+			// CppCanvas draws the rectangle as the current path
+			m_Path.clear();
+			m_RawPath.clear();
+		}
+
+		void addColors(const unsigned int* colors, size_t count)
+		{
+			if (colors == nullptr)
+				return;
+			for (size_t i = 0; i < count; ++i)
+				m_List.addArg(colors[i] & 0xffffff);
+		}
+
+		void addDrawCanvas(const Canvas& src, const double* args, int count)
+		{
+			m_List.add(DisplayOp::draw_canvas);
+			m_List.addResource(&src);
+			m_List.addArg(count);
+			for (int i = 0; i < count; ++i)
+				m_List.addArg(args[i]);
+		}
+
+		// The bulk commands replace the current path
+		void setItemBounds(const Extent& device, const Extent& raw, double stroke_extent)
+		{
+			setBounds(&device, &raw, stroke_extent);
+			m_Path.clear();
+			m_RawPath.clear();
+		}
+
+		void setPathBounds(double stroke_extent)
+		{
+			setBounds(&m_Path, &m_RawPath, stroke_extent);
+			m_Path.clear();
+			m_RawPath.clear();
+		}
+
+		// Text is not measured, every byte is assumed to be at most 1.5 em wide
+		// and the anchor can be at either end of the line.
+		void setTextBounds(const TextItem* items, size_t count, bool stroke_text)
+		{
+			double size = parseFontSize(font);
+
+			Extent device;
+			Extent raw;
+			for (size_t i = 0; i < count; ++i)
+			{
+				double width = 1.5 * size * strlen(items[i].text);
+				addRect(device, raw, items[i].x - width, items[i].y - 2.0 * size, 2.0 * width, 4.0 * size);
+			}
+			setBounds(&device, &raw, stroke_text ? strokeExtent() : 0.0);
+			if (stroke_text)
+			{
+				m_Path.clear();
+				m_RawPath.clear();
+			}
+		}
+
+		bool isCompositeBounded() const
+		{
+			const char* name = globalCompositeOperation.getName();
+			if (name[0] == '\0')
+			{
+				GlobalCompositeOperationType op = globalCompositeOperation;
+				return op != GlobalCompositeOperationType::source_in && op != GlobalCompositeOperationType::source_out &&
+					op != GlobalCompositeOperationType::destination_in && op != GlobalCompositeOperationType::destination_atop &&
+					op != GlobalCompositeOperationType::copy;
+			}
+			static const char* bounded[] = { "source-over", "source-atop", "destination-over", "destination-out", "lighter", "xor" };
+			for (const char* op : bounded)
+			{
+				if (strcmp(name, op) == 0)
+					return true;
+			}
+			return false;
+		}
+
+		// Sets the bounds of the last command, null extents leave it unbounded
+		void setBounds(const Extent* device, const Extent* raw, double stroke_extent = 0.0)
+		{
+			bool shadow = ((unsigned int)shadowColor != 0 || shadowColor.getName()[0] != '\0');
+			unsigned int blur = shadowBlur;
+			if (shadow && blur > m_MaxShadowBlur)
+				m_MaxShadowBlur = blur;
+
+			if (device == nullptr || !isCompositeBounded())
+				return;
+			if (device->empty)
+			{
+				// nothing is drawn
+				Rect none = { 0.0, 0.0, 0.0, 0.0 };
+				m_List.setBounds(none);
+				return;
+			}
+
+			double pad = stroke_extent * m_Matrix.maxScale() + 1.0;
+			Extent bounds;
+			bounds.add(device->x0 - pad, device->y0 - pad);
+			bounds.add(device->x1 + pad, device->y1 + pad);
+			if (shadow)
+			{
+				// without blur the shadow is drawn with the transform,
+				// with blur the mask is drawn untransformed
+				double offset_x = shadowOffsetX;
+				double offset_y = shadowOffsetY;
+				double dx = m_Matrix.xx * offset_x + m_Matrix.xy * offset_y;
+				double dy = m_Matrix.yx * offset_x + m_Matrix.yy * offset_y;
+				bounds.add(device->x0 - pad + dx, device->y0 - pad + dy);
+				bounds.add(device->x1 + pad + dx, device->y1 + pad + dy);
+
+				double raw_pad = stroke_extent + blur + 1.0;
+				bounds.add(raw->x0 - raw_pad + offset_x, raw->y0 - raw_pad + offset_y);
+				bounds.add(raw->x1 + raw_pad + offset_x, raw->y1 + raw_pad + offset_y);
+			}
+			Rect rc = { bounds.x0, bounds.y0, bounds.x1 - bounds.x0, bounds.y1 - bounds.y0 };
+			m_List.setBounds(rc);
+		}
+
+		DisplayList m_List;
+		int m_Width;
+		int m_Height;
+		DisplayMatrix m_Matrix;
+		std::vector<DisplayState> m_States;
+		Extent m_Path;
+		Extent m_RawPath;
+		unsigned int m_MaxShadowBlur;
+	};
+
+	// Scene made of separately recorded items. Changing an item marks its old
+	// and new bounds as damaged and render() only repaints the damaged area.
+	// Every item is replayed between save() and restore(), with the transform
+	// reset and an empty path, so what it sets does not reach the next items.
+	class RetainedScene
+	{
+	public:
+		RetainedScene(int width, int height)
+			: m_Width(width), m_Height(height), m_Damaged(false)
+			, m_DamageX0(0.0), m_DamageY0(0.0), m_DamageX1(0.0), m_DamageY1(0.0)
+		{
+		}
+
+		size_t size() const
+		{
+			return m_Items.size();
+		}
+
+		// Adds an empty item on top of the others
+		RecordingCanvas& add()
+		{
+			Item item;
+			item.canvas.reset(new RecordingCanvas(m_Width, m_Height));
+			item.dirty = true;
+			m_Items.push_back(std::move(item));
+			return *m_Items.back().canvas;
+		}
+
+		// Clears the item for recording again, the area it covered is damaged
+		RecordingCanvas& update(size_t index)
+		{
+			Item& item = m_Items[index];
+			if (!item.dirty)
+				addDamage(item.canvas->getDisplayList().getBounds());
+			item.canvas->clear();
+			item.dirty = true;
+			return *item.canvas;
+		}
+
+		// Area that the next render() repaints, empty if there is none
+		Rect getDamage()
+		{
+			collectDamage();
+			Rect damage = { 0.0, 0.0, 0.0, 0.0 };
+			if (m_Damaged)
+			{
+				damage.x = m_DamageX0;
+				damage.y = m_DamageY0;
+				damage.width = m_DamageX1 - m_DamageX0;
+				damage.height = m_DamageY1 - m_DamageY0;
+			}
+			return damage;
+		}
+
+		// Repaints the damaged area of canvas, which must hold the previous render
+		void render(Canvas& canvas)
+		{
+			Rect damage = getDamage();
+			m_Damaged = false;
+			if (damage.width <= 0.0 || damage.height <= 0.0)
+				return;
+
+			canvas.clearRect(damage.x, damage.y, damage.width, damage.height);
+			canvas.save();
+			canvas.setTransform(1.0, 0.0, 0.0, 1.0, 0.0, 0.0);
+			canvas.beginPath();
+			canvas.rect(damage.x, damage.y, damage.width, damage.height);
+			canvas.clip();
+			for (const Item& item : m_Items)
+			{
+				canvas.save();
+				canvas.beginPath();
+				item.canvas->getDisplayList().replay(canvas, damage);
+				canvas.restore();
+			}
+			canvas.beginPath();
+			canvas.restore();
+		}
+
+	private:
+		// remove copy constructor and assignment operator
+		RetainedScene(const RetainedScene& other) = delete;
+		void operator=(const RetainedScene& other) = delete;
+
+		struct Item
+		{
+			std::unique_ptr<RecordingCanvas> canvas;
+			bool dirty;
+		};
+
+		void collectDamage()
+		{
+			for (Item& item : m_Items)
+			{
+				if (item.dirty)
+				{
+					addDamage(item.canvas->getDisplayList().getBounds());
+					item.dirty = false;
+				}
+			}
+		}
+
+		// Snaps to whole pixels and clamps to the scene
+		void addDamage(const Rect& bounds)
+		{
+			if (bounds.width <= 0.0 || bounds.height <= 0.0)
+				return;
+
+			double x0 = std::max(floor(bounds.x), 0.0);
+			double y0 = std::max(floor(bounds.y), 0.0);
+			double x1 = std::min(ceil(bounds.x + bounds.width), (double)m_Width);
+			double y1 = std::min(ceil(bounds.y + bounds.height), (double)m_Height);
+			if (x0 >= x1 || y0 >= y1)
+				return;
+
+			if (!m_Damaged)
+			{
+				m_DamageX0 = x0;
+				m_DamageY0 = y0;
+				m_DamageX1 = x1;
+				m_DamageY1 = y1;
+				m_Damaged = true;
+				return;
+			}
+			m_DamageX0 = std::min(m_DamageX0, x0);
+			m_DamageY0 = std::min(m_DamageY0, y0);
+			m_DamageX1 = std::max(m_DamageX1, x1);
+			m_DamageY1 = std::max(m_DamageY1, y1);
+		}
+
+		std::vector<Item> m_Items;
+		int m_Width;
+		int m_Height;
+		bool m_Damaged;
+		double m_DamageX0;
+		double m_DamageY0;
+		double m_DamageX1;
+		double m_DamageY1;
+	};
+}
@@ -0,0 +1,184 @@
+// Copyright 2019 Shao Voon Wong
+// No warranties expressed or implied
+// use it at your risk!
+
+#pragma once
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+
+namespace canvas
+{
+	// Fixed set of workers, each with its own queue of jobs. A worker takes
+	// from the back of its queue and steals from the front of the others when
+	// it runs dry, so uneven jobs such as busy and empty tiles balance out.
+	class ThreadPool
+	{
+	public:
+		explicit ThreadPool(unsigned int threads = std::thread::hardware_concurrency())
+			: m_Task(nullptr), m_Pending(0), m_Generation(0), m_Stop(false)
+		{
+			if (threads == 0)
+				threads = 1;
+
+			for (unsigned int i = 0; i < threads; ++i)
+				m_Queues.push_back(std::unique_ptr<JobQueue>(new JobQueue()));
+
+			// the calling thread works on queue 0
+			for (unsigned int i = 1; i < threads; ++i)
+				m_Threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+		}
+
+		~ThreadPool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				m_Stop = true;
+			}
+			m_WorkReady.notify_all();
+			for (auto& thread : m_Threads)
+				thread.join();
+		}
+
+		unsigned int size() const
+		{
+			return (unsigned int)m_Queues.size();
+		}
+
+		// Runs task(i) for every i in [0, count) and returns when all are done.
+		// Consecutive jobs go to the same worker to keep neighbouring tiles together.
+		// Called from inside a job of any pool, the jobs run one after another on
+		// the calling thread, as the workers may all be busy waiting on it.
+		void parallelFor(size_t count, const std::function<void(size_t)>& task)
+		{
+			if (count == 0)
+				return;
+
+			if (insideJob())
+			{
+				for (size_t i = 0; i < count; ++i)
+					task(i);
+				return;
+			}
+
+			std::lock_guard<std::mutex> run_lock(m_RunMutex);
+			{
+				// set before the jobs are queued, a worker may still be looking for jobs
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				m_Task = &task;
+				m_Pending = count;
+				++m_Generation;
+			}
+			size_t workers = m_Queues.size();
+			for (size_t w = 0; w < workers; ++w)
+			{
+				std::lock_guard<std::mutex> lock(m_Queues[w]->mutex);
+				for (size_t i = count * w / workers; i < count * (w + 1) / workers; ++i)
+					m_Queues[w]->jobs.push_back(i);
+			}
+			m_WorkReady.notify_all();
+
+			runJobs(0);
+
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_WorkDone.wait(lock, [this]() { return m_Pending == 0; });
+			m_Task = nullptr;
+		}
+
+	private:
+		// remove copy constructor and assignment operator
+		ThreadPool(const ThreadPool& other) = delete;
+		void operator=(const ThreadPool& other) = delete;
+
+		struct JobQueue
+		{
+			std::mutex mutex;
+			std::deque<size_t> jobs;
+		};
+
+		// Whether the thread is running a job, of this pool or another
+		static bool& insideJob()
+		{
+			thread_local bool inside = false;
+			return inside;
+		}
+
+		bool popJob(size_t worker, size_t& job)
+		{
+			{
+				JobQueue& own = *m_Queues[worker];
+				std::lock_guard<std::mutex> lock(own.mutex);
+				if (!own.jobs.empty())
+				{
+					job = own.jobs.back();
+					own.jobs.pop_back();
+					return true;
+				}
+			}
+			for (size_t i = 1; i < m_Queues.size(); ++i)
+			{
+				JobQueue& victim = *m_Queues[(worker + i) % m_Queues.size()];
+				std::lock_guard<std::mutex> lock(victim.mutex);
+				if (!victim.jobs.empty())
+				{
+					job = victim.jobs.front();
+					victim.jobs.pop_front();
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void runJobs(size_t worker)
+		{
+			size_t job = 0;
+			while (popJob(worker, job))
+			{
+				// a queued job keeps m_Pending above zero, so m_Task is its task
+				const std::function<void(size_t)>* task = nullptr;
+				{
+					std::lock_guard<std::mutex> lock(m_Mutex);
+					task = m_Task;
+				}
+				insideJob() = true;
+				(*task)(job);
+				insideJob() = false;
+
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				if (--m_Pending == 0)
+					m_WorkDone.notify_all();
+			}
+		}
+
+		void workerLoop(size_t worker)
+		{
+			unsigned int generation = 0;
+			while (true)
+			{
+				{
+					std::unique_lock<std::mutex> lock(m_Mutex);
+					m_WorkReady.wait(lock, [&]() { return m_Stop || m_Generation != generation; });
+					if (m_Stop)
+						return;
+					generation = m_Generation;
+				}
+				runJobs(worker);
+			}
+		}
+
+		std::vector<std::unique_ptr<JobQueue> > m_Queues;
+		std::vector<std::thread> m_Threads;
+		std::mutex m_RunMutex;
+		std::mutex m_Mutex;
+		std::condition_variable m_WorkReady;
+		std::condition_variable m_WorkDone;
+		const std::function<void(size_t)>* m_Task;
+		size_t m_Pending;
+		unsigned int m_Generation;
+		bool m_Stop;
+	};
+}
@@ -0,0 +1,103 @@
+// Copyright 2019 Shao Voon Wong
+// No warranties expressed or implied
+// use it at your risk!
+
+#pragma once
+#include "CppCanvas.h"
+#include "RecordingCanvas.h"
+#include "ThreadPool.h"
+#include <algorithm>
+
+namespace canvas
+{
+	// Replays a recorded scene on tiles of the target in parallel. Every tile is
+	// rendered on its own Canvas, grown by the largest shadow blur so that blurred
+	// shadows crossing the tile edges come out the same as on a single Canvas,
+	// and only its interior is copied back. The scene is replayed from the
+	// default state, as on a new Canvas.
+	//
+	// The tiles share the resources recorded in the scene. Gradients, patterns
+	// and images are only read, and cairo counts their references atomically.
+	// A Path2D builds its cairo path per scale on first use under its own lock.
+	// The scene must not change while it renders. A pool recorded with
+	// drawHeatmap is not used inside the tiles, which are already pool jobs.
+	class TileRenderer
+	{
+	public:
+		TileRenderer(ThreadPool& pool, int tile_size = 256)
+			: m_Pool(pool), m_TileSize(tile_size) {}
+
+		void render(const RecordingCanvas& scene, Canvas& target)
+		{
+			cairo_surface_t* target_surface = target.getSurface();
+			int width = cairo_image_surface_get_width(target_surface);
+			int height = cairo_image_surface_get_height(target_surface);
+			int cols = (width + m_TileSize - 1) / m_TileSize;
+			int rows = (height + m_TileSize - 1) / m_TileSize;
+
+			// the box blur spreads one pixel per pass, plus one for antialiasing
+			int margin = (int)scene.getMaxShadowBlur() + 1;
+
+			cairo_surface_flush(target_surface);
+			m_Pool.parallelFor((size_t)(cols * rows), [&](size_t index)
+			{
+				int x0 = (int)(index % cols) * m_TileSize;
+				int y0 = (int)(index / cols) * m_TileSize;
+				int x1 = std::min(x0 + m_TileSize, width);
+				int y1 = std::min(y0 + m_TileSize, height);
+				renderTile(scene, target_surface, x0, y0, x1, y1, margin);
+			});
+			cairo_surface_mark_dirty(target_surface);
+		}
+
+	private:
+		// remove copy constructor and assignment operator
+		TileRenderer(const TileRenderer& other) = delete;
+		void operator=(const TileRenderer& other) = delete;
+
+		void renderTile(const RecordingCanvas& scene, cairo_surface_t* target_surface,
+			int x0, int y0, int x1, int y1, int margin)
+		{
+			int width = cairo_image_surface_get_width(target_surface);
+			int height = cairo_image_surface_get_height(target_surface);
+			int left = std::max(x0 - margin, 0);
+			int top = std::max(y0 - margin, 0);
+			int right = std::min(x1 + margin, width);
+			int bottom = std::min(y1 + margin, height);
+
+			Canvas tile("tile", right - left, bottom - top);
+			tile.setOrigin(left, top);
+			cairo_surface_t* tile_surface = tile.getSurface();
+
+			// compositing reads the destination, so start from the target pixels.
+			// The margin only has to hold the shapes that cast shadows into the tile.
+			copyPixels(target_surface, x0, y0, tile_surface, x0 - left, y0 - top, x1 - x0, y1 - y0);
+			cairo_surface_mark_dirty(tile_surface);
+
+			Rect cull = { (double)left, (double)top, (double)(right - left), (double)(bottom - top) };
+			scene.getDisplayList().replay(tile, cull);
+
+			// the target is marked dirty once all the tiles are copied
+			cairo_surface_flush(tile_surface);
+			copyPixels(tile_surface, x0 - left, y0 - top, target_surface, x0, y0, x1 - x0, y1 - y0);
+		}
+
+		static void copyPixels(cairo_surface_t* src, int src_x, int src_y,
+			cairo_surface_t* dest, int dest_x, int dest_y, int width, int height)
+		{
+			const unsigned char* src_data = cairo_image_surface_get_data(src);
+			int src_stride = cairo_image_surface_get_stride(src);
+			unsigned char* dest_data = cairo_image_surface_get_data(dest);
+			int dest_stride = cairo_image_surface_get_stride(dest);
+			for (int y = 0; y < height; ++y)
+			{
+				memcpy(dest_data + (dest_y + y) * dest_stride + dest_x * 4,
+					src_data + (src_y + y) * src_stride + src_x * 4,
+					width * 4);
+			}
+		}
+
+		ThreadPool& m_Pool;
+		int m_TileSize;
+	};
+}
@@ -0,0 +1,12 @@
+﻿// Runs cpp.js in a worker on the canvases that worker.html transferred to it.
+// The module is loaded after the canvases arrive, so that main() finds them.
+// Animations run on the requestAnimationFrame of the worker, as animateFrames()
+// in CanvasExample.cpp does. The command buffer runs when each callback ends,
+// at the latest, and the OffscreenCanvas presents the frame in the same browser
+// frame. img elements do not exist here, images are loaded from urls.
+onmessage = function (e) {
+    onmessage = null;
+    importScripts("jscanvas.js");
+    receive_canvases(e.data);
+    importScripts("preamble.js", "cpp.js");
+};
@@ -1,56 +1,440 @@
-﻿var canvas_dict = {};
-var gradient_dict = {};
-var pattern_dict = {};
-var imgdata_dict = {};
+﻿// The canvas contexts, gradients, patterns and paths live in
+// slots and C++ holds the index of the slot as an integer handle, so a call
+// costs an array load instead of a string decode and a dictionary lookup.
+// Slot 0 is never used, a handle of 0 means none.
+var slots = [null];
+var free_slots = [];
+
+function add_slot(obj) {
+    var handle = (free_slots.length > 0) ? free_slots.pop() : slots.length;
+    slots[handle] = obj;
+    return handle;
+}
+
+function remove_slot(handle) {
+    slots[handle] = null;
+    free_slots.push(handle);
+}
+
+// Worker mode: the page hands its canvas elements to the worker running the
+// module with transfer_canvases(), and the worker passes the message to
+// receive_canvases() before it loads the module. There is no document in the
+// worker, so add_canvas finds the OffscreenCanvas by the id of its element
+// and new canvases are OffscreenCanvas too.
+var offscreen_canvases = {};
+
+function transfer_canvases(worker, names) {
+    var canvases = [];
+    for (var i = 0; i < names.length; ++i)
+        canvases.push(document.getElementById(names[i]).transferControlToOffscreen());
+    worker.postMessage({ names: names, canvases: canvases }, canvases);
+}
+
+function receive_canvases(message) {
+    for (var i = 0; i < message.names.length; ++i)
+        offscreen_canvases[message.names[i]] = message.canvases[i];
+}
+
+function find_canvas(name) {
+    if (typeof document === 'undefined')
+        return offscreen_canvases[name];
+    return document.getElementById(name);
+}
+
+function create_canvas(width, height) {
+    if (typeof document === 'undefined')
+        return new OffscreenCanvas(width, height);
+    var canvas = document.createElement("canvas");
+    canvas.width = width;
+    canvas.height = height;
+    return canvas;
+}
 
 function add_canvas(name)
 {
-    var theCanvas = document.getElementById(name);
+    var theCanvas = find_canvas(name);
     var context = theCanvas.getContext("2d");
+    reset_state(context);
 
-    canvas_dict[name] = context;
+    var handle = add_slot(context);
+    named_canvases[name] = handle;
+    return handle;
 }
 
-function remove_canvas(name) {
-    delete canvas_dict[name];
-}
+// Modules built before the handles, such as the checked-in cpp.js, still pass
+// the names of the canvases and gradients. These keep them working until they
+// are rebuilt; get_canvas and get_gradient take a name as well as a handle.
+var named_canvases = {};
+var named_gradients = {};
 
-function get_canvas(name) {
-    return canvas_dict[name];
+function remove_canvas(name) {
+    remove_slot(named_canvases[name]);
+    delete named_canvases[name];
 }
 
 function add_gradient(name, grad) {
-    gradient_dict[name] = grad;
+    named_gradients[name] = add_slot(grad);
 }
 
 function remove_gradient(name) {
-    delete gradient_dict[name];
+    remove_slot(named_gradients[name]);
+    delete named_gradients[name];
+}
+
+// The C++ side mirrors the drawing state and starts from the defaults of a new
+// context, so an element used before gets them back.
+function reset_state(ctx) {
+    ctx.lineWidth = 1;
+    ctx.miterLimit = 10;
+    ctx.shadowOffsetX = 0;
+    ctx.shadowOffsetY = 0;
+    ctx.shadowBlur = 0;
+    ctx.lineCap = "butt";
+    ctx.lineJoin = "miter";
+    ctx.textAlign = "start";
+    ctx.textBaseline = "alphabetic";
+    ctx.font = "10px sans-serif";
+    ctx.shadowColor = "rgba(0, 0, 0, 0)";
+    ctx.globalCompositeOperation = "source-over";
+    ctx.fillStyle = "#000000";
+    ctx.strokeStyle = "#000000";
 }
 
-function get_gradient(name) {
-    return gradient_dict[name];
+function get_canvas(handle) {
+    if (typeof handle === "string")
+        handle = named_canvases[handle];
+    return slots[handle];
 }
 
-function add_pattern(name, pat) {
-    pattern_dict[name] = pat;
+// Keeps the img element with the id name, or a new one loading the url name, in
+// a slot until the browser has decoded it into an ImageBitmap, which then takes
+// its place. The check of the slot skips a bitmap of an image already released.
+function add_image(name) {
+    if (typeof document === 'undefined')
+        return add_image_url(name);
+
+    var image = document.getElementById(name);
+    if (image == null) {
+        image = new Image();
+        image.src = name;
+    }
+    var handle = add_slot(image);
+    if (typeof createImageBitmap === 'undefined')
+        return handle;
+
+    var decode = function () {
+        createImageBitmap(image).then(function (bitmap) {
+            if (slots[handle] === image)
+                slots[handle] = bitmap;
+        });
+    };
+    if (image.complete && image.naturalWidth > 0)
+        decode();
+    else
+        image.addEventListener("load", decode);
+    return handle;
+}
+
+// In a worker, which has neither elements nor Image, the url is fetched and the
+// slot holds a placeholder that is not drawn until the bitmap replaces it
+function add_image_url(url) {
+    var placeholder = { complete: false, naturalWidth: 0 };
+    var handle = add_slot(placeholder);
+    fetch(url).then(function (response) {
+        return response.blob();
+    }).then(function (blob) {
+        return createImageBitmap(blob);
+    }).then(function (bitmap) {
+        if (slots[handle] === placeholder)
+            slots[handle] = bitmap;
+    });
+    return handle;
 }
 
-function remove_pattern(name) {
-    delete pattern_dict[name];
+// pixels points to width * height RGBA pixels in the heap
+function add_image_data(pixels, width, height) {
+    var canvas = create_canvas(width, height);
+    var data = new Uint8ClampedArray(HEAPU8.buffer, pixels, width * height * 4);
+    canvas.getContext("2d").putImageData(new ImageData(data, width, height), 0, 0);
+    var handle = add_slot(canvas);
+    if (typeof createImageBitmap === 'undefined')
+        return handle;
+
+    createImageBitmap(canvas).then(function (bitmap) {
+        if (slots[handle] === canvas)
+            slots[handle] = bitmap;
+    });
+    return handle;
 }
 
-function get_pattern(name) {
-    return pattern_dict[name];
+// drawImage throws on an img element that has not loaded, which would stop run_commands
+function image_ready(image) {
+    if (image == null)
+        return false;
+    return image.complete === undefined || (image.complete && image.naturalWidth > 0);
 }
 
-function add_imgdata(name, imgdata) {
-    imgdata_dict[name] = imgdata;
+// off-screen canvas elements of destroyed layers, reused by size
+var layer_pool = [];
+
+function acquire_layer(width, height) {
+    var canvas = null;
+    for (var i = 0; i < layer_pool.length; ++i) {
+        if (layer_pool[i].width == width && layer_pool[i].height == height) {
+            canvas = layer_pool.splice(i, 1)[0];
+            break;
+        }
+    }
+    if (canvas == null) {
+        canvas = create_canvas(width, height);
+    }
+    else {
+        // setting the size clears the canvas and resets the context state
+        canvas.width = width;
+    }
+    return add_slot(canvas.getContext("2d"));
 }
 
-function remove_imgdata(name) {
-    delete imgdata_dict[name];
+function release_layer(handle) {
+    var context = slots[handle];
+    remove_slot(handle);
+    if (layer_pool.length >= 8)
+        layer_pool.shift();
+    layer_pool.push(context.canvas);
 }
 
-function get_imgdata(name) {
-    return imgdata_dict[name];
+function get_gradient(handle) {
+    if (typeof handle === "string")
+        handle = named_gradients[handle];
+    return slots[handle];
+}
+
+function get_pattern(handle) {
+    return slots[handle];
+}
+
+function get_path(handle) {
+    return slots[handle];
+}
+
+// Runs the command buffer of JsCanvas.h: count doubles at args, each command
+// an opcode and its arguments, strings as offsets into text. The opcodes are
+// in the order of JsOp.
+function run_commands(args, count, text) {
+    var f = HEAPF64;
+    var i = args >> 3;
+    var end = i + count;
+    var ctx = null;
+    while (i < end) {
+        switch (f[i++]) {
+            case 0: ctx.lineWidth = f[i++]; break;
+            case 1: ctx.miterLimit = f[i++]; break;
+            case 2: ctx.shadowOffsetX = f[i++]; break;
+            case 3: ctx.shadowOffsetY = f[i++]; break;
+            case 4: ctx.shadowBlur = f[i++]; break;
+            case 5: ctx.font = UTF8ToString(text + f[i++]); break;
+            case 6: ctx.lineCap = UTF8ToString(text + f[i++]); break;
+            case 7: ctx.lineJoin = UTF8ToString(text + f[i++]); break;
+            case 8: ctx.textAlign = UTF8ToString(text + f[i++]); break;
+            case 9: ctx.textBaseline = UTF8ToString(text + f[i++]); break;
+            case 10: ctx.shadowColor = UTF8ToString(text + f[i++]); break;
+            case 11: ctx.globalCompositeOperation = UTF8ToString(text + f[i++]); break;
+            case 12: ctx.fillStyle = UTF8ToString(text + f[i++]); break;
+            case 13: ctx.strokeStyle = UTF8ToString(text + f[i++]); break;
+            case 14: ctx.fillStyle = slots[f[i++]]; break;
+            case 15: ctx.strokeStyle = slots[f[i++]]; break;
+            case 16: ctx = slots[f[i++]]; break;
+            case 17: remove_slot(f[i++]); break;
+            case 18: release_layer(f[i++]); break;
+            case 19: slots[f[i]].addColorStop(f[i + 1], UTF8ToString(text + f[i + 2])); i += 3; break;
+            case 20: slots[f[i]].moveTo(f[i + 1], f[i + 2]); i += 3; break;
+            case 21: slots[f[i]].lineTo(f[i + 1], f[i + 2]); i += 3; break;
+            case 22: slots[f[i]].bezierCurveTo(f[i + 1], f[i + 2], f[i + 3], f[i + 4], f[i + 5], f[i + 6]); i += 7; break;
+            case 23: slots[f[i]].quadraticCurveTo(f[i + 1], f[i + 2], f[i + 3], f[i + 4]); i += 5; break;
+            case 24: slots[f[i]].arc(f[i + 1], f[i + 2], f[i + 3], f[i + 4], f[i + 5]); i += 6; break;
+            case 25: slots[f[i]].rect(f[i + 1], f[i + 2], f[i + 3], f[i + 4]); i += 5; break;
+            case 26: slots[f[i++]].closePath(); break;
+            case 27: ctx.fillRect(f[i], f[i + 1], f[i + 2], f[i + 3]); i += 4; break;
+            case 28: ctx.clearRect(f[i], f[i + 1], f[i + 2], f[i + 3]); i += 4; break;
+            case 29: ctx.strokeRect(f[i], f[i + 1], f[i + 2], f[i + 3]); i += 4; break;
+            case 30: ctx.fillText(UTF8ToString(text + f[i]), f[i + 1], f[i + 2]); i += 3; break;
+            case 31: ctx.strokeText(UTF8ToString(text + f[i]), f[i + 1], f[i + 2]); i += 3; break;
+            case 32: ctx.rect(f[i], f[i + 1], f[i + 2], f[i + 3]); i += 4; break;
+            case 33: ctx.beginPath(); break;
+            case 34: ctx.closePath(); break;
+            case 35: ctx.moveTo(f[i], f[i + 1]); i += 2; break;
+            case 36: ctx.lineTo(f[i], f[i + 1]); i += 2; break;
+            case 37: ctx.bezierCurveTo(f[i], f[i + 1], f[i + 2], f[i + 3], f[i + 4], f[i + 5]); i += 6; break;
+            case 38: ctx.quadraticCurveTo(f[i], f[i + 1], f[i + 2], f[i + 3]); i += 4; break;
+            case 39: ctx.arc(f[i], f[i + 1], f[i + 2], f[i + 3], f[i + 4]); i += 5; break;
+            case 40: ctx.clip(); break;
+            case 41: ctx.clip(slots[f[i++]]); break;
+            case 42: ctx.stroke(); break;
+            case 43: ctx.stroke(slots[f[i++]]); break;
+            case 44: ctx.fill(); break;
+            case 45: ctx.fill(slots[f[i++]]); break;
+            case 46: ctx.scale(f[i], f[i + 1]); i += 2; break;
+            case 47: ctx.translate(f[i], f[i + 1]); i += 2; break;
+            case 48: ctx.rotate(f[i++]); break;
+            case 49: ctx.transform(f[i], f[i + 1], f[i + 2], f[i + 3], f[i + 4], f[i + 5]); i += 6; break;
+            case 50: ctx.setTransform(f[i], f[i + 1], f[i + 2], f[i + 3], f[i + 4], f[i + 5]); i += 6; break;
+            case 51: {
+                // image slot, argument count and the arguments of the drawImage overload
+                var image = slots[f[i]];
+                var n = f[i + 1];
+                i += 2;
+                if (image_ready(image)) {
+                    if (n == 2)
+                        ctx.drawImage(image, f[i], f[i + 1]);
+                    else
+                        ctx.drawImage(image, f[i], f[i + 1], f[i + 2], f[i + 3]);
+                }
+                i += n;
+                break;
+            }
+            case 52: {
+                // source, argument count and the arguments of the drawImage overload
+                var src = slots[f[i]].canvas;
+                var n = f[i + 1];
+                i += 2;
+                if (n == 2)
+                    ctx.drawImage(src, f[i], f[i + 1]);
+                else if (n == 4)
+                    ctx.drawImage(src, f[i], f[i + 1], f[i + 2], f[i + 3]);
+                else
+                    ctx.drawImage(src, f[i], f[i + 1], f[i + 2], f[i + 3], f[i + 4], f[i + 5], f[i + 6], f[i + 7]);
+                i += n;
+                break;
+            }
+            case 53: ctx.save(); break;
+            case 54: ctx.restore(); break;
+        }
+    }
+}
+
+// items is a pointer to 5 doubles per item: text pointer, x, y, has color, color
+function draw_text_batch(ctx, items, count, stroke) {
+    var style = stroke ? ctx.strokeStyle : ctx.fillStyle;
+    var index = items >> 3;
+    for (var i = 0; i < count; ++i, index += 5) {
+        var color = style;
+        if (HEAPF64[index + 3] != 0)
+            color = "#" + ("000000" + HEAPF64[index + 4].toString(16)).slice(-6);
+
+        var text = UTF8ToString(HEAPF64[index]);
+        if (stroke) {
+            ctx.strokeStyle = color;
+            ctx.strokeText(text, HEAPF64[index + 1], HEAPF64[index + 2]);
+        }
+        else {
+            ctx.fillStyle = color;
+            ctx.fillText(text, HEAPF64[index + 1], HEAPF64[index + 2]);
+        }
+    }
+    if (stroke)
+        ctx.strokeStyle = style;
+    else
+        ctx.fillStyle = style;
+}
+
+// Adds the items of every color to the path with add_item(index) and fills or
+// strokes them once per color. colors points to one 0xRRGGBB per item, or is 0
+// to use the current style.
+function draw_grouped(ctx, count, colors, stroke, add_item) {
+    var style = stroke ? ctx.strokeStyle : ctx.fillStyle;
+    var groups = new Map();
+    for (var i = 0; i < count; ++i) {
+        var color = (colors == 0) ? -1 : HEAPU32[(colors >> 2) + i] & 0xffffff;
+        var group = groups.get(color);
+        if (group === undefined) {
+            group = [];
+            groups.set(color, group);
+        }
+        group.push(i);
+    }
+    groups.forEach(function (group, color) {
+        var group_style = (color < 0) ? style : "#" + ("000000" + color.toString(16)).slice(-6);
+        ctx.beginPath();
+        for (var j = 0; j < group.length; ++j)
+            add_item(group[j]);
+        if (stroke) {
+            ctx.strokeStyle = group_style;
+            ctx.stroke();
+        }
+        else {
+            ctx.fillStyle = group_style;
+            ctx.fill();
+        }
+    });
+    if (stroke)
+        ctx.strokeStyle = style;
+    else
+        ctx.fillStyle = style;
+}
+
+// rects is a pointer to 4 doubles per item: x, y, width, height
+function fill_rects(ctx, rects, count, colors) {
+    var base = rects >> 3;
+    draw_grouped(ctx, count, colors, false, function (i) {
+        var index = base + i * 4;
+        ctx.rect(HEAPF64[index], HEAPF64[index + 1], HEAPF64[index + 2], HEAPF64[index + 3]);
+    });
+}
+
+// lines is a pointer to 4 doubles per item: x0, y0, x1, y1
+function stroke_segments(ctx, lines, count, colors) {
+    var base = lines >> 3;
+    draw_grouped(ctx, count, colors, true, function (i) {
+        var index = base + i * 4;
+        ctx.moveTo(HEAPF64[index], HEAPF64[index + 1]);
+        ctx.lineTo(HEAPF64[index + 2], HEAPF64[index + 3]);
+    });
+}
+
+// points is a pointer to 2 doubles per item: x, y
+function draw_points(ctx, points, count, radius, square, colors) {
+    var base = points >> 3;
+    draw_grouped(ctx, count, colors, false, function (i) {
+        var index = base + i * 2;
+        var x = HEAPF64[index];
+        var y = HEAPF64[index + 1];
+        if (square) {
+            ctx.rect(x - radius, y - radius, 2 * radius, 2 * radius);
+        }
+        else {
+            ctx.moveTo(x + radius, y);
+            ctx.arc(x, y, radius, 0, 2 * Math.PI);
+        }
+    });
+}
+
+// points is a pointer to 2 doubles per point: x, y
+function stroke_polyline(ctx, points, count) {
+    var index = points >> 3;
+    ctx.beginPath();
+    for (var i = 0; i < count; ++i, index += 2) {
+        if (i == 0)
+            ctx.moveTo(HEAPF64[index], HEAPF64[index + 1]);
+        else
+            ctx.lineTo(HEAPF64[index], HEAPF64[index + 1]);
+    }
+    if (count > 0)
+        ctx.stroke();
+}
+
+var heatmap_canvas = null;
+
+// pixels is a pointer to cols * rows RGBA bytes
+function draw_heatmap(ctx, pixels, cols, rows, x, y, width, height, bilinear) {
+    if (heatmap_canvas == null)
+        heatmap_canvas = create_canvas(cols, rows);
+    heatmap_canvas.width = cols;
+    heatmap_canvas.height = rows;
+    var data = new Uint8ClampedArray(HEAPU8.buffer, pixels, cols * rows * 4).slice();
+    heatmap_canvas.getContext("2d").putImageData(new ImageData(data, cols, rows), 0, 0);
+
+    ctx.save();
+    ctx.imageSmoothingEnabled = (bilinear != 0);
+    ctx.drawImage(heatmap_canvas, x, y, width, height);
+    ctx.restore();
 }
\ No newline at end of file
@@ -0,0 +1,53 @@
+// Runs an Emscripten build of CanvasExample.cpp under Node, with jscanvas.js
+// and a document whose canvases have the call-counting mock context, and
+// prints what the module prints and the context calls per frame. Build
+// CanvasExample.cpp with benchmarkFrames() enabled in main() twice: with
+// JsCanvas (em++ -O3 -sALLOW_MEMORY_GROWTH=1 CanvasExample.cpp -o bench_js.js)
+// and with the software renderer (the em++ command next to present() in
+// CppCanvas.h, -o bench_cairo.js). Then
+//
+//     node test/benchmark.js bench_js.js
+//     node test/benchmark.js bench_cairo.js
+//
+// JsCanvas makes a context call per draw call, the software renderer one
+// putImageData per frame.
+var path = require("path");
+var mock = require("./mock_context.js");
+
+var file = path.resolve(process.argv[2] || "");
+var frames = 60;
+var counts = {};
+var contexts = {};
+global.document = {
+    getElementById: function (name) {
+        if (!(name in contexts))
+            contexts[name] = mock.createCountingContext(counts, 1280, 720);
+        return { getContext: function () { return contexts[name]; } };
+    }
+};
+global.ImageData = function (data, width, height) {
+    this.data = data;
+    this.width = width;
+    this.height = height;
+};
+mock.loadScript(path.join(__dirname, "..", "jscanvas.js"));
+
+// the module runs in the global scope like a script tag, so that jscanvas.js
+// sees its HEAPF64, HEAPU8 and UTF8ToString
+global.require = require;
+global.__dirname = path.dirname(file);
+global.__filename = file;
+global.Module = {
+    print: function (text) { console.log(text); },
+    printErr: function (text) { console.error(text); }
+};
+
+process.on("exit", function () {
+    var total = 0;
+    for (var key in counts)
+        total += counts[key];
+    var top = Object.keys(counts).sort(function (a, b) { return counts[b] - counts[a]; }).slice(0, 5);
+    console.log("context calls per frame: " + Math.round(total / frames) + " (" +
+        top.map(function (key) { return key + " " + Math.round(counts[key] / frames); }).join(", ") + ")");
+});
+mock.loadScript(file);
@@ -0,0 +1,76 @@
+// Runs a command buffer encoded as CommandBuffer in JsCanvas.h encodes it
+// through run_commands of jscanvas.js, with a mock 2D context that records
+// every call, and checks that each command makes exactly its context call.
+// The opcodes are read from the JsOp enum, so a reordered enum or switch fails.
+//
+//     node test/command_buffer.js [segments]
+var fs = require("fs");
+var path = require("path");
+var mock = require("./mock_context.js");
+
+var dir = path.join(__dirname, "..");
+var op = mock.loadOpcodes();
+mock.createHeap(1 << 24);
+var calls = [];
+global.document = {
+    getElementById: function (name) {
+        return { getContext: function () { return mock.createContext(calls, 800, 600); } };
+    }
+};
+mock.loadScript(path.join(dir, "jscanvas.js"));
+
+var cases = /function run_commands[\s\S]*?\n}/.exec(fs.readFileSync(path.join(dir, "jscanvas.js"), "utf8"))[0].match(/case \d+:/g).length;
+if (cases != Object.keys(op).length) {
+    console.log("run_commands has " + cases + " cases for " + Object.keys(op).length + " opcodes");
+    process.exit(1);
+}
+
+var canvas = add_canvas("canvas");
+calls.length = 0;
+
+var args = [];
+var text = "";
+var textBase = 1 << 23;
+function push(name) {
+    args.push(op[name]);
+    for (var i = 1; i < arguments.length; ++i)
+        args.push(arguments[i]);
+}
+function str(value) {
+    var offset = text.length;
+    text += value + "\0";
+    return offset;
+}
+
+var segments = parseInt(process.argv[2] || "10000", 10);
+push("select", canvas);
+push("line_width", 2);
+push("stroke_style", str("#ff0000"));
+push("begin_path");
+push("move_to", 0, 0);
+for (var i = 0; i < segments; ++i)
+    push("line_to", i % 800, (i * 7) % 600);
+push("stroke");
+push("fill_style", str("blue"));
+push("fill_rect", 0, 0, 10, 10);
+push("fill_text", str("done"), 20, 20);
+
+HEAPF64.set(args, 0);
+for (var i = 0; i < text.length; ++i)
+    HEAPU8[textBase + i] = text.charCodeAt(i);
+
+var start = process.hrtime();
+run_commands(0, args.length, textBase);
+var time = process.hrtime(start);
+
+var expected = ["lineWidth = 2", "strokeStyle = #ff0000", "beginPath()", "moveTo(0, 0)"];
+for (var i = 0; i < segments; ++i)
+    expected.push("lineTo(" + (i % 800) + ", " + ((i * 7) % 600) + ")");
+expected.push("stroke()", "fillStyle = blue", "fillRect(0, 0, 10, 10)", "fillText(done, 20, 20)");
+var failed = calls.length != expected.length;
+for (var i = 0; !failed && i < expected.length; ++i)
+    failed = calls[i] != expected[i];
+if (failed)
+    process.exitCode = 1;
+console.log(calls.length + " calls from " + args.length + " doubles in one run_commands, " +
+    (time[0] * 1e3 + time[1] / 1e6).toFixed(2) + " ms" + (failed ? ", FAILED" : ", ok"));
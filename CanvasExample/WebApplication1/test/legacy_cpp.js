@@ -0,0 +1,29 @@
+// Runs the checked-in cpp.js under Node against jscanvas.js, with a mock 2D
+// context that records every call, to check that a module built before the
+// integer handles still draws through the name-based functions.
+//
+//     node test/legacy_cpp.js
+var fs = require("fs");
+var path = require("path");
+var mock = require("./mock_context.js");
+
+var dir = path.join(__dirname, "..");
+var calls = [];
+global.document = {
+    getElementById: function (name) {
+        return { getContext: function () { return mock.createContext(calls, 320, 280); } };
+    }
+};
+mock.loadScript(path.join(dir, "jscanvas.js"));
+
+process.on("exit", function (code) {
+    var expected = ["fillText(Hello World!, 10, 50)", "createLinearGradient(0, 0, 320, 0)", "fillText(Big smile!, 10, 90)"];
+    for (var i = 0; i < expected.length; ++i) {
+        if (calls.indexOf(expected[i]) < 0) {
+            console.log("missing: " + expected[i]);
+            process.exitCode = 1;
+        }
+    }
+    console.log(calls.length + " calls" + (process.exitCode ? ", FAILED" : ", ok"));
+});
+require(path.join(dir, "cpp.js"));
@@ -0,0 +1,80 @@
+// Helpers shared by the Node checks of jscanvas.js
+var fs = require("fs");
+var path = require("path");
+var vm = require("vm");
+
+// Runs a browser script in the global scope, as a script tag would
+function loadScript(file) {
+    vm.runInThisContext(fs.readFileSync(file, "utf8").replace(/^\uFEFF/, ""), { filename: file });
+}
+
+// 2D context that appends every call and property assignment to calls as text
+function createContext(calls, width, height) {
+    var target = { canvas: { width: width, height: height } };
+    return new Proxy(target, {
+        get: function (t, key) {
+            if (key in t)
+                return t[key];
+            return function () {
+                calls.push(key + "(" + Array.prototype.slice.call(arguments).map(String).join(", ") + ")");
+                return {
+                    addColorStop: function (stop, color) {
+                        calls.push("addColorStop(" + stop + ", " + color + ")");
+                    }
+                };
+            };
+        },
+        set: function (t, key, value) {
+            calls.push(key + " = " + value);
+            t[key] = value;
+            return true;
+        }
+    });
+}
+
+// 2D context that only counts the calls and property assignments by name, for
+// benchmarks where recording every call would cost more than the bridge
+function createCountingContext(counts, width, height) {
+    var target = { canvas: { width: width, height: height } };
+    var result = { addColorStop: function () {} };
+    return new Proxy(target, {
+        get: function (t, key) {
+            if (key in t)
+                return t[key];
+            return function () {
+                counts[key] = (counts[key] || 0) + 1;
+                return result;
+            };
+        },
+        set: function (t, key, value) {
+            counts[key] = (counts[key] || 0) + 1;
+            t[key] = value;
+            return true;
+        }
+    });
+}
+
+// Opcodes of the command buffer by name, from the JsOp enum of JsCanvas.h
+function loadOpcodes() {
+    var header = fs.readFileSync(path.join(__dirname, "..", "..", "CanvasExample", "JsCanvas.h"), "utf8");
+    var names = /enum class JsOp\s*\{([^}]*)\}/.exec(header)[1].split(",");
+    var op = {};
+    names.forEach(function (name, index) { op[name.trim()] = index; });
+    return op;
+}
+
+// Globals that the Emscripten runtime gives jscanvas.js, over a heap of size bytes
+function createHeap(size) {
+    var heap = new ArrayBuffer(size);
+    global.HEAPF64 = new Float64Array(heap);
+    global.HEAPU8 = new Uint8Array(heap);
+    global.UTF8ToString = function (ptr) {
+        var s = "";
+        while (HEAPU8[ptr])
+            s += String.fromCharCode(HEAPU8[ptr++]);
+        return s;
+    };
+}
+
+module.exports = { loadScript: loadScript, createContext: createContext, createCountingContext: createCountingContext,
+    loadOpcodes: loadOpcodes, createHeap: createHeap };
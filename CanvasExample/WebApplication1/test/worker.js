@@ -0,0 +1,90 @@
+// Runs jscanvas.js in a Node worker, where document does not exist, as
+// cppworker.js runs it in the browser. A stub OffscreenCanvas records the calls
+// of its context, and the worker draws a layer and composites it onto the
+// canvas that it received.
+//
+//     node test/worker.js
+var threads = require("worker_threads");
+var path = require("path");
+
+if (threads.isMainThread) {
+    var worker = new threads.Worker(__filename);
+    worker.on("message", function (calls) {
+        var expected = [
+            "off1.fillRect(0, 0, 10, 10)",
+            "page.drawImage(off1, 5, 5)",
+            "off1.width = 100",
+            "off2.fillRect(1, 2, 3, 4)"
+        ];
+        var failed = JSON.stringify(calls) != JSON.stringify(expected);
+        if (failed) {
+            console.log("expected " + JSON.stringify(expected));
+            console.log("got      " + JSON.stringify(calls));
+            process.exitCode = 1;
+        }
+        console.log(calls.length + " calls in the worker" + (failed ? ", FAILED" : ", ok"));
+    });
+    worker.on("error", function (e) {
+        console.log(e);
+        process.exitCode = 1;
+    });
+}
+else {
+    var mock = require("./mock_context.js");
+    var calls = [];
+    var count = 0;
+
+    // setting the size is recorded once the canvas is in use, as it clears the canvas
+    function OffscreenCanvas(width, height) {
+        this.id = "off" + count++;
+        this.size = width;
+        this.height = height;
+        this.context = null;
+    }
+    Object.defineProperty(OffscreenCanvas.prototype, "width", {
+        get: function () { return this.size; },
+        set: function (value) {
+            if (this.context != null)
+                calls.push(this.id + ".width = " + value);
+            this.size = value;
+        }
+    });
+    OffscreenCanvas.prototype.getContext = function () {
+        var canvas = this;
+        if (this.context == null) {
+            this.context = {
+                canvas: canvas,
+                fillRect: function (x, y, w, h) { calls.push(canvas.id + ".fillRect(" + [x, y, w, h].join(", ") + ")"); },
+                drawImage: function (src, x, y) { calls.push(canvas.id + ".drawImage(" + src.id + ", " + x + ", " + y + ")"); }
+            };
+        }
+        return this.context;
+    };
+    global.OffscreenCanvas = OffscreenCanvas;
+
+    var op = mock.loadOpcodes();
+    mock.createHeap(1 << 16);
+    mock.loadScript(path.join(__dirname, "..", "jscanvas.js"));
+
+    // what the page posts after transferControlToOffscreen
+    var page = new OffscreenCanvas(320, 280);
+    page.id = "page";
+    receive_canvases({ names: ["canvas"], canvases: [page] });
+    var canvas = add_canvas("canvas");
+
+    function run(args) {
+        HEAPF64.set(args, 0);
+        run_commands(0, args.length, 0);
+    }
+
+    // a layer drawn and composited, then released and reused at the same size
+    var layer = acquire_layer(100, 50);
+    run([op.select, layer, op.fill_rect, 0, 0, 10, 10, op.select, canvas, op.draw_canvas, layer, 2, 5, 5]);
+    run([op.release_layer, layer]);
+    var reused = acquire_layer(100, 50);
+    var other = acquire_layer(20, 20);
+    run([op.select, other, op.fill_rect, 1, 2, 3, 4]);
+    if (slots[reused].canvas.id != "off1")
+        calls.push("layer not reused: " + slots[reused].canvas.id);
+    threads.parentPort.postMessage(calls);
+}